@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "../core/malloc_hook.h"
+#include "../core/leptonet_malloc.h"
+
+// millions of small live buffers, like pending messages and socket buffers
+// build with MALLOC=libc, slab or nocookie to compare them
+#define BENCH_OBJECTS 2000000
+
+static size_t rss() {
+  long pages = 0, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f) {
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+      resident = 0;
+    }
+    fclose(f);
+  }
+  return (size_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_round(size_t lo, size_t hi) {
+  void **ptrs = malloc(sizeof(void*) * BENCH_OBJECTS);
+  uint32_t seed = 1;
+  size_t requested = 0;
+  size_t before = rss();
+  uint64_t begin = now_ns();
+  for (int i = 0; i < BENCH_OBJECTS; i ++) {
+    seed = seed * 1103515245 + 12345;
+    size_t sz = lo + (seed >> 8) % (hi - lo + 1);
+    requested += sz;
+    ptrs[i] = leptonet_malloc(sz);
+    *(volatile char*)ptrs[i] = 0;
+  }
+  uint64_t elapsed = now_ns() - begin;
+  size_t used = rss() - before;
+  printf("%4zu-%4zuB: requested %7.2f MB, rss %7.2f MB, %5.1f bytes/object, overhead %5.1f%%, accounted %7.2f MB, %6.2f ns/alloc\n",
+         lo, hi, requested / 1048576.0, used / 1048576.0, (double)used / BENCH_OBJECTS,
+         (used - (double)requested) * 100 / requested, leptonet_memory_usage() / 1048576.0,
+         (double)elapsed / BENCH_OBJECTS);
+  fflush(stdout);
+  for (int i = 0; i < BENCH_OBJECTS; i ++) {
+    leptonet_free(ptrs[i]);
+  }
+  free(ptrs);
+}
+
+int main() {
+  size_t ranges[][2] = {{16, 64}, {32, 32}, {64, 256}, {256, 1024}};
+  // each round runs in a fresh process, so that memory freed by last round doesn't hide rss
+  for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i ++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      bench_round(ranges[i][0], ranges[i][1]);
+      _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+  }
+  return 0;
+}
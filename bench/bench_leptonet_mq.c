@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "../core/leptonet_mq.h"
+#include "../core/atomic.h"
+
+// total messages pushed in each round, shared by all producers
+#define BENCH_MESSAGES 2000000
+#define BENCH_MAX_PRODUCER 32
+
+struct bench_arg {
+  struct message_queue *mq;
+  int count;
+  ATOMIC_INT *start;
+};
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void* producer(void *arg) {
+  struct bench_arg *b = arg;
+  while (!ATOMIC_LOAD(b->start)) {}
+  struct leptonet_message msg = {.type = 0, .sission = 0, .data = NULL, .sz = 0};
+  for (int i = 0; i < b->count; i ++) {
+    msg.sission = i;
+    leptonet_mq_push(b->mq, &msg);
+  }
+  return NULL;
+}
+
+// all producers push into one mailbox, main thread works as the owning worker
+static void bench_round(int nproducer) {
+  struct message_queue *mq = leptonet_mq_create(1);
+  pthread_t threads[BENCH_MAX_PRODUCER];
+  struct bench_arg args[BENCH_MAX_PRODUCER];
+  ATOMIC_INT start = 0;
+  int per = BENCH_MESSAGES / nproducer;
+  int total = per * nproducer;
+  for (int i = 0; i < nproducer; i ++) {
+    args[i].mq = mq;
+    args[i].count = per;
+    args[i].start = &start;
+    pthread_create(&threads[i], NULL, producer, &args[i]);
+  }
+
+  uint64_t begin = now_ns();
+  ATOMIC_STORE(&start, 1);
+  int consumed = 0;
+  while (consumed < total) {
+    struct message_queue *q;
+    if (!leptonet_globalmq_pop(&q)) {
+      sched_yield();
+      continue;
+    }
+    struct leptonet_message msg;
+    while (leptonet_mq_pop(q, &msg)) {
+      consumed++;
+    }
+  }
+  uint64_t elapsed = now_ns() - begin;
+
+  for (int i = 0; i < nproducer; i ++) {
+    pthread_join(threads[i], NULL);
+  }
+  leptonet_mq_release(mq, NULL, NULL);
+
+  printf("producers: %2d, messages: %d, elapsed: %8.2f ms, throughput: %7.2f Mmsg/s\n",
+         nproducer, total, elapsed / 1e6, total * 1e3 / elapsed);
+  fflush(stdout);
+}
+
+int main() {
+  leptonet_global_message_queue_init();
+  for (int n = 1; n <= BENCH_MAX_PRODUCER; n *= 2) {
+    bench_round(n);
+  }
+  leptonet_global_message_queue_release();
+  return 0;
+}
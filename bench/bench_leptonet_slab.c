@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "../core/leptonet_slab.h"
+#include "../core/atomic.h"
+
+// message sized workloads, compare slab with libc malloc
+#define BENCH_OPS 4000000
+#define BENCH_LIVE 256
+#define RING_SIZE 1024
+
+typedef void* (*alloc_func)(size_t);
+typedef void (*free_func)(void*);
+
+struct allocator {
+  const char *name;
+  alloc_func alloc;
+  free_func free;
+};
+
+static struct allocator allocators[] = {
+  {"libc", malloc, free},
+  {"slab", leptonet_slab_alloc, leptonet_slab_free},
+};
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// size in [lo, hi], fixed sequence so both allocators see the same workload
+static inline size_t bench_size(uint32_t *seed, size_t lo, size_t hi) {
+  *seed = *seed * 1103515245 + 12345;
+  return lo + (*seed >> 8) % (hi - lo + 1);
+}
+
+// alloc and free on one thread, keep BENCH_LIVE objects alive like a mailbox backlog
+static void bench_same_thread(struct allocator *a, size_t lo, size_t hi) {
+  void *live[BENCH_LIVE];
+  memset(live, 0, sizeof live);
+  uint32_t seed = 1;
+  uint64_t begin = now_ns();
+  for (int i = 0; i < BENCH_OPS; i ++) {
+    int idx = i % BENCH_LIVE;
+    if (live[idx]) {
+      a->free(live[idx]);
+    }
+    size_t sz = bench_size(&seed, lo, hi);
+    live[idx] = a->alloc(sz);
+    // touch it like a payload copy
+    *(volatile char*)live[idx] = 0;
+  }
+  for (int i = 0; i < BENCH_LIVE; i ++) {
+    a->free(live[i]);
+  }
+  uint64_t elapsed = now_ns() - begin;
+  printf("%s same-thread  %4zu-%4zuB: %8.2f ms, %7.2f ns/op\n",
+         a->name, lo, hi, elapsed / 1e6, (double)elapsed / BENCH_OPS);
+  fflush(stdout);
+}
+
+struct ring {
+  void *volatile slot[RING_SIZE];
+  ATOMIC_UINT head;
+  ATOMIC_UINT tail;
+  struct allocator *a;
+};
+
+static void* consumer(void *ud) {
+  struct ring *r = ud;
+  for (int i = 0; i < BENCH_OPS; i ++) {
+    while (ATOMIC_LOAD_ACQ(&r->head) == r->tail) {
+      sched_yield();
+    }
+    r->a->free(r->slot[r->tail % RING_SIZE]);
+    ATOMIC_STORE_REL(&r->tail, r->tail + 1);
+  }
+  return NULL;
+}
+
+// alloc on one thread, free on another, like socket buffers
+static void bench_cross_thread(struct allocator *a, size_t lo, size_t hi) {
+  static struct ring r;
+  memset(&r, 0, sizeof r);
+  r.a = a;
+  uint32_t seed = 1;
+  pthread_t pid;
+  uint64_t begin = now_ns();
+  pthread_create(&pid, NULL, consumer, &r);
+  for (int i = 0; i < BENCH_OPS; i ++) {
+    while (r.head - ATOMIC_LOAD_ACQ(&r.tail) == RING_SIZE) {
+      sched_yield();
+    }
+    void *p = a->alloc(bench_size(&seed, lo, hi));
+    *(volatile char*)p = 0;
+    r.slot[r.head % RING_SIZE] = p;
+    ATOMIC_STORE_REL(&r.head, r.head + 1);
+  }
+  pthread_join(pid, NULL);
+  uint64_t elapsed = now_ns() - begin;
+  printf("%s cross-thread %4zu-%4zuB: %8.2f ms, %7.2f ns/op\n",
+         a->name, lo, hi, elapsed / 1e6, (double)elapsed / BENCH_OPS);
+  fflush(stdout);
+}
+
+int main() {
+  size_t ranges[][2] = {{64, 64}, {64, 512}, {512, 4096}, {4096, 4096}};
+  int nrange = sizeof(ranges) / sizeof(ranges[0]);
+  int nalloc = sizeof(allocators) / sizeof(allocators[0]);
+  for (int i = 0; i < nrange; i ++) {
+    for (int j = 0; j < nalloc; j ++) {
+      bench_same_thread(&allocators[j], ranges[i][0], ranges[i][1]);
+    }
+  }
+  for (int i = 0; i < nrange; i ++) {
+    for (int j = 0; j < nalloc; j ++) {
+      bench_cross_thread(&allocators[j], ranges[i][0], ranges[i][1]);
+    }
+  }
+  return 0;
+}
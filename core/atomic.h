@@ -5,6 +5,7 @@
 #include <stdint.h>
 
 #define ATOMIC_INT volatile int
+#define ATOMIC_UINT volatile unsigned int
 #define ATOMIC_PTR volatile uintptr_t
 #define ATOMIC_LL volatile long long
 #define ATOMIC_ULL volatile unsigned long long
@@ -14,6 +15,8 @@
 #define ATOMIC_INIT(ptr, val) (*ptr = (val))
 #define ATOMIC_LOAD(ptr) (*ptr)
 #define ATOMIC_STORE(ptr, val) (*ptr = val)
+#define ATOMIC_LOAD_ACQ(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE_REL(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
 #define ATOMIC_INC(ptr) __sync_add_and_fetch(ptr, 1)
 #define ATOMIC_DEC(ptr) __sync_sub_and_fetch(ptr, 1)
 #define ATOMIC_ADD(ptr, val) __sync_add_and_fetch(ptr, val)
@@ -23,5 +26,8 @@
 #define ATOMIC_XOR(ptr, val) __sync_xor_and_fetch(ptr, val)
 
 #define ATOMIC_CAS(ptr, oval, nval) __sync_bool_compare_and_swap(ptr, oval, nval)
+// return the old value and set the new value, full barrier
+#define ATOMIC_XCHG(ptr, val) __atomic_exchange_n(ptr, val, __ATOMIC_SEQ_CST)
+#define ATOMIC_BARRIER() __sync_synchronize()
 
 #endif
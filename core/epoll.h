@@ -8,12 +8,24 @@
 #include <stddef.h>
 #include <unistd.h>
 
+// kind of event, epoll only reports readiness, others are completions of io_uring, see uring.h
+#define EVENT_READY 0
+// res is received bytes, 0 for eof, or -errno, data is received bytes
+#define EVENT_RECV 1
+// res is accepted fd, or -errno
+#define EVENT_ACCEPT 2
+// res is sent bytes, or -errno, data is token of the send, socket is NULL
+#define EVENT_SEND 3
+
 struct event {
   void *socket;   // socket pointer
   bool read;      // read event
   bool write;     // write event
   bool error;     // error event
   bool eof;       // eof event
+  int kind;       // EVENT_READY or a completion
+  int res;        // result of completion
+  void *data;     // data of completion
 };
 
 static inline int epinit() {
@@ -28,36 +40,28 @@ static inline int epvalid(int epfd) {
   return epfd >= 0;
 }
 
+// edge triggered, fd is registered once for both directions, so that there is no EPOLL_CTL_MOD afterwards
+// user must read until EAGAIN, and try to write before waiting for EPOLLOUT
 static inline int epregist(int epfd, int fd, void *ptr) {
-  struct epoll_event e;  
-  e.events = EPOLLIN;
-  e.data.ptr = ptr;
-  return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &e);
-}
-
-static inline int epread(int epfd, int fd, void *ptr, bool read) {
   struct epoll_event e;
-  e.events = read ? EPOLLIN : 0;
+  e.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
   e.data.ptr = ptr;
-  return epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &e);
-}
-
-static inline int epwrite(int epfd, int fd, void *ptr, bool write) {
-  struct epoll_event e;
-  e.events = write ? EPOLLOUT : 0;
-  e.data.ptr = ptr;
-  return epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &e);
+  return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &e);
 }
 
-static inline int epwait(int epfd, struct event *evs, int maxevents) {
+// timeout in milliseconds, -1 blocks until any event
+static inline int epwait(int epfd, struct event *evs, int maxevents, int timeout) {
   struct epoll_event events[maxevents];
-  int cnt = epoll_wait(epfd, events, maxevents, 0);
+  int cnt = epoll_wait(epfd, events, maxevents, timeout);
   for (int i = 0; i < cnt; i ++) {
     evs[i].read = (events[i].events & EPOLLIN);
     evs[i].write = (events[i].events & EPOLLOUT);
     evs[i].error = (events[i].events & EPOLLERR);
-    evs[i].eof = (events[i].events & EPOLLHUP);
+    evs[i].eof = (events[i].events & (EPOLLHUP | EPOLLRDHUP));
     evs[i].socket = events[i].data.ptr;
+    evs[i].kind = EVENT_READY;
+    evs[i].res = 0;
+    evs[i].data = NULL;
   }
   return cnt;
 }
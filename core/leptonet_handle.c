@@ -0,0 +1,279 @@
+#include <string.h>
+#include <assert.h>
+
+#include "leptonet_handle.h"
+#include "leptonet_malloc.h"
+#include "spinlock.h"
+#include "rwlock.h"
+#include "atomic.h"
+
+#define CACHELINE_SIZE 64
+
+#define DEFAULT_SLOT_SIZE 4
+#define MAX_SLOT_SIZE 0x40000000
+
+#define DEFAULT_NAME_SIZE 16
+
+// handle is placed at slot (handle & mask), so a query is one slot access without probing
+// when there is no free slot, a table of double size is published, readers never wait for it
+struct handle_slot {
+  ATOMIC_UINT handle;                     // 0 for empty slot
+  struct leptonet_context *volatile ctx;
+};
+
+struct handle_table {
+  uint32_t mask;
+  struct handle_table *retired;           // older table, readers may still use it, freed on release
+  struct handle_slot slot[];
+};
+
+struct handle_name {
+  char *name;                             // NULL for empty entry
+  uint32_t handle;                        // 0 for deleted entry
+  uint32_t hash;
+};
+
+struct handle_storage {
+  // read by every query, only written when table grows
+  struct handle_table *volatile table;
+  char pad[CACHELINE_SIZE - sizeof(struct handle_table*)];
+
+  struct spinlock lock;                   // for writers
+  uint32_t handle_index;                  // next handle to try
+
+  // name index, open addressing with linear probing
+  struct rwlock namelock;
+  int name_cap;
+  int name_used;                          // live and deleted entries
+  struct handle_name *names;
+};
+
+static struct handle_storage *H = NULL;
+
+static struct handle_table* table_create(uint32_t size) {
+  struct handle_table *t = leptonet_malloc(sizeof(*t) + sizeof(struct handle_slot) * size);
+  memset(t, 0, sizeof(*t) + sizeof(struct handle_slot) * size);
+  t->mask = size - 1;
+  return t;
+}
+
+void leptonet_handle_init() {
+  struct handle_storage *h = leptonet_malloc(sizeof *h);
+  memset(h, 0, sizeof *h);
+  h->table = table_create(DEFAULT_SLOT_SIZE);
+  spinlock_init(&h->lock);
+  h->handle_index = 1;
+  rwlock_init(&h->namelock);
+  h->name_cap = DEFAULT_NAME_SIZE;
+  h->names = leptonet_malloc(sizeof(struct handle_name) * h->name_cap);
+  memset(h->names, 0, sizeof(struct handle_name) * h->name_cap);
+  H = h;
+}
+
+void leptonet_handle_release() {
+  struct handle_table *t = H->table;
+  while (t) {
+    struct handle_table *retired = t->retired;
+    leptonet_free(t);
+    t = retired;
+  }
+  for (int i = 0; i < H->name_cap; i ++) {
+    if (H->names[i].name) {
+      leptonet_free(H->names[i].name);
+    }
+  }
+  leptonet_free(H->names);
+  spinlock_destroy(&H->lock);
+  leptonet_free(H);
+  H = NULL;
+}
+
+// handles are unique in old table, so they are still unique under a wider mask
+static void table_grow(struct handle_storage *h) {
+  struct handle_table *old = h->table;
+  uint32_t size = (old->mask + 1) * 2;
+  assert(size <= MAX_SLOT_SIZE);
+  struct handle_table *t = table_create(size);
+  for (uint32_t i = 0; i <= old->mask; i ++) {
+    struct handle_slot *s = &old->slot[i];
+    if (s->handle) {
+      struct handle_slot *ns = &t->slot[s->handle & t->mask];
+      ns->handle = s->handle;
+      ns->ctx = s->ctx;
+    }
+  }
+  t->retired = old;
+  // slots must be visible before the table
+  ATOMIC_STORE_REL(&h->table, t);
+}
+
+uint32_t leptonet_handle_register(struct leptonet_context *ctx) {
+  struct handle_storage *h = H;
+  spinlock_lock(&h->lock);
+  for (;;) {
+    struct handle_table *t = h->table;
+    uint32_t handle = h->handle_index;
+    for (uint32_t i = 0; i <= t->mask; i ++, handle ++) {
+      if (handle == 0) {
+        // 0 is reserved for system
+        handle = 1;
+      }
+      struct handle_slot *s = &t->slot[handle & t->mask];
+      if (s->handle == 0) {
+        s->ctx = ctx;
+        ATOMIC_STORE_REL(&s->handle, handle);
+        h->handle_index = handle + 1;
+        spinlock_unlock(&h->lock);
+        return handle;
+      }
+    }
+    table_grow(h);
+  }
+}
+
+static void name_remove(struct handle_storage *h, uint32_t handle) {
+  rwlock_wlock(&h->namelock);
+  for (int i = 0; i < h->name_cap; i ++) {
+    struct handle_name *n = &h->names[i];
+    if (n->name && n->handle == handle) {
+      // keep name as a tombstone, so that probing goes on
+      n->handle = 0;
+    }
+  }
+  rwlock_wunlock(&h->namelock);
+}
+
+int leptonet_handle_retire(uint32_t handle) {
+  struct handle_storage *h = H;
+  int r = 0;
+  spinlock_lock(&h->lock);
+  // clear retired tables too, so that a reader holding an old table won't find it
+  for (struct handle_table *t = h->table; t; t = t->retired) {
+    struct handle_slot *s = &t->slot[handle & t->mask];
+    if (handle != 0 && s->handle == handle) {
+      ATOMIC_STORE_REL(&s->handle, 0);
+      s->ctx = NULL;
+      r = 1;
+    }
+  }
+  spinlock_unlock(&h->lock);
+  if (r) {
+    name_remove(h, handle);
+  }
+  return r;
+}
+
+struct leptonet_context* leptonet_handle_query(uint32_t handle) {
+  struct handle_table *t = ATOMIC_LOAD_ACQ(&H->table);
+  struct handle_slot *s = &t->slot[handle & t->mask];
+  if (handle == 0 || ATOMIC_LOAD_ACQ(&s->handle) != handle) {
+    return NULL;
+  }
+  struct leptonet_context *ctx = ATOMIC_LOAD_ACQ(&s->ctx);
+  // slot may be reused by another handle between two loads
+  if (ATOMIC_LOAD_ACQ(&s->handle) != handle) {
+    return NULL;
+  }
+  return ctx;
+}
+
+// FNV-1a
+static inline uint32_t name_hash(const char *name) {
+  uint32_t hash = 2166136261u;
+  for (const unsigned char *p = (const unsigned char*)name; *p; p ++) {
+    hash ^= *p;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// return the entry of name, or NULL
+static struct handle_name* name_find(struct handle_storage *h, const char *name, uint32_t hash) {
+  int mask = h->name_cap - 1;
+  for (int i = 0; i < h->name_cap; i ++) {
+    struct handle_name *n = &h->names[(hash + i) & mask];
+    if (n->name == NULL) {
+      return NULL;
+    }
+    if (n->handle && n->hash == hash && strcmp(n->name, name) == 0) {
+      return n;
+    }
+  }
+  return NULL;
+}
+
+static void name_insert(struct handle_storage *h, char *name, uint32_t hash, uint32_t handle) {
+  int mask = h->name_cap - 1;
+  for (int i = 0; i < h->name_cap; i ++) {
+    struct handle_name *n = &h->names[(hash + i) & mask];
+    if (n->name == NULL) {
+      n->name = name;
+      n->hash = hash;
+      n->handle = handle;
+      h->name_used++;
+      return;
+    }
+  }
+  assert(0);
+}
+
+// tombstones are dropped while rehashing
+static void name_grow(struct handle_storage *h) {
+  struct handle_name *old = h->names;
+  int old_cap = h->name_cap;
+  int live = 0;
+  for (int i = 0; i < old_cap; i ++) {
+    if (old[i].name && old[i].handle) {
+      live++;
+    }
+  }
+  int cap = old_cap;
+  while (live * 2 >= cap) {
+    cap *= 2;
+  }
+  h->names = leptonet_malloc(sizeof(struct handle_name) * cap);
+  memset(h->names, 0, sizeof(struct handle_name) * cap);
+  h->name_cap = cap;
+  h->name_used = 0;
+  for (int i = 0; i < old_cap; i ++) {
+    struct handle_name *n = &old[i];
+    if (n->name == NULL) {
+      continue;
+    }
+    if (n->handle) {
+      name_insert(h, n->name, n->hash, n->handle);
+    } else {
+      leptonet_free(n->name);
+    }
+  }
+  leptonet_free(old);
+}
+
+uint32_t leptonet_handle_findname(const char *name) {
+  struct handle_storage *h = H;
+  uint32_t hash = name_hash(name);
+  uint32_t handle = 0;
+  rwlock_rlock(&h->namelock);
+  struct handle_name *n = name_find(h, name, hash);
+  if (n) {
+    handle = n->handle;
+  }
+  rwlock_runlock(&h->namelock);
+  return handle;
+}
+
+const char* leptonet_handle_namehandle(uint32_t handle, const char *name) {
+  struct handle_storage *h = H;
+  uint32_t hash = name_hash(name);
+  char *result = NULL;
+  rwlock_wlock(&h->namelock);
+  if (name_find(h, name, hash) == NULL) {
+    if ((h->name_used + 1) * 4 >= h->name_cap * 3) {
+      name_grow(h);
+    }
+    result = leptonet_strdup(name);
+    name_insert(h, result, hash, handle);
+  }
+  rwlock_wunlock(&h->namelock);
+  return result;
+}
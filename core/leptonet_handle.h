@@ -0,0 +1,25 @@
+#ifndef __LEPTONET_HANDLE_H__
+#define __LEPTONET_HANDLE_H__
+
+#include <stdint.h>
+
+#include "leptonet_server.h"
+
+void leptonet_handle_init();
+void leptonet_handle_release();
+
+// return a new handle, never 0
+uint32_t leptonet_handle_register(struct leptonet_context *ctx);
+// return 1 if handle is retired by this call, names of handle are removed too
+int leptonet_handle_retire(uint32_t handle);
+
+// lock-free and write-free, return NULL if handle is not registered
+// a retired context may still be returned to a query running concurrently, so its memory must outlive it
+struct leptonet_context* leptonet_handle_query(uint32_t handle);
+
+// return 0 if name is not found
+uint32_t leptonet_handle_findname(const char *name);
+// bind name to handle, return the stored name, or NULL if name is already used
+const char* leptonet_handle_namehandle(uint32_t handle, const char *name);
+
+#endif
@@ -21,8 +21,11 @@ static struct modules *M = NULL;
 // TODO: temporary placed here
 void* leptonet_strdup(const char *str) {
   int len = strlen(str);
-  char * s = leptonet_malloc(len);
-  memcpy(s, str, len);
+  char * s = leptonet_malloc(len + 1);
+  if (s == NULL) {
+    return NULL;
+  }
+  memcpy(s, str, len + 1);
   return s;
 }
 
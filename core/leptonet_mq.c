@@ -1,45 +1,79 @@
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
 
 #include "leptonet_mq.h"
 #include "leptonet_malloc.h"
 #include "spinlock.h"
+#include "atomic.h"
 
 #define UNINGLOBAL 0
 #define INGLOBAL 1
 
-#define DEFAULT_MQ_SIZE 1024
+#define CACHELINE_SIZE 64
 
+#define DEFAULT_MQ_OVERLOAD_HIGH 1024
+#define DEFAULT_MQ_OVERLOAD_LOW 256
+
+// overload event is packed as (length << 32 | state) so that it can be posted and taken atomically
+#define MQ_EVENT_NONE 0
+#define MQ_EVENT_OVERLOAD 1
+#define MQ_EVENT_RECOVER 2
+
+// allocated by producer, released by consumer
+struct mq_node {
+  struct mq_node *volatile next;
+  struct leptonet_message msg;
+};
+
+// multi-producer/single-consumer mailbox
+// producers swap their node into tail and then link it to the previous one, which is lock-free
+// the owning worker follows next from head without any atomic operation, which is wait-free
+// head always points to a dummy node whose message has already been consumed
 struct message_queue {
-  int head;
-  int tail;
-  int capacity;
-  int in_global;      // indicate whether this mq is in global mq
-  int32_t handle;     // indicate which context this mq belongs to
-  struct message_queue *next;
-  struct leptonet_message *msg;
-  // TODO: we may add a fileds to indicate whether this queue has too many messages
+  // written by producers
+  struct mq_node *volatile tail;
+  ATOMIC_INT length;
+  int high;                  // overload when length reaches it, INT_MAX means never
+  int low;                   // recover when length drops to it
+  ATOMIC_INT overload;       // set between crossing high and dropping to low, senders should back off
+  char pad[CACHELINE_SIZE - sizeof(struct mq_node*) - sizeof(int) * 4];
+  // written by consumer
+  struct mq_node *head;
+  ATOMIC_INT in_global;      // indicate whether this mq is in global mq or owned by a worker
+  uint32_t handle;           // indicate which context this mq belongs to
+  struct message_queue *volatile next;
+  ATOMIC_ULL event;          // last overload event, taken by owner
 };
 
+// intrusive multi-producer queue linked by message_queue.next (Vyukov's MPSC queue)
+// producers swap themselves into tail without lock, then link the previous one
+// consumers are serialized by a spinlock on the head side, which producers never touch
+// and since only one consumer follows next at a time, there is no ABA or use-after-free hazard
+// pop holds the lock for a few loads and stores, and a contended pop waits for it instead of reporting empty
 struct global_message_queue {
+  struct message_queue *volatile tail;
+  char pad[CACHELINE_SIZE - sizeof(struct message_queue*)];
   struct message_queue *head;
-  struct message_queue *tail;
   struct spinlock lock;
+  struct message_queue stub;
 };
 
 static struct global_message_queue *Q;
 
 void leptonet_global_message_queue_init() {
-  struct global_message_queue *q = leptonet_malloc(sizeof *q); 
+  struct global_message_queue *q = leptonet_malloc(sizeof *q);
+  memset(q, 0, sizeof *q);
   spinlock_init(&q->lock);
-  q->head = q->tail = NULL;
+  q->stub.next = NULL;
+  q->head = q->tail = &q->stub;
   Q = q;
 }
 
 void leptonet_global_message_queue_release() {
   struct message_queue *mq;
-  struct leptonet_message msg;
-  while(leptonet_globalmq_pop(mq)) {
+  while(leptonet_globalmq_pop(&mq)) {
+    mq->in_global = UNINGLOBAL;
     leptonet_mq_release(mq, NULL, NULL);
   }
   leptonet_free(Q);
@@ -47,104 +81,245 @@ void leptonet_global_message_queue_release() {
 
 struct message_queue* leptonet_mq_create(uint32_t handle) {
   struct message_queue *q = leptonet_malloc(sizeof *q);
+  struct mq_node *stub = leptonet_malloc(sizeof *stub);
+  stub->next = NULL;
+  q->head = q->tail = stub;
+  q->length = 0;
+  q->high = DEFAULT_MQ_OVERLOAD_HIGH;
+  q->low = DEFAULT_MQ_OVERLOAD_LOW;
+  q->overload = 0;
+  q->event = MQ_EVENT_NONE;
   q->handle = handle;
-  q->head = q->tail = 0;
-  q->capacity = DEFAULT_MQ_SIZE;
   q->in_global = UNINGLOBAL;
   q->next = NULL;
-  q->msg = leptonet_malloc(sizeof(struct leptonet_message) * q->capacity);
   return q;
 }
 
+static inline void mq_post_event(struct message_queue *mq, int length, int state) {
+  ATOMIC_STORE(&mq->event, (unsigned long long)length << 32 | state);
+}
+
+// only the owner of mq can call it
+static int mq_dequeue(struct message_queue *mq, struct leptonet_message *msgs, int max) {
+  struct mq_node *head = mq->head;
+  int n = 0;
+  while (n < max) {
+    struct mq_node *next = head->next;
+    if (next == NULL) {
+      break;
+    }
+    msgs[n++] = next->msg;
+    leptonet_free(head);
+    head = next;
+  }
+  if (n > 0) {
+    mq->head = head;
+    int length = ATOMIC_SUB(&mq->length, n);
+    if (length <= mq->low && ATOMIC_LOAD(&mq->overload) && ATOMIC_CAS(&mq->overload, 1, 0)) {
+      mq_post_event(mq, length, MQ_EVENT_RECOVER);
+    }
+  }
+  return n;
+}
+
 void leptonet_mq_release(struct message_queue *mq, message_drop drop, void * ud) {
   assert(mq->in_global == UNINGLOBAL);
   struct leptonet_message msg;
-  while (leptonet_mq_pop(mq, &msg)) {
+  while (mq_dequeue(mq, &msg, 1)) {
     if (drop != NULL) {
       drop(&msg, ud);
     }
   }
+  leptonet_free(mq->head);
+  leptonet_free(mq);
 }
 
 int leptonet_mq_length(struct message_queue *mq) {
-  int len = (mq->tail - mq->head + mq->capacity) % mq->capacity;
-  return len;
+  return ATOMIC_LOAD(&mq->length);
+}
+
+uint32_t leptonet_mq_handle(struct message_queue *mq) {
+  return mq->handle;
 }
 
-static void extend_mq(struct message_queue *mq) {
-  struct leptonet_message *newmsg = leptonet_malloc(mq->capacity * 2);
-  // we cannot directly use memcpy to move memory content
-  for (int i = 0; i < mq->capacity; i ++) {
-    newmsg[i] = mq->msg[(mq->head + i) % mq->capacity];
+void leptonet_mq_watermark(struct message_queue *mq, int high, int low) {
+  if (high <= 0) {
+    high = INT_MAX;
   }
-  mq->head = 0;
-  mq->tail = mq->capacity;
-  mq->capacity *= 2;
-  leptonet_free(mq->msg);
-  mq->msg = newmsg;
+  assert(low < high);
+  mq->low = low;
+  ATOMIC_STORE(&mq->high, high);
 }
 
-void leptonet_mq_push(struct message_queue *mq, struct leptonet_message *msg) {
-  mq->msg[mq->tail++] = *msg;;
+int leptonet_mq_overload(struct message_queue *mq) {
+  return ATOMIC_LOAD(&mq->overload);
+}
 
-  if (mq->tail == mq->capacity) {
-    mq->tail = 0;
+int leptonet_mq_overload_event(struct message_queue *mq, struct leptonet_mq_overload *ev) {
+  if (ATOMIC_LOAD(&mq->event) == MQ_EVENT_NONE) {
+    return 0;
+  }
+  unsigned long long event = ATOMIC_XCHG(&mq->event, MQ_EVENT_NONE);
+  if (event == MQ_EVENT_NONE) {
+    return 0;
   }
-  
-  if (mq->tail == mq->head) {
-    extend_mq(mq);
+  ev->handle = mq->handle;
+  ev->length = (int)(event >> 32);
+  ev->overload = (event & 0xffffffff) == MQ_EVENT_OVERLOAD;
+  return 1;
+}
+
+// link a chain of nodes [first, last] into mq with a single swap
+static inline void mq_enqueue(struct message_queue *mq, struct mq_node *first, struct mq_node *last, int n) {
+  last->next = NULL;
+  int length = ATOMIC_ADD(&mq->length, n);
+  // only the producer which crosses high mark posts the event
+  if (length >= mq->high && !ATOMIC_LOAD(&mq->overload) && ATOMIC_CAS(&mq->overload, 0, 1)) {
+    mq_post_event(mq, length, MQ_EVENT_OVERLOAD);
   }
-  // if this mq has message, we should push it into global mq
-  spinlock_lock(&Q->lock);
-  if (mq->in_global == UNINGLOBAL) {
+  struct mq_node *prev = ATOMIC_XCHG(&mq->tail, last);
+  // consumer can't see the chain until we link it
+  prev->next = first;
+  // the first producer which find an idle mq should push it into global mq
+  if (ATOMIC_LOAD(&mq->in_global) == UNINGLOBAL && ATOMIC_CAS(&mq->in_global, UNINGLOBAL, INGLOBAL)) {
     leptonet_globalmq_push(mq);
-    mq->in_global = INGLOBAL;
   }
-  spinlock_unlock(&Q->lock);
 }
 
+int leptonet_mq_push(struct message_queue *mq, struct leptonet_message *msg) {
+  struct mq_node *node = leptonet_malloc(sizeof *node);
+  if (node == NULL) {
+    // sender is over its hard memory limit
+    return -1;
+  }
+  node->msg = *msg;
+  mq_enqueue(mq, node, node, 1);
+  return 0;
+}
+
+int leptonet_mq_push_batch(struct message_queue *mq, struct leptonet_message *msgs, int n) {
+  if (n <= 0) {
+    return 0;
+  }
+  struct mq_node *first = leptonet_malloc(sizeof *first);
+  if (first == NULL) {
+    return -1;
+  }
+  struct mq_node *last = first;
+  first->msg = msgs[0];
+  for (int i = 1; i < n; i ++) {
+    struct mq_node *node = leptonet_malloc(sizeof *node);
+    if (node == NULL) {
+      // all or nothing, so that order isn't broken by a partial batch
+      last->next = NULL;
+      while (first) {
+        struct mq_node *next = first->next;
+        leptonet_free(first);
+        first = next;
+      }
+      return -1;
+    }
+    node->msg = msgs[i];
+    last->next = node;
+    last = node;
+  }
+  mq_enqueue(mq, first, last, n);
+  return 0;
+}
+
+int leptonet_mq_trypush(struct message_queue *mq, struct leptonet_message *msg) {
+  if (ATOMIC_LOAD(&mq->overload)) {
+    return -1;
+  }
+  return leptonet_mq_push(mq, msg);
+}
+
+// return 1, caller still owns mq and should push it back into global mq when it's done
+// return 0, mq has been handed back to producers (or global mq), caller must not touch it any more
 int leptonet_mq_pop(struct message_queue *mq, struct leptonet_message *msg) {
-  assert(mq->head <= mq->tail);
-  if (mq->head == mq->tail) {
-    // a empty queue cannot be in global mq
-    mq->in_global = UNINGLOBAL;
+  return leptonet_mq_pop_batch(mq, msg, 1);
+}
+
+int leptonet_mq_pop_batch(struct message_queue *mq, struct leptonet_message *msgs, int max) {
+  int n = mq_dequeue(mq, msgs, max);
+  if (n > 0) {
+    return n;
+  }
+  // a empty queue cannot be in global mq
+  ATOMIC_CAS(&mq->in_global, INGLOBAL, UNINGLOBAL);
+  if (mq->head == ATOMIC_LOAD(&mq->tail)) {
     return 0;
   }
-  *msg = mq->msg[mq->head++];
-  if (mq->head == mq->capacity) {
-    mq->head = 0;
+  // a producer has swapped tail before we release it, it may see INGLOBAL and skip scheduling
+  if (ATOMIC_CAS(&mq->in_global, UNINGLOBAL, INGLOBAL)) {
+    n = mq_dequeue(mq, msgs, max);
+    if (n > 0) {
+      return n;
+    }
+    // the producer hasn't linked its node yet, let other worker handle it later instead of waiting
+    leptonet_globalmq_push(mq);
   }
-  return 1;
+  return 0;
+}
+
+static inline void globalmq_link(struct message_queue *mq) {
+  mq->next = NULL;
+  struct message_queue *prev = ATOMIC_XCHG(&Q->tail, mq);
+  prev->next = mq;
 }
 
 void leptonet_globalmq_push(struct message_queue *mq) {
-  spinlock_lock(&Q->lock);
-  if (Q->head == NULL) {
-    assert(Q->tail == NULL);
-    Q->head = Q->tail = mq;
-    mq->next = NULL;
-  } else {
-    assert(Q->tail);
-    mq->next = Q->tail->next;
-    Q->tail = mq;
+  globalmq_link(mq);
+}
+
+// return -1 if a producer has swapped tail but not linked yet, so it's not empty
+static int globalmq_take(struct message_queue **mq) {
+  struct message_queue *head = Q->head;
+  struct message_queue *next = head->next;
+  if (head == &Q->stub) {
+    if (next == NULL) {
+      // empty, unless a producer is linking after stub
+      return head == ATOMIC_LOAD(&Q->tail) ? 0 : -1;
+    }
+    // skip stub
+    Q->head = next;
+    head = next;
+    next = next->next;
   }
-  spinlock_unlock(&Q->lock);
+  if (next) {
+    Q->head = next;
+    *mq = head;
+    return 1;
+  }
+  if (head != ATOMIC_LOAD(&Q->tail)) {
+    // a producer has swapped tail but not linked yet
+    return -1;
+  }
+  // head is the last one, put stub back so that head can be detached
+  globalmq_link(&Q->stub);
+  next = head->next;
+  if (next) {
+    Q->head = next;
+    *mq = head;
+    return 1;
+  }
+  // a producer swapped tail before the stub
+  return -1;
 }
 
 int leptonet_globalmq_pop(struct message_queue **mq) {
-  spinlock_lock(&Q->lock);
-  if (Q->head == NULL) {
-    assert(Q->tail == NULL);
+  for (;;) {
+    spinlock_lock(&Q->lock);
+    int r = globalmq_take(mq);
     spinlock_unlock(&Q->lock);
-    return 0;
-  } else {
-    assert(Q->tail == NULL);
-    *mq = Q->head;
-    Q->head = Q->head->next;
-    if (Q->head == NULL) {
-      Q->tail = NULL;
+    // retry without lock, so that other consumers aren't blocked by an unlinked producer
+    if (r >= 0) {
+      return r;
     }
   }
-  spinlock_unlock(&Q->lock);
-  return 1;
+}
+
+int leptonet_globalmq_empty() {
+  // tail is stub also when a push lands while pop puts stub back, then a mq is still queued before stub
+  return ATOMIC_LOAD(&Q->head) == &Q->stub && ATOMIC_LOAD(&Q->stub.next) == NULL && ATOMIC_LOAD(&Q->tail) == &Q->stub;
 }
@@ -3,6 +3,11 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
+
+// message type
+#define PTYPE_TEXT 0
+#define PTYPE_RESPONSE 1
 
 struct leptonet_message {
   uint32_t type;
@@ -11,6 +16,12 @@ struct leptonet_message {
   size_t sz;
 };
 
+struct leptonet_mq_overload {
+  uint32_t handle;
+  int length;       // queue length when crossing watermark
+  bool overload;    // true: crossed high watermark, false: dropped to low watermark
+};
+
 struct message_queue;
 
 void leptonet_global_message_queue_init();
@@ -22,12 +33,36 @@ typedef void (*message_drop)(struct leptonet_message *, void *);
 void leptonet_mq_release(struct message_queue *mq, message_drop drop, void * ud);
 
 int leptonet_mq_length(struct message_queue *mq);
+uint32_t leptonet_mq_handle(struct message_queue *mq);
+
+// mq becomes overloaded when its length reaches high, and recovers when it drops to low
+// high <= 0 disables overload detection
+void leptonet_mq_watermark(struct message_queue *mq, int high, int low);
+// cheap check for senders, return 1 if mq is overloaded
+int leptonet_mq_overload(struct message_queue *mq);
+// only the owner can call it, return 1 and take the last event if there is one
+int leptonet_mq_overload_event(struct message_queue *mq, struct leptonet_mq_overload *ev);
 
-void leptonet_mq_push(struct message_queue *mq, struct leptonet_message *msg);
+// can be called from any thread, node is charged to current handle
+// return -1 without pushing if current handle is over its hard memory limit, msg->data is still owned by caller
+int leptonet_mq_push(struct message_queue *mq, struct leptonet_message *msg);
+// return -1 without pushing if mq is overloaded, the sender should back off and retry later, or if push fails
+int leptonet_mq_trypush(struct message_queue *mq, struct leptonet_message *msg);
+// push n messages in order, with a single synchronization point
+// all of them are pushed, or none of them if it returns -1 as above
+int leptonet_mq_push_batch(struct message_queue *mq, struct leptonet_message *msgs, int n);
+// only the worker which owns mq (popped it from global mq) can call it
+// return 0 when mq is empty, and the ownership is given up at the same time
 int leptonet_mq_pop(struct message_queue *mq, struct leptonet_message *msg);
+// pop at most max messages, return the number of popped messages, 0 has the same meaning as above
+int leptonet_mq_pop_batch(struct message_queue *mq, struct leptonet_message *msgs, int max);
 
+// lock-free, can be called from any thread
 void leptonet_globalmq_push(struct message_queue *mq);
+// return 0 only when global mq is empty, contended pops wait for each other instead of failing
 int leptonet_globalmq_pop(struct message_queue **mq);
+// a hint without lock, may be stale when it returns
+int leptonet_globalmq_empty();
 
 
 #endif
@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "leptonet_scheduler.h"
+#include "leptonet_malloc.h"
+#include "leptonet_server.h"
+#include "atomic.h"
+
+// must be power of two
+#define RUNQ_SIZE 256
+// check global mq first every GLOBAL_CHECK_TICK dispatches, so that new arrivals won't starve
+#define GLOBAL_CHECK_TICK 61
+// max messages popped from mailbox at once
+#define DISPATCH_BATCH 32
+
+// a worker drains length >> weight messages from a mailbox before re-queueing it, and -1 means only one message
+static const int default_weight[] = {
+  -1, -1, -1, -1, 0, 0, 0, 0,
+  1, 1, 1, 1, 1, 1, 1, 1,
+  2, 2, 2, 2, 2, 2, 2, 2,
+  3, 3, 3, 3, 3, 3, 3, 3,
+};
+
+// per-worker run queue, only owner pushes into tail, owner and thieves take from head with CAS
+// taking from head keeps re-queued mailboxes in FIFO order, so a hot service can't starve cold ones
+struct runq {
+  ATOMIC_UINT head;
+  ATOMIC_UINT tail;
+  struct message_queue *volatile slot[RUNQ_SIZE];
+};
+
+struct worker {
+  int id;
+  int weight;
+  uint32_t seed;                // for random victim
+  uint32_t tick;                // dispatch count
+  pthread_t thread;
+  struct leptonet_scheduler *s;
+  struct runq runq;
+};
+
+struct leptonet_scheduler {
+  int thread;
+  ATOMIC_INT quit;
+  ATOMIC_INT sleep;             // sleeping worker count
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  leptonet_dispatch dispatch;
+  leptonet_dispatch_batch dispatch_batch;
+  void *ud;
+  struct worker *workers;
+};
+
+static inline int runq_put(struct runq *q, struct message_queue *mq) {
+  uint32_t head = ATOMIC_LOAD_ACQ(&q->head);
+  uint32_t tail = q->tail;
+  if (tail - head >= RUNQ_SIZE) {
+    return 0;
+  }
+  q->slot[tail % RUNQ_SIZE] = mq;
+  // publish slot before tail
+  ATOMIC_STORE_REL(&q->tail, tail + 1);
+  return 1;
+}
+
+static inline struct message_queue* runq_get(struct runq *q) {
+  for (;;) {
+    uint32_t head = ATOMIC_LOAD_ACQ(&q->head);
+    uint32_t tail = ATOMIC_LOAD_ACQ(&q->tail);
+    if (head == tail) {
+      return NULL;
+    }
+    // slot may be overwritten if head is stale, but then CAS fails
+    struct message_queue *mq = q->slot[head % RUNQ_SIZE];
+    if (ATOMIC_CAS(&q->head, head, head + 1)) {
+      return mq;
+    }
+  }
+}
+
+static inline uint32_t runq_size(struct runq *q) {
+  return ATOMIC_LOAD(&q->tail) - ATOMIC_LOAD(&q->head);
+}
+
+static inline uint32_t worker_random(struct worker *w) {
+  // xorshift32
+  uint32_t x = w->seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  w->seed = x;
+  return x;
+}
+
+static struct message_queue* worker_steal(struct worker *w) {
+  struct leptonet_scheduler *s = w->s;
+  int n = s->thread;
+  if (n <= 1) {
+    return NULL;
+  }
+  int start = worker_random(w) % n;
+  for (int i = 0; i < n; i ++) {
+    struct worker *victim = &s->workers[(start + i) % n];
+    if (victim == w) {
+      continue;
+    }
+    struct message_queue *mq = runq_get(&victim->runq);
+    if (mq) {
+      return mq;
+    }
+  }
+  return NULL;
+}
+
+// local run queue first, then global mq, then steal from other workers
+static struct message_queue* worker_next(struct worker *w) {
+  struct message_queue *mq = NULL;
+  if (w->tick % GLOBAL_CHECK_TICK == 0 && leptonet_globalmq_pop(&mq)) {
+    return mq;
+  }
+  mq = runq_get(&w->runq);
+  if (mq) {
+    return mq;
+  }
+  if (leptonet_globalmq_pop(&mq)) {
+    return mq;
+  }
+  return worker_steal(w);
+}
+
+static inline void worker_report_overload(struct message_queue *mq) {
+  struct leptonet_mq_overload ev;
+  if (leptonet_mq_overload_event(mq, &ev)) {
+    if (ev.overload) {
+      fprintf(stderr, "[leptonet-scheduler]: mailbox :%08x may overload, length = %d\n", ev.handle, ev.length);
+    } else {
+      fprintf(stderr, "[leptonet-scheduler]: mailbox :%08x recovered, length = %d\n", ev.handle, ev.length);
+    }
+  }
+}
+
+static void worker_dispatch(struct worker *w, struct message_queue *mq) {
+  struct leptonet_scheduler *s = w->s;
+  uint32_t handle = leptonet_mq_handle(mq);
+  struct leptonet_message msgs[DISPATCH_BATCH];
+  int n = 1;
+  if (w->weight >= 0) {
+    n = leptonet_mq_length(mq) >> w->weight;
+    n = n > 1 ? n : 1;
+  }
+  while (n > 0) {
+    int cnt = leptonet_mq_pop_batch(mq, msgs, n < DISPATCH_BATCH ? n : DISPATCH_BATCH);
+    if (cnt == 0) {
+      // mq is empty, and it's not ours any more
+      return;
+    }
+    if (s->dispatch_batch) {
+      s->dispatch_batch(s->ud, handle, msgs, cnt);
+    } else {
+      for (int i = 0; i < cnt; i ++) {
+        s->dispatch(s->ud, handle, &msgs[i]);
+      }
+    }
+    // we still own mq here
+    worker_report_overload(mq);
+    n -= cnt;
+  }
+  // keep it on this worker for cache locality, overflow goes to global mq
+  if (!runq_put(&w->runq, mq)) {
+    leptonet_globalmq_push(mq);
+  }
+}
+
+// true if a run queue holds a mailbox, so it can be stolen
+static bool worker_pending(struct leptonet_scheduler *s) {
+  for (int i = 0; i < s->thread; i ++) {
+    if (runq_size(&s->workers[i].runq) > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void worker_sleep(struct worker *w) {
+  struct leptonet_scheduler *s = w->s;
+  pthread_mutex_lock(&s->mutex);
+  // increase sleep before checking work, so a producer either sees us sleeping or we see its work
+  ATOMIC_INC(&s->sleep);
+  if (!ATOMIC_LOAD(&s->quit) && leptonet_globalmq_empty() && !worker_pending(s)) {
+    pthread_cond_wait(&s->cond, &s->mutex);
+  }
+  ATOMIC_DEC(&s->sleep);
+  pthread_mutex_unlock(&s->mutex);
+}
+
+// wake up at most n sleeping workers
+static void worker_wakeup(struct leptonet_scheduler *s, int n) {
+  // pair with worker_sleep, the queued mailboxes must be visible before we read sleep
+  ATOMIC_BARRIER();
+  int sleep = ATOMIC_LOAD(&s->sleep);
+  if (n <= 0 || sleep == 0) {
+    return;
+  }
+  pthread_mutex_lock(&s->mutex);
+  if (n >= sleep) {
+    pthread_cond_broadcast(&s->cond);
+  } else {
+    for (int i = 0; i < n; i ++) {
+      pthread_cond_signal(&s->cond);
+    }
+  }
+  pthread_mutex_unlock(&s->mutex);
+}
+
+static void* worker_thread(void *ud) {
+  struct worker *w = ud;
+  struct leptonet_scheduler *s = w->s;
+  while (!ATOMIC_LOAD(&s->quit)) {
+    struct message_queue *mq = worker_next(w);
+    if (mq == NULL) {
+      worker_sleep(w);
+      continue;
+    }
+    w->tick++;
+    // allocations during dispatch are charged to the owner of mq
+    leptonet_context_set_current_handle(leptonet_mq_handle(mq));
+    worker_dispatch(w, mq);
+    leptonet_context_set_current_handle(0);
+    // there is more work than we can do, ask for one helper for each mailbox we can't take next
+    int more = (int)runq_size(&w->runq) - 1 + !leptonet_globalmq_empty();
+    worker_wakeup(s, more);
+  }
+  return NULL;
+}
+
+struct leptonet_scheduler* leptonet_scheduler_create(struct leptonet_scheduler_config *config) {
+  assert(config->thread > 0 && (config->dispatch || config->dispatch_batch));
+  struct leptonet_scheduler *s = leptonet_malloc(sizeof *s);
+  memset(s, 0, sizeof *s);
+  s->thread = config->thread;
+  s->dispatch = config->dispatch;
+  s->dispatch_batch = config->dispatch_batch;
+  s->ud = config->ud;
+  pthread_mutex_init(&s->mutex, NULL);
+  pthread_cond_init(&s->cond, NULL);
+  s->workers = leptonet_malloc(sizeof(struct worker) * s->thread);
+  memset(s->workers, 0, sizeof(struct worker) * s->thread);
+  int ndefault = sizeof(default_weight) / sizeof(default_weight[0]);
+  for (int i = 0; i < s->thread; i ++) {
+    struct worker *w = &s->workers[i];
+    w->id = i;
+    w->s = s;
+    w->seed = 0x9e3779b9u * (i + 1);
+    if (config->weight) {
+      w->weight = config->weight[i];
+    } else {
+      w->weight = i < ndefault ? default_weight[i] : 0;
+    }
+  }
+  return s;
+}
+
+void leptonet_scheduler_release(struct leptonet_scheduler *s) {
+  pthread_mutex_destroy(&s->mutex);
+  pthread_cond_destroy(&s->cond);
+  leptonet_free(s->workers);
+  leptonet_free(s);
+}
+
+void leptonet_scheduler_start(struct leptonet_scheduler *s) {
+  for (int i = 0; i < s->thread; i ++) {
+    struct worker *w = &s->workers[i];
+    if (pthread_create(&w->thread, NULL, worker_thread, w)) {
+      fprintf(stderr, "[leptonet-scheduler]: create worker %d failed\n", i);
+    }
+  }
+}
+
+void leptonet_scheduler_stop(struct leptonet_scheduler *s) {
+  pthread_mutex_lock(&s->mutex);
+  ATOMIC_STORE(&s->quit, 1);
+  pthread_cond_broadcast(&s->cond);
+  pthread_mutex_unlock(&s->mutex);
+  for (int i = 0; i < s->thread; i ++) {
+    pthread_join(s->workers[i].thread, NULL);
+  }
+  // mailboxes left in run queues go back to global mq
+  for (int i = 0; i < s->thread; i ++) {
+    struct message_queue *mq;
+    while ((mq = runq_get(&s->workers[i].runq))) {
+      leptonet_globalmq_push(mq);
+    }
+  }
+}
+
+void leptonet_scheduler_wakeup(struct leptonet_scheduler *s, int busy) {
+  // pair with worker_sleep, the pushed work must be visible before we read sleep
+  ATOMIC_BARRIER();
+  if (ATOMIC_LOAD(&s->sleep) >= s->thread - busy) {
+    pthread_mutex_lock(&s->mutex);
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+  }
+}
@@ -0,0 +1,34 @@
+#ifndef __LEPTONET_SCHEDULER_H__
+#define __LEPTONET_SCHEDULER_H__
+
+#include <stdint.h>
+
+#include "leptonet_mq.h"
+
+// called by worker thread for each message, handle is the owner of mailbox
+typedef void (*leptonet_dispatch)(void *ud, uint32_t handle, struct leptonet_message *msg);
+// called with at most 32 messages of the same mailbox in order
+typedef void (*leptonet_dispatch_batch)(void *ud, uint32_t handle, struct leptonet_message *msgs, int n);
+
+struct leptonet_scheduler_config {
+  int thread;                   // worker thread number
+  const int *weight;            // weight of each worker, NULL for default
+  leptonet_dispatch dispatch;   // message handler
+  leptonet_dispatch_batch dispatch_batch;  // used instead of dispatch if it's not NULL
+  void *ud;                     // passed to dispatch
+};
+
+struct leptonet_scheduler;
+
+struct leptonet_scheduler* leptonet_scheduler_create(struct leptonet_scheduler_config *config);
+void leptonet_scheduler_release(struct leptonet_scheduler *s);
+
+void leptonet_scheduler_start(struct leptonet_scheduler *s);
+// stop all workers and wait for them to exit
+void leptonet_scheduler_stop(struct leptonet_scheduler *s);
+
+// wake up a sleeping worker if less than (thread - busy) workers are running
+// threads which are not workers (timer, socket) should call it after pushing messages
+void leptonet_scheduler_wakeup(struct leptonet_scheduler *s, int busy);
+
+#endif
@@ -0,0 +1,12 @@
+#include "leptonet_server.h"
+
+// malloc hook reads it on every allocation, so keep it thread local instead of looking up context
+static __thread uint32_t current_handle = 0;
+
+uint32_t leptonet_context_current_handle(void) {
+  return current_handle;
+}
+
+void leptonet_context_set_current_handle(uint32_t handle) {
+  current_handle = handle;
+}
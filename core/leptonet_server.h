@@ -0,0 +1,13 @@
+#ifndef __LEPTONET_SERVER_H__
+#define __LEPTONET_SERVER_H__
+
+#include <stdint.h>
+
+struct leptonet_context;
+
+// handle of the service running on current thread, 0 means system
+uint32_t leptonet_context_current_handle(void);
+// called by worker before dispatching messages of a service
+void leptonet_context_set_current_handle(uint32_t handle);
+
+#endif
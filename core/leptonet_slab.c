@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "leptonet_slab.h"
+#include "spinlock.h"
+#include "atomic.h"
+
+#define CACHELINE_SIZE 64
+
+// spans are carved from one reserved arena, so owner and size class of a pointer come from its address
+#define SPAN_SHIFT 16
+#define SPAN_SIZE (1 << SPAN_SHIFT)
+#ifndef SLAB_ARENA_SIZE
+#define SLAB_ARENA_SIZE (4ULL << 30)
+#endif
+#define SPAN_NUM (SLAB_ARENA_SIZE >> SPAN_SHIFT)
+
+// objects moved between thread cache and depot at a time, about BATCH_BYTES bytes
+#define BATCH_BYTES 16384
+#define BATCH_MIN 4
+#define BATCH_MAX 64
+
+// 16 bytes step up to 128, then 4 classes per power of two
+#define CLASS_NUM 32
+static const uint32_t class_size[CLASS_NUM] = {
+  16, 32, 48, 64, 80, 96, 112, 128,
+  160, 192, 224, 256, 320, 384, 448, 512,
+  640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+  2560, 3072, 3584, 4096, 5120, 6144, 7168, 8192,
+};
+
+struct free_object {
+  struct free_object *next;
+  struct free_object *batch;    // next batch, only used by batch head in depot
+};
+
+// objects freed by any thread flow back here, so cross-thread frees are reused by all threads
+struct depot {
+  struct spinlock lock;
+  struct free_object *batches;  // each batch has exactly batch[class] objects
+  struct free_object *partial;  // leftover of exited threads
+  int npartial;
+  char *cur;                    // span being carved
+  char *end;
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+struct thread_cache {
+  int init;
+  struct free_object *list[CLASS_NUM];
+  int count[CLASS_NUM];
+};
+
+// leptonet_malloc is built on top of slab, so slab can't allocate its own state dynamically
+struct slab {
+  char *base;                   // NULL if arena isn't available
+  ATOMIC_INT next_span;
+  int batch[CLASS_NUM];
+  uint8_t size_class[(SLAB_MAX_SIZE >> 4) + 1];
+  uint8_t span_class[SPAN_NUM];
+#ifdef LEPTONET_MALLOC_NOCOOKIE
+  uint32_t *tags[SPAN_NUM];     // one tag per object, allocated with span
+#endif
+  pthread_key_t key;            // flush thread cache on exit
+  struct depot depot[CLASS_NUM];
+};
+
+static struct slab S;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static __thread struct thread_cache C;
+
+static void cache_flush(struct thread_cache *tc);
+
+static void cache_destroy(void *ud) {
+  cache_flush(ud);
+}
+
+static void slab_init() {
+  int c = 0;
+  for (int i = 0; i <= SLAB_MAX_SIZE >> 4; i ++) {
+    while (class_size[c] < (uint32_t)i << 4) {
+      c++;
+    }
+    S.size_class[i] = c;
+  }
+  for (c = 0; c < CLASS_NUM; c ++) {
+    int batch = BATCH_BYTES / class_size[c];
+    batch = batch < BATCH_MIN ? BATCH_MIN : batch;
+    batch = batch > BATCH_MAX ? BATCH_MAX : batch;
+    S.batch[c] = batch;
+    spinlock_init(&S.depot[c].lock);
+  }
+  // reserve address space only, pages are committed on first touch
+  size_t sz = SLAB_ARENA_SIZE + SPAN_SIZE;
+  char *p = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "[leptonet-slab]: reserve arena failed, fallback to libc\n");
+    return;
+  }
+  pthread_key_create(&S.key, cache_destroy);
+  // span must be aligned, so that span index is an address shift
+  S.base = (char*)(((uintptr_t)p + SPAN_SIZE - 1) & ~(uintptr_t)(SPAN_SIZE - 1));
+}
+
+static inline void cache_init(struct thread_cache *tc) {
+  pthread_once(&slab_once, slab_init);
+  tc->init = 1;
+  if (S.base) {
+    pthread_setspecific(S.key, tc);
+  }
+}
+
+static inline int slab_owns(void *ptr) {
+  return S.base && (uintptr_t)ptr - (uintptr_t)S.base < SLAB_ARENA_SIZE;
+}
+
+// called with depot lock of class c
+static char* span_alloc(int c) {
+  if (ATOMIC_LOAD(&S.next_span) >= (int)SPAN_NUM) {
+    return NULL;
+  }
+  int idx = ATOMIC_INC(&S.next_span) - 1;
+  if (idx >= (int)SPAN_NUM) {
+    return NULL;
+  }
+  S.span_class[idx] = c;
+#ifdef LEPTONET_MALLOC_NOCOOKIE
+  S.tags[idx] = calloc(SPAN_SIZE / class_size[c], sizeof(uint32_t));
+  if (S.tags[idx] == NULL) {
+    return NULL;
+  }
+#endif
+  return S.base + ((size_t)idx << SPAN_SHIFT);
+}
+
+// move at most one batch from depot into list, return count
+static int depot_fetch(int c, struct free_object **list) {
+  struct depot *d = &S.depot[c];
+  int n = 0;
+  spinlock_lock(&d->lock);
+  if (d->batches) {
+    *list = d->batches;
+    d->batches = d->batches->batch;
+    n = S.batch[c];
+  } else if (d->partial) {
+    *list = d->partial;
+    n = d->npartial;
+    d->partial = NULL;
+    d->npartial = 0;
+  } else {
+    // carve new objects in address order
+    size_t size = class_size[c];
+    struct free_object *head = NULL;
+    struct free_object **tail = &head;
+    while (n < S.batch[c]) {
+      if ((size_t)(d->end - d->cur) < size) {
+        char *span = span_alloc(c);
+        if (span == NULL) {
+          break;
+        }
+        d->cur = span;
+        d->end = span + SPAN_SIZE;
+      }
+      struct free_object *obj = (struct free_object*)d->cur;
+      d->cur += size;
+      *tail = obj;
+      tail = &obj->next;
+      n++;
+    }
+    *tail = NULL;
+    *list = head;
+  }
+  spinlock_unlock(&d->lock);
+  return n;
+}
+
+static void depot_release(int c, struct free_object *list, int n) {
+  struct depot *d = &S.depot[c];
+  if (n == S.batch[c]) {
+    spinlock_lock(&d->lock);
+    list->batch = d->batches;
+    d->batches = list;
+    spinlock_unlock(&d->lock);
+    return;
+  }
+  struct free_object *tail = list;
+  while (tail->next) {
+    tail = tail->next;
+  }
+  spinlock_lock(&d->lock);
+  tail->next = d->partial;
+  d->partial = list;
+  d->npartial += n;
+  spinlock_unlock(&d->lock);
+}
+
+static void cache_flush(struct thread_cache *tc) {
+  for (int c = 0; c < CLASS_NUM; c ++) {
+    if (tc->list[c]) {
+      depot_release(c, tc->list[c], tc->count[c]);
+      tc->list[c] = NULL;
+      tc->count[c] = 0;
+    }
+  }
+  // thread may allocate again in other destructors, it registers itself again then
+  tc->init = 0;
+}
+
+static inline void* slab_alloc(size_t sz) {
+  if (sz > SLAB_MAX_SIZE) {
+    return NULL;
+  }
+  struct thread_cache *tc = &C;
+  if (!tc->init) {
+    cache_init(tc);
+  }
+  if (S.base == NULL) {
+    return NULL;
+  }
+  int c = S.size_class[(sz + 15) >> 4];
+  struct free_object *obj = tc->list[c];
+  if (obj == NULL) {
+    tc->count[c] = depot_fetch(c, &tc->list[c]);
+    obj = tc->list[c];
+    if (obj == NULL) {
+      // arena is used up
+      return NULL;
+    }
+  }
+  tc->list[c] = obj->next;
+  tc->count[c]--;
+  return obj;
+}
+
+void* leptonet_slab_alloc(size_t sz) {
+  void *ptr = slab_alloc(sz);
+  return ptr ? ptr : malloc(sz);
+}
+
+void* leptonet_slab_tryalloc(size_t sz) {
+  return slab_alloc(sz);
+}
+
+size_t leptonet_slab_round(size_t sz) {
+  if (sz > SLAB_MAX_SIZE) {
+    return 0;
+  }
+  pthread_once(&slab_once, slab_init);
+  return class_size[S.size_class[(sz + 15) >> 4]];
+}
+
+void leptonet_slab_free(void *ptr) {
+  if (!slab_owns(ptr)) {
+    free(ptr);
+    return;
+  }
+  struct thread_cache *tc = &C;
+  if (!tc->init) {
+    cache_init(tc);
+  }
+  int c = S.span_class[((char*)ptr - S.base) >> SPAN_SHIFT];
+  struct free_object *obj = ptr;
+  obj->next = tc->list[c];
+  tc->list[c] = obj;
+  int batch = S.batch[c];
+  if (++tc->count[c] >= batch * 2) {
+    // keep the recently freed half, it's still hot in cache
+    struct free_object *tail = obj;
+    for (int i = 1; i < batch; i ++) {
+      tail = tail->next;
+    }
+    struct free_object *rest = tail->next;
+    int n = tc->count[c] - batch;
+    tail->next = NULL;
+    tc->count[c] = batch;
+    depot_release(c, rest, n);
+  }
+}
+
+size_t leptonet_slab_size(void *ptr) {
+  if (!slab_owns(ptr)) {
+    return 0;
+  }
+  return class_size[S.span_class[((char*)ptr - S.base) >> SPAN_SHIFT]];
+}
+
+void leptonet_slab_flush() {
+  struct thread_cache *tc = &C;
+  if (tc->init) {
+    cache_flush(tc);
+  }
+}
+
+#ifdef LEPTONET_MALLOC_NOCOOKIE
+uint32_t* leptonet_slab_tag(void *ptr) {
+  if (!slab_owns(ptr)) {
+    return NULL;
+  }
+  size_t idx = ((char*)ptr - S.base) >> SPAN_SHIFT;
+  size_t offset = ((char*)ptr - S.base) & (SPAN_SIZE - 1);
+  return &S.tags[idx][offset / class_size[S.span_class[idx]]];
+}
+#endif
@@ -0,0 +1,30 @@
+#ifndef __LEPTONET_SLAB_H__
+#define __LEPTONET_SLAB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// size classes up to 8KB are served from per-thread caches, larger requests go to libc
+#define SLAB_MAX_SIZE 8192
+
+// never return NULL unless libc fails
+void* leptonet_slab_alloc(size_t sz);
+// like leptonet_slab_alloc, but return NULL instead of falling back to libc
+void* leptonet_slab_tryalloc(size_t sz);
+// usable size of an object for sz, 0 if sz is beyond SLAB_MAX_SIZE
+size_t leptonet_slab_round(size_t sz);
+// ptr may be allocated by any thread, NULL is ignored
+void leptonet_slab_free(void *ptr);
+// usable size of ptr, 0 if ptr isn't from slab
+size_t leptonet_slab_size(void *ptr);
+
+// return objects cached by current thread to central depot, it's done automatically on thread exit
+void leptonet_slab_flush();
+
+#ifdef LEPTONET_MALLOC_NOCOOKIE
+// a 4 bytes tag of each object kept out of the object, NULL if ptr isn't from slab
+// it's set by owner of object, it's not cleared on free
+uint32_t* leptonet_slab_tag(void *ptr);
+#endif
+
+#endif
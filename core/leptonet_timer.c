@@ -0,0 +1,400 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "leptonet_timer.h"
+#include "leptonet_malloc.h"
+#include "spinlock.h"
+#include "atomic.h"
+
+// hierarchical timing wheel, one tick is a centisecond
+// near wheel holds timers expiring in next 256 ticks, four levels of 64 slots hold the rest of 32 bits
+#define TIME_NEAR_SHIFT 8
+#define TIME_NEAR (1 << TIME_NEAR_SHIFT)
+#define TIME_LEVEL_SHIFT 6
+#define TIME_LEVEL (1 << TIME_LEVEL_SHIFT)
+#define TIME_NEAR_MASK (TIME_NEAR - 1)
+#define TIME_LEVEL_MASK (TIME_LEVEL - 1)
+
+// timer nodes are allocated by chunk, so that pointers are stable and timer id can index them
+#define NODE_CHUNK_SHIFT 12
+#define NODE_CHUNK (1 << NODE_CHUNK_SHIFT)
+#define NODE_CHUNK_MASK (NODE_CHUNK - 1)
+
+#define NODE_FREE 0
+#define NODE_PENDING 1
+#define NODE_FIRING 2
+
+// sleep interval of tick thread, in microseconds
+#define TICK_INTERVAL 2500
+
+struct timer_node {
+  struct timer_node *prev;
+  struct timer_node *next;
+  uint32_t expire;
+  uint32_t index;               // position in node pool
+  uint32_t version;             // increased on recycle, so stale timer id can be detected
+  int state;
+  struct message_queue *mq;
+  uint32_t sission;
+};
+
+// circular doubly linked list with a sentinel, unlink is O(1) without knowing the slot
+struct link_list {
+  struct timer_node head;
+};
+
+struct timer {
+  struct link_list near[TIME_NEAR];
+  struct link_list t[4][TIME_LEVEL];
+  struct spinlock lock;
+  uint32_t time;                // current tick
+  uint64_t current;             // centiseconds since start
+  uint64_t current_point;       // last clock point, in centiseconds
+
+  struct timer_node **chunks;   // node pool
+  int nchunk;
+  int chunk_cap;
+  struct timer_node *freelist;  // linked by next
+
+  ATOMIC_INT quit;
+  pthread_t thread;
+  struct leptonet_scheduler *scheduler;
+};
+
+static struct timer *TI = NULL;
+
+static uint64_t gettime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 100 + ts.tv_nsec / 10000000;
+}
+
+static inline void link_init(struct link_list *list) {
+  list->head.prev = list->head.next = &list->head;
+}
+
+static inline int link_empty(struct link_list *list) {
+  return list->head.next == &list->head;
+}
+
+static inline void link_node(struct link_list *list, struct timer_node *node) {
+  struct timer_node *tail = list->head.prev;
+  node->prev = tail;
+  node->next = &list->head;
+  tail->next = node;
+  list->head.prev = node;
+}
+
+static inline void unlink_node(struct timer_node *node) {
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+  node->prev = node->next = NULL;
+}
+
+// detach all nodes, return a NULL terminated singly list
+static inline struct timer_node* link_clear(struct link_list *list) {
+  if (link_empty(list)) {
+    return NULL;
+  }
+  struct timer_node *first = list->head.next;
+  list->head.prev->next = NULL;
+  link_init(list);
+  return first;
+}
+
+// return NULL if the pool can't grow, i.e. caller is over its hard memory limit
+static struct timer_node* node_alloc(struct timer *T) {
+  if (T->freelist == NULL) {
+    if (T->nchunk == T->chunk_cap) {
+      int cap = T->chunk_cap * 2;
+      struct timer_node **chunks = leptonet_malloc(sizeof(*chunks) * cap);
+      if (chunks == NULL) {
+        return NULL;
+      }
+      memcpy(chunks, T->chunks, sizeof(*chunks) * T->nchunk);
+      leptonet_free(T->chunks);
+      T->chunks = chunks;
+      T->chunk_cap = cap;
+    }
+    struct timer_node *chunk = leptonet_malloc(sizeof(*chunk) * NODE_CHUNK);
+    if (chunk == NULL) {
+      return NULL;
+    }
+    uint32_t base = T->nchunk << NODE_CHUNK_SHIFT;
+    // link in reverse order, so that low index is used first
+    for (int i = NODE_CHUNK - 1; i >= 0; i --) {
+      struct timer_node *node = &chunk[i];
+      node->index = base + i;
+      node->version = 1;
+      node->state = NODE_FREE;
+      node->next = T->freelist;
+      T->freelist = node;
+    }
+    T->chunks[T->nchunk++] = chunk;
+  }
+  struct timer_node *node = T->freelist;
+  T->freelist = node->next;
+  return node;
+}
+
+static inline void node_free(struct timer *T, struct timer_node *node) {
+  node->state = NODE_FREE;
+  node->version++;
+  node->mq = NULL;
+  node->next = T->freelist;
+  T->freelist = node;
+}
+
+static inline uint64_t node_id(struct timer_node *node) {
+  return (uint64_t)node->version << 32 | (node->index + 1);
+}
+
+static struct timer_node* node_query(struct timer *T, uint64_t id) {
+  uint32_t index = (uint32_t)id - 1;
+  uint32_t version = id >> 32;
+  if ((id & 0xffffffff) == 0 || (int)(index >> NODE_CHUNK_SHIFT) >= T->nchunk) {
+    return NULL;
+  }
+  struct timer_node *node = &T->chunks[index >> NODE_CHUNK_SHIFT][index & NODE_CHUNK_MASK];
+  if (node->version != version) {
+    return NULL;
+  }
+  return node;
+}
+
+static void add_node(struct timer *T, struct timer_node *node) {
+  uint32_t time = node->expire;
+  uint32_t current = T->time;
+  if ((time | TIME_NEAR_MASK) == (current | TIME_NEAR_MASK)) {
+    link_node(&T->near[time & TIME_NEAR_MASK], node);
+  } else {
+    int i;
+    uint32_t mask = TIME_NEAR << TIME_LEVEL_SHIFT;
+    for (i = 0; i < 3; i ++) {
+      if ((time | (mask - 1)) == (current | (mask - 1))) {
+        break;
+      }
+      mask <<= TIME_LEVEL_SHIFT;
+    }
+    link_node(&T->t[i][(time >> (TIME_NEAR_SHIFT + i * TIME_LEVEL_SHIFT)) & TIME_LEVEL_MASK], node);
+  }
+}
+
+// re-add nodes of a higher level slot, they go to lower levels
+static void move_list(struct timer *T, int level, int idx) {
+  struct timer_node *current = link_clear(&T->t[level][idx]);
+  while (current) {
+    struct timer_node *next = current->next;
+    add_node(T, current);
+    current = next;
+  }
+}
+
+static void timer_shift(struct timer *T) {
+  uint32_t mask = TIME_NEAR;
+  uint32_t ct = ++T->time;
+  if (ct == 0) {
+    move_list(T, 3, 0);
+  } else {
+    uint32_t time = ct >> TIME_NEAR_SHIFT;
+    int i = 0;
+    while ((ct & (mask - 1)) == 0) {
+      int idx = time & TIME_LEVEL_MASK;
+      if (idx != 0) {
+        move_list(T, i, idx);
+        break;
+      }
+      mask <<= TIME_LEVEL_SHIFT;
+      time >>= TIME_LEVEL_SHIFT;
+      ++i;
+    }
+  }
+}
+
+static void dispatch_list(struct timer_node *current) {
+  while (current) {
+    struct leptonet_message msg;
+    msg.type = PTYPE_RESPONSE;
+    msg.sission = current->sission;
+    msg.data = NULL;
+    msg.sz = 0;
+    if (leptonet_mq_push(current->mq, &msg)) {
+      fprintf(stderr, "[leptonet-timer]: timeout message of :%08x dropped, out of memory\n", leptonet_mq_handle(current->mq));
+    }
+    current = current->next;
+  }
+}
+
+// fire all timers in current near slot, return fired count
+// messages are pushed without lock, node is kept in FIRING state so that it can't be canceled or reused
+static int timer_execute(struct timer *T) {
+  int idx = T->time & TIME_NEAR_MASK;
+  int cnt = 0;
+  while (!link_empty(&T->near[idx])) {
+    struct timer_node *list = link_clear(&T->near[idx]);
+    for (struct timer_node *node = list; node; node = node->next) {
+      node->state = NODE_FIRING;
+      cnt++;
+    }
+    spinlock_unlock(&T->lock);
+    dispatch_list(list);
+    spinlock_lock(&T->lock);
+    while (list) {
+      struct timer_node *next = list->next;
+      node_free(T, list);
+      list = next;
+    }
+  }
+  return cnt;
+}
+
+static int timer_update(struct timer *T) {
+  spinlock_lock(&T->lock);
+  // try to dispatch timeout 0 (rare condition)
+  int cnt = timer_execute(T);
+  // shift time first, and then dispatch timer message
+  timer_shift(T);
+  cnt += timer_execute(T);
+  spinlock_unlock(&T->lock);
+  return cnt;
+}
+
+void leptonet_timer_init() {
+  struct timer *T = leptonet_malloc(sizeof *T);
+  memset(T, 0, sizeof *T);
+  for (int i = 0; i < TIME_NEAR; i ++) {
+    link_init(&T->near[i]);
+  }
+  for (int i = 0; i < 4; i ++) {
+    for (int j = 0; j < TIME_LEVEL; j ++) {
+      link_init(&T->t[i][j]);
+    }
+  }
+  spinlock_init(&T->lock);
+  T->chunk_cap = 16;
+  T->chunks = leptonet_malloc(sizeof(*T->chunks) * T->chunk_cap);
+  T->current_point = gettime();
+  TI = T;
+}
+
+void leptonet_timer_release() {
+  struct timer *T = TI;
+  for (int i = 0; i < T->nchunk; i ++) {
+    leptonet_free(T->chunks[i]);
+  }
+  leptonet_free(T->chunks);
+  spinlock_destroy(&T->lock);
+  leptonet_free(T);
+  TI = NULL;
+}
+
+uint64_t leptonet_timer_timeout(struct message_queue *mq, int time, uint32_t sission) {
+  if (time <= 0) {
+    struct leptonet_message msg;
+    msg.type = PTYPE_RESPONSE;
+    msg.sission = sission;
+    msg.data = NULL;
+    msg.sz = 0;
+    return leptonet_mq_push(mq, &msg) ? LEPTONET_TIMER_ERROR : 0;
+  }
+  struct timer *T = TI;
+  spinlock_lock(&T->lock);
+  struct timer_node *node = node_alloc(T);
+  if (node == NULL) {
+    spinlock_unlock(&T->lock);
+    return LEPTONET_TIMER_ERROR;
+  }
+  node->mq = mq;
+  node->sission = sission;
+  node->state = NODE_PENDING;
+  node->expire = T->time + time;
+  add_node(T, node);
+  uint64_t id = node_id(node);
+  spinlock_unlock(&T->lock);
+  return id;
+}
+
+int leptonet_timer_cancel(uint64_t id) {
+  struct timer *T = TI;
+  int r = 0;
+  spinlock_lock(&T->lock);
+  struct timer_node *node = node_query(T, id);
+  // a firing node is pushing into its mq without lock, wait until it's freed, so that mq can be released after return
+  while (node && node->state == NODE_FIRING) {
+    spinlock_unlock(&T->lock);
+    spinlock_lock(&T->lock);
+    node = node_query(T, id);
+  }
+  if (node && node->state == NODE_PENDING) {
+    unlink_node(node);
+    node_free(T, node);
+    r = 1;
+  }
+  spinlock_unlock(&T->lock);
+  return r;
+}
+
+void leptonet_timer_update() {
+  struct timer *T = TI;
+  uint64_t cp = gettime();
+  if (cp < T->current_point) {
+    fprintf(stderr, "[leptonet-timer]: time diff error: change from %llu to %llu\n",
+            (unsigned long long)T->current_point, (unsigned long long)cp);
+    T->current_point = cp;
+    return;
+  }
+  if (cp == T->current_point) {
+    return;
+  }
+  uint32_t diff = (uint32_t)(cp - T->current_point);
+  T->current_point = cp;
+  T->current += diff;
+  int cnt = 0;
+  for (uint32_t i = 0; i < diff; i ++) {
+    cnt += timer_update(T);
+  }
+  if (cnt > 0 && T->scheduler) {
+    leptonet_scheduler_wakeup(T->scheduler, 0);
+  }
+}
+
+uint64_t leptonet_timer_now() {
+  return TI->current;
+}
+
+static void* timer_thread(void *ud) {
+  struct timer *T = ud;
+  while (!ATOMIC_LOAD(&T->quit)) {
+    leptonet_timer_update();
+    usleep(TICK_INTERVAL);
+  }
+  return NULL;
+}
+
+void leptonet_timer_start(struct leptonet_scheduler *s) {
+  struct timer *T = TI;
+  T->scheduler = s;
+  T->quit = 0;
+  T->current_point = gettime();
+  if (pthread_create(&T->thread, NULL, timer_thread, T)) {
+    fprintf(stderr, "[leptonet-timer]: create tick thread failed\n");
+  }
+}
+
+void leptonet_timer_stop() {
+  struct timer *T = TI;
+  ATOMIC_STORE(&T->quit, 1);
+  pthread_join(T->thread, NULL);
+}
+
+void dleptonet_timer_tick(int n) {
+  struct timer *T = TI;
+  for (int i = 0; i < n; i ++) {
+    timer_update(T);
+    T->current++;
+  }
+}
@@ -0,0 +1,35 @@
+#ifndef __LEPTONET_TIMER_H__
+#define __LEPTONET_TIMER_H__
+
+#include <stdint.h>
+
+#include "leptonet_mq.h"
+#include "leptonet_scheduler.h"
+
+void leptonet_timer_init();
+void leptonet_timer_release();
+
+// returned by leptonet_timer_timeout if caller is over its hard memory limit
+#define LEPTONET_TIMER_ERROR ((uint64_t)-1)
+
+// push {type = PTYPE_RESPONSE, sission} into mq after time centiseconds, O(1)
+// return timer id, 0 if time <= 0 and the message has been pushed immediately, or LEPTONET_TIMER_ERROR
+// timers of mq must be canceled before mq is released
+uint64_t leptonet_timer_timeout(struct message_queue *mq, int time, uint32_t sission);
+// O(1), return 1 if the timer is canceled before it fires
+// if it's firing, wait until its message is pushed, so that mq can be released once all timers are canceled
+int leptonet_timer_cancel(uint64_t id);
+
+// drive timer by wall clock, called by tick thread
+void leptonet_timer_update();
+// centiseconds since timer init
+uint64_t leptonet_timer_now();
+
+// start a tick thread, s is woken up when timers fire, it can be NULL
+void leptonet_timer_start(struct leptonet_scheduler *s);
+void leptonet_timer_stop();
+
+// for debug, advance n ticks without clock
+void dleptonet_timer_tick(int n);
+
+#endif
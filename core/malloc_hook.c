@@ -1,19 +1,42 @@
+// for dladdr
+#define _GNU_SOURCE
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <execinfo.h>
 
 #include "malloc_hook.h"
 #include "leptonet_malloc.h"
 #include "leptonet_server.h"
+#include "spinlock.h"
 #include "atomic.h"
 
-struct mem_hunk {
-  ATOMIC_ULL handle;
-  ATOMIC_SZ allocated;
-};
+// allocator behind leptonet_malloc, selected at build time
+// without cookie, handle of a small object is kept in slab tag, and its size is its size class
+#if defined(LEPTONET_MALLOC_NOCOOKIE) && !defined(LEPTONET_USE_SLAB)
+#define LEPTONET_USE_SLAB
+#endif
+
+#ifdef LEPTONET_USE_SLAB
+#include "leptonet_slab.h"
+#endif
+
+// without cookie, mem_alloc takes slab objects itself, and a cookie block from slab would be taken for a tagged object
+#if defined(LEPTONET_USE_SLAB) && !defined(LEPTONET_MALLOC_NOCOOKIE)
+#define raw_malloc leptonet_slab_alloc
+#define raw_free leptonet_slab_free
+#else
+#define raw_malloc malloc
+#define raw_free free
+#endif
 
 #define MEM_ALLOCATED 0x20250101
 #define MEM_RELEASED 0x20251010
+#define MEM_SAMPLED 0x20251111
 
 struct mem_cookie {
   size_t mem_size;      // size of memory
@@ -22,14 +45,86 @@ struct mem_cookie {
   uint32_t cookie_size; // cookie size, should be placed in last
 };
 
-// (1 << 17)
-#define SLOT_SIZE 0x10000
 #define PREFIX_SIZE (sizeof(struct mem_cookie))
 
-static struct mem_hunk slots[SLOT_SIZE];
+// each thread keeps pending deltas of recent handles, direct-mapped by handle
+// they are folded into the exact handle table on collision, on threshold, or on thread exit
+// so that allocation touches no shared cacheline in common case
+#define DELTA_SIZE 128
+#define DELTA_FLUSH (64 * 1024)
+#define DEFAULT_HANDLE_TABLE 64
+
+struct mem_handle {
+  uint32_t handle;
+  ATOMIC_LL allocated;          // folded bytes, written with lock
+  ATOMIC_LL bound;              // allocation beyond it takes slow path, INT64_MAX if no limit is armed
+  int64_t soft;                 // 0 for no limit
+  int64_t hard;
+  int soft_fired;
+};
+
+struct mem_delta {
+  uint32_t handle;
+  struct mem_handle *owner;     // NULL for empty slot, changed with lock
+  ATOMIC_LL size;               // pending bytes, only written by owner thread
+};
+
+struct mem_thread {
+  ATOMIC_LL usage;              // only written by owner thread, may be negative due to cross-thread free
+  ATOMIC_LL blocks;
+  int64_t sample_left;          // bytes to allocate before next sample
+  uint64_t seed;
+  struct mem_thread *prev;
+  struct mem_thread *next;
+  struct mem_delta delta[DELTA_SIZE];
+};
+
+struct mem_stat {
+  struct spinlock lock;         // for handle table, thread list and delta slot owner
+  struct mem_handle **table;    // open addressing, entries are never moved or freed
+  uint32_t cap;
+  uint32_t cnt;
+  struct mem_thread *threads;
+  int64_t usage;                // of exited threads
+  int64_t blocks;
+  pthread_key_t key;
+  leptonet_memory_limit_cb cb;
+  void *cb_ud;
+};
+
+// statistic is used by leptonet_malloc itself, so it lives in static storage and uses libc
+static struct mem_stat MS;
+static pthread_once_t mem_once = PTHREAD_ONCE_INIT;
+static __thread struct mem_thread *current_thread = NULL;
+// limit callback may allocate, don't report recursively
+static __thread int in_limit_cb = 0;
 
-static ATOMIC_ULL _mem_usage = 0;
-static ATOMIC_ULL _mem_blocks = 0;
+// sampling profiler, each thread samples an allocation about every rate bytes
+#define SAMPLE_DEPTH 32
+// profile_record and leptonet_malloc
+#define SAMPLE_SKIP 2
+#define SAMPLE_HASH 4096
+// rate is rechecked every SAMPLE_IDLE bytes when sampling is off
+#define SAMPLE_IDLE (1024 * 1024)
+
+struct mem_sample {
+  struct mem_sample *next;
+  void *ptr;
+  size_t size;
+  size_t rate;
+  uint32_t handle;
+  int depth;
+  void *stack[SAMPLE_DEPTH];
+};
+
+struct mem_profile {
+  struct spinlock lock;         // for hash
+  ATOMIC_SZ rate;               // 0 for off
+  size_t last_rate;             // last non-zero rate, for dump
+  struct mem_sample *volatile hash[SAMPLE_HASH];
+};
+
+static struct mem_profile MP;
 
 static inline uint32_t get_cookie_size(void *ptr) {
   uint32_t size;
@@ -37,124 +132,551 @@ static inline uint32_t get_cookie_size(void *ptr) {
   return size;
 }
 
-static inline ATOMIC_SZ* get_handle_allocated(uint32_t handle) {
-  // due to we don't take lock, so we must retrive data carefully
-  uint32_t hash = handle % SLOT_SIZE;
-  struct mem_hunk* mem = &slots[hash];
-  // mem may be accessed by different thread at the same time, so here we need implement a simple spinlock
-  uint32_t oldhandle = mem->handle;
-  size_t oldallocated = mem->allocated;
-  if (oldhandle == 0 || oldallocated == 0) {
-    // this mem don't have owner
-    if (!ATOMIC_CAS(&mem->handle, oldhandle, handle)) {
-      // update value failed
+static inline uint32_t handle_hash(uint32_t handle) {
+  return handle * 2654435761u;
+}
+
+// called with lock
+static struct mem_handle* handle_find(uint32_t handle, int create) {
+  if (MS.table == NULL) {
+    if (!create) {
       return NULL;
     }
-    if (!ATOMIC_CAS(&mem->allocated, oldallocated, 0)) {
-      return NULL;
+    MS.cap = DEFAULT_HANDLE_TABLE;
+    MS.table = calloc(MS.cap, sizeof(struct mem_handle*));
+  }
+  uint32_t mask = MS.cap - 1;
+  uint32_t i = handle_hash(handle) & mask;
+  for (; MS.table[i]; i = (i + 1) & mask) {
+    if (MS.table[i]->handle == handle) {
+      return MS.table[i];
     }
   }
-  if (mem->handle != handle) {
-    // this mem has owner but inconsist with current handle
+  if (!create) {
     return NULL;
   }
-  return &mem->allocated;
+  struct mem_handle *h = calloc(1, sizeof(*h));
+  h->handle = handle;
+  h->bound = INT64_MAX;
+  MS.table[i] = h;
+  if (++MS.cnt * 2 > MS.cap) {
+    // grow at half load, probing stays short
+    uint32_t cap = MS.cap * 2;
+    struct mem_handle **table = calloc(cap, sizeof(struct mem_handle*));
+    for (uint32_t j = 0; j < MS.cap; j ++) {
+      struct mem_handle *e = MS.table[j];
+      if (e) {
+        uint32_t k = handle_hash(e->handle) & (cap - 1);
+        while (table[k]) {
+          k = (k + 1) & (cap - 1);
+        }
+        table[k] = e;
+      }
+    }
+    free(MS.table);
+    MS.table = table;
+    MS.cap = cap;
+  }
+  return h;
+}
+
+// called with lock
+static inline void delta_fold(struct mem_delta *d) {
+  if (d->owner) {
+    d->owner->allocated += d->size;
+    d->size = 0;
+  }
+}
+
+static void thread_exit(void *ud) {
+  struct mem_thread *t = ud;
+  spinlock_lock(&MS.lock);
+  for (int i = 0; i < DELTA_SIZE; i ++) {
+    delta_fold(&t->delta[i]);
+  }
+  MS.usage += t->usage;
+  MS.blocks += t->blocks;
+  if (t->prev) {
+    t->prev->next = t->next;
+  } else {
+    MS.threads = t->next;
+  }
+  if (t->next) {
+    t->next->prev = t->prev;
+  }
+  spinlock_unlock(&MS.lock);
+  free(t);
+  current_thread = NULL;
+}
+
+static void mem_init() {
+  pthread_key_create(&MS.key, thread_exit);
+}
+
+static struct mem_thread* thread_register() {
+  pthread_once(&mem_once, mem_init);
+  struct mem_thread *t = calloc(1, sizeof(*t));
+  t->seed = (uintptr_t)t * 0x9e3779b97f4a7c15ULL | 1;
+  spinlock_lock(&MS.lock);
+  t->next = MS.threads;
+  if (MS.threads) {
+    MS.threads->prev = t;
+  }
+  MS.threads = t;
+  spinlock_unlock(&MS.lock);
+  pthread_setspecific(MS.key, t);
+  current_thread = t;
+  return t;
 }
 
-static inline void track_memory_stat_alloc(uint32_t handle, size_t sz) {
-  ATOMIC_ADD(&_mem_usage, sz);
-  ATOMIC_INC(&_mem_blocks);
-  ATOMIC_SZ *allocated = get_handle_allocated(handle);
-  if (allocated) {
-    ATOMIC_ADD(allocated, sz);
+static inline struct mem_delta* thread_delta(struct mem_thread *t, uint32_t handle) {
+  struct mem_delta *d = &t->delta[handle_hash(handle) % DELTA_SIZE];
+  if (d->owner == NULL || d->handle != handle) {
+    spinlock_lock(&MS.lock);
+    delta_fold(d);
+    d->owner = handle_find(handle, 1);
+    d->handle = handle;
+    spinlock_unlock(&MS.lock);
   }
+  return d;
+}
+
+static inline struct mem_thread* thread_current() {
+  struct mem_thread *t = current_thread;
+  if (t == NULL) {
+    t = thread_register();
+  }
+  return t;
+}
+
+static inline void track_memory_delta(struct mem_thread *t, struct mem_delta *d, int64_t sz, int blocks) {
+  t->usage += sz;
+  t->blocks += blocks;
+  d->size += sz;
+  if (d->size > DELTA_FLUSH || d->size < -DELTA_FLUSH) {
+    spinlock_lock(&MS.lock);
+    delta_fold(d);
+    spinlock_unlock(&MS.lock);
+  }
+}
+
+// called with lock
+static inline void limit_rebound(struct mem_handle *h) {
+  int64_t bound = INT64_MAX;
+  if (h->soft && !h->soft_fired) {
+    bound = h->soft;
+  }
+  if (h->hard && h->hard < bound) {
+    bound = h->hard;
+  }
+  h->bound = bound;
+}
+
+// called with lock
+static int64_t handle_pending(uint32_t handle) {
+  int64_t r = 0;
+  uint32_t idx = handle_hash(handle) % DELTA_SIZE;
+  for (struct mem_thread *t = MS.threads; t; t = t->next) {
+    struct mem_delta *d = &t->delta[idx];
+    if (d->owner && d->handle == handle) {
+      r += d->size;
+    }
+  }
+  return r;
+}
+
+// slow path when allocation may cross a limit, return 0 if it's rejected by hard limit
+static int limit_check(struct mem_delta *d, size_t sz) {
+  struct mem_handle *h = d->owner;
+  int hard = -1;
+  spinlock_lock(&MS.lock);
+  int64_t usage = h->allocated + handle_pending(h->handle) + (int64_t)sz;
+  if (h->hard && usage > h->hard) {
+    hard = 1;
+  } else if (h->soft && !h->soft_fired && usage > h->soft) {
+    h->soft_fired = 1;
+    limit_rebound(h);
+    hard = 0;
+  }
+  leptonet_memory_limit_cb cb = MS.cb;
+  void *ud = MS.cb_ud;
+  spinlock_unlock(&MS.lock);
+  if (hard >= 0 && cb && !in_limit_cb) {
+    in_limit_cb = 1;
+    cb(ud, h->handle, usage, hard);
+    in_limit_cb = 0;
+  }
+  return hard != 1;
+}
+
+// return 0 if handle is over its hard limit
+static inline int track_memory_stat_alloc(uint32_t handle, size_t sz) {
+  struct mem_thread *t = thread_current();
+  struct mem_delta *d = thread_delta(t, handle);
+  // other threads' pending deltas are not seen here, so a limit may be passed by DELTA_FLUSH per thread
+  if (d->owner->allocated + d->size + (int64_t)sz > d->owner->bound && !limit_check(d, sz)) {
+    return 0;
+  }
+  track_memory_delta(t, d, sz, 1);
+  return 1;
 }
 
 static inline void track_memory_stat_free(uint32_t handle, size_t sz) {
-  ATOMIC_SUB(&_mem_usage, sz);
-  ATOMIC_DEC(&_mem_blocks);
-  ATOMIC_SZ *allocated = get_handle_allocated(handle);
-  if (allocated) {
-    ATOMIC_SUB(allocated, sz);
+  struct mem_thread *t = thread_current();
+  track_memory_delta(t, thread_delta(t, handle), -(int64_t)sz, -1);
+}
+
+// folded bytes plus pending deltas of all threads
+static int64_t handle_usage(uint32_t handle) {
+  spinlock_lock(&MS.lock);
+  struct mem_handle *h = handle_find(handle, 0);
+  int64_t r = h ? h->allocated + handle_pending(handle) : 0;
+  spinlock_unlock(&MS.lock);
+  // alloc and free on different threads may be seen out of order
+  return r > 0 ? r : 0;
+}
+
+// xorshift64*
+static inline uint64_t sample_random(struct mem_thread *t) {
+  uint64_t x = t->seed;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  t->seed = x;
+  return x * 0x2545f4914f6cdd1dULL;
+}
+
+// exponential intervals make sample points a poisson process over allocated bytes
+// so a large allocation is more likely to be sampled than a small one, without bias to allocation pattern
+static inline int64_t sample_interval(struct mem_thread *t, size_t rate) {
+  double u = ((sample_random(t) >> 11) + 1) * (1.0 / 9007199254740992.0);
+  return (int64_t)(-log(u) * rate);
+}
+
+// one subtraction on fast path
+static inline int profile_should_sample(size_t sz) {
+  struct mem_thread *t = thread_current();
+  t->sample_left -= sz;
+  if (t->sample_left >= 0) {
+    return 0;
+  }
+  size_t rate = ATOMIC_LOAD(&MP.rate);
+  if (rate == 0) {
+    t->sample_left = SAMPLE_IDLE;
+    return 0;
+  }
+  t->sample_left = sample_interval(t, rate);
+  return 1;
+}
+
+static inline uint32_t sample_hash(void *ptr) {
+  return ((uintptr_t)ptr >> 4) % SAMPLE_HASH;
+}
+
+// return 1 if ptr is recorded, called by leptonet_malloc directly, so that SAMPLE_SKIP is stable
+static int __attribute__((noinline)) profile_record(void *ptr, uint32_t handle, size_t sz) {
+  void *stack[SAMPLE_DEPTH + SAMPLE_SKIP];
+  int n = backtrace(stack, SAMPLE_DEPTH + SAMPLE_SKIP);
+  struct mem_sample *s = malloc(sizeof(*s));
+  if (s == NULL) {
+    return 0;
   }
+  s->ptr = ptr;
+  s->size = sz;
+  s->rate = ATOMIC_LOAD(&MP.rate);
+  s->handle = handle;
+  s->depth = n > SAMPLE_SKIP ? n - SAMPLE_SKIP : 0;
+  memcpy(s->stack, stack + SAMPLE_SKIP, s->depth * sizeof(void*));
+  uint32_t h = sample_hash(ptr);
+  spinlock_lock(&MP.lock);
+  s->next = MP.hash[h];
+  MP.hash[h] = s;
+  spinlock_unlock(&MP.lock);
+  return 1;
 }
 
-static inline void* fill_prefix(void * ptr, size_t size, uint32_t cookie_size) {
-  uint32_t handle = leptonet_context_current_handle();
+static void profile_remove(void *ptr) {
+  uint32_t h = sample_hash(ptr);
+  struct mem_sample *s = NULL;
+  spinlock_lock(&MP.lock);
+  for (struct mem_sample *volatile *p = &MP.hash[h]; *p; p = &(*p)->next) {
+    if ((*p)->ptr == ptr) {
+      s = *p;
+      *p = s->next;
+      break;
+    }
+  }
+  spinlock_unlock(&MP.lock);
+  free(s);
+}
+
+static inline void* fill_prefix(uint32_t handle, void * ptr, size_t size, uint32_t cookie_size) {
   struct mem_cookie* mem = ptr;
   mem->handle = handle;
   mem->mem_size = size;
   mem->dummy_tag = MEM_ALLOCATED;
   void *ret = ptr + cookie_size;
   memcpy(ret - sizeof(uint32_t), &cookie_size, sizeof (cookie_size));
-  track_memory_stat_alloc(handle, size);
   return ret;
 }
 
 static inline void* clear_prefix(void *ptr, uint32_t cookie_size) {
   uint32_t prefix_size = get_cookie_size(ptr);
   struct mem_cookie *mem = (struct mem_cookie*)((char*)ptr - prefix_size);
-  assert(mem->dummy_tag == MEM_ALLOCATED);
+  assert(mem->dummy_tag == MEM_ALLOCATED || mem->dummy_tag == MEM_SAMPLED);
+  if (mem->dummy_tag == MEM_SAMPLED) {
+    profile_remove(ptr);
+  }
   mem->dummy_tag = MEM_RELEASED;
   track_memory_stat_free(mem->handle, mem->mem_size);
   return mem;
 }
 
-void* leptonet_malloc(size_t sz) {
-  void *ptr = malloc(sz + PREFIX_SIZE);
-  return fill_prefix(ptr, sz, PREFIX_SIZE);
+// always inlined, so that profile_record is called by leptonet_malloc directly
+static inline __attribute__((always_inline)) void* mem_alloc(uint32_t handle, size_t sz) {
+  size_t tracked = sz;
+#ifdef LEPTONET_MALLOC_NOCOOKIE
+  size_t usable = leptonet_slab_round(sz);
+  if (usable) {
+    if (!track_memory_stat_alloc(handle, usable)) {
+      return NULL;
+    }
+    void *ptr = leptonet_slab_tryalloc(sz);
+    if (ptr) {
+      *leptonet_slab_tag(ptr) = handle;
+      if (profile_should_sample(usable)) {
+        profile_record(ptr, handle, usable);
+      }
+      return ptr;
+    }
+    // arena is used up, usable size is recorded in cookie instead
+    tracked = usable;
+  } else if (!track_memory_stat_alloc(handle, sz)) {
+    return NULL;
+  }
+#else
+  if (!track_memory_stat_alloc(handle, sz)) {
+    return NULL;
+  }
+#endif
+  void *ptr = raw_malloc(tracked + PREFIX_SIZE);
+  void *ret = fill_prefix(handle, ptr, tracked, PREFIX_SIZE);
+  if (profile_should_sample(tracked) && profile_record(ret, handle, tracked)) {
+    ((struct mem_cookie*)ptr)->dummy_tag = MEM_SAMPLED;
+  }
+  return ret;
 }
 
-void leptonet_free(void* ptr) {
+static inline void mem_free(void *ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+#ifdef LEPTONET_MALLOC_NOCOOKIE
+  uint32_t *tag = leptonet_slab_tag(ptr);
+  if (tag) {
+    // a sample is inserted before ptr escapes its allocating thread, so an empty bucket means no sample
+    if (ATOMIC_LOAD(&MP.hash[sample_hash(ptr)])) {
+      profile_remove(ptr);
+    }
+    track_memory_stat_free(*tag, leptonet_slab_size(ptr));
+    leptonet_slab_free(ptr);
+    return;
+  }
+#endif
   void* p = clear_prefix(ptr, PREFIX_SIZE);
-  free(p);
+  raw_free(p);
 }
 
-static inline void* dfill_prefix(uint32_t handle, void * ptr, size_t size, uint32_t cookie_size) {
-  struct mem_cookie* mem = ptr;
-  mem->handle = handle;
-  mem->mem_size = size;
-  mem->dummy_tag = MEM_ALLOCATED;
-  void *ret = ptr + cookie_size;
-  memcpy(ret - sizeof(uint32_t), &cookie_size, sizeof (cookie_size));
-  track_memory_stat_alloc(handle, size);
-  return ret;
+void* leptonet_malloc(size_t sz) {
+  return mem_alloc(leptonet_context_current_handle(), sz);
+}
+
+void leptonet_free(void* ptr) {
+  mem_free(ptr);
 }
 
 void* dleptonet_malloc(uint32_t handle, size_t sz) {
-  void *ptr = malloc(sz + PREFIX_SIZE);
-  return dfill_prefix(handle, ptr, sz, PREFIX_SIZE);
+  return mem_alloc(handle, sz);
 }
 
 void dleptonet_free(void* ptr) {
-  void* p = clear_prefix(ptr, PREFIX_SIZE);
-  free(p);
+  mem_free(ptr);
 }
 
 size_t dleptonet_malloc_memory_usage(void* ptr, uint32_t *handle) {
+#ifdef LEPTONET_MALLOC_NOCOOKIE
+  uint32_t *tag = leptonet_slab_tag(ptr);
+  if (tag) {
+    *handle = *tag;
+    return handle_usage(*tag);
+  }
+#endif
   uint32_t prefix_size = get_cookie_size(ptr);
   struct mem_cookie *mem = (struct mem_cookie*)((char*)ptr - prefix_size);
-  ATOMIC_SZ *size = get_handle_allocated(mem->handle);
-  if (size) {
-    *handle = mem->handle;
-    return *size;
-  }
-  return 0;
+  *handle = mem->handle;
+  return handle_usage(mem->handle);
 }
 
 size_t leptonet_memory_usage_handle(uint32_t handle) {
-  ATOMIC_SZ *size = get_handle_allocated(handle);
-  if (size) {
-    return *size;
-  }
-  return 0;
+  return handle_usage(handle);
 }
 
 uint64_t leptonet_memory_usage() {
-  return ATOMIC_LOAD(&_mem_usage);
+  spinlock_lock(&MS.lock);
+  int64_t r = MS.usage;
+  for (struct mem_thread *t = MS.threads; t; t = t->next) {
+    r += t->usage;
+  }
+  spinlock_unlock(&MS.lock);
+  return r > 0 ? r : 0;
 }
 
 uint64_t leptonet_memory_blocks() {
-  return ATOMIC_LOAD(&_mem_blocks);
+  spinlock_lock(&MS.lock);
+  int64_t r = MS.blocks;
+  for (struct mem_thread *t = MS.threads; t; t = t->next) {
+    r += t->blocks;
+  }
+  spinlock_unlock(&MS.lock);
+  return r > 0 ? r : 0;
+}
+
+void leptonet_memory_limit(uint32_t handle, size_t soft, size_t hard) {
+  spinlock_lock(&MS.lock);
+  struct mem_handle *h = handle_find(handle, 1);
+  h->soft = soft;
+  h->hard = hard;
+  h->soft_fired = 0;
+  limit_rebound(h);
+  spinlock_unlock(&MS.lock);
+}
+
+void leptonet_memory_limit_callback(leptonet_memory_limit_cb cb, void *ud) {
+  spinlock_lock(&MS.lock);
+  MS.cb = cb;
+  MS.cb_ud = ud;
+  spinlock_unlock(&MS.lock);
+}
+
+void leptonet_memory_profile_rate(size_t rate) {
+  if (rate) {
+    // backtrace may allocate on first call, do it before any sample is taken
+    void *stack[1];
+    backtrace(stack, 1);
+    MP.last_rate = rate;
+  }
+  ATOMIC_STORE(&MP.rate, rate);
+  // other threads see new rate within SAMPLE_IDLE bytes
+  thread_current()->sample_left = 0;
+}
+
+static int sample_compare(const void *a, const void *b) {
+  const struct mem_sample *x = *(const struct mem_sample**)a;
+  const struct mem_sample *y = *(const struct mem_sample**)b;
+  if (x->handle != y->handle) {
+    return x->handle < y->handle ? -1 : 1;
+  }
+  if (x->depth != y->depth) {
+    return x->depth - y->depth;
+  }
+  return memcmp(x->stack, y->stack, x->depth * sizeof(void*));
+}
+
+static inline int sample_same_stack(struct mem_sample *x, struct mem_sample *y) {
+  return x->depth == y->depth && memcmp(x->stack, y->stack, x->depth * sizeof(void*)) == 0;
 }
 
+// expected bytes allocated at this site for one sample of size
+static inline double sample_estimate(struct mem_sample *s) {
+  if (s->rate == 0 || s->size == 0) {
+    return s->size;
+  }
+  return s->size / (1 - exp(-(double)s->size / s->rate));
+}
+
+static void dump_pprof(FILE *f, struct mem_sample **samples, int n) {
+  int64_t count = 0, bytes = 0;
+  for (int i = 0; i < n; i ++) {
+    count++;
+    bytes += samples[i]->size;
+  }
+  // heap_v2 tells pprof to unsample counts with rate
+  fprintf(f, "heap profile: %6lld: %8lld [%6lld: %8lld] @ heap_v2/%zu\n",
+          (long long)count, (long long)bytes, (long long)count, (long long)bytes, MP.last_rate);
+  // samples are sorted by handle first, so same stack of different handles are merged by pprof
+  for (int i = 0; i < n; i ++) {
+    struct mem_sample *s = samples[i];
+    fprintf(f, "%6d: %8lld [%6d: %8lld] @", 1, (long long)s->size, 1, (long long)s->size);
+    for (int j = 0; j < s->depth; j ++) {
+      fprintf(f, " %p", s->stack[j]);
+    }
+    fprintf(f, "\n");
+  }
+  fprintf(f, "\nMAPPED_LIBRARIES:\n");
+  FILE *maps = fopen("/proc/self/maps", "r");
+  if (maps) {
+    char buf[4096];
+    size_t sz;
+    while ((sz = fread(buf, 1, sizeof buf, maps)) > 0) {
+      fwrite(buf, 1, sz, f);
+    }
+    fclose(maps);
+  }
+}
+
+static void dump_folded(FILE *f, struct mem_sample **samples, int n) {
+  int i = 0;
+  while (i < n) {
+    // merge same stack of same handle
+    double bytes = 0;
+    int j = i;
+    for (; j < n && samples[j]->handle == samples[i]->handle && sample_same_stack(samples[i], samples[j]); j ++) {
+      bytes += sample_estimate(samples[j]);
+    }
+    struct mem_sample *s = samples[i];
+    // root first, handle is the root frame
+    fprintf(f, "handle_%08x", s->handle);
+    for (int k = s->depth - 1; k >= 0; k --) {
+      Dl_info info;
+      if (dladdr(s->stack[k], &info) && info.dli_sname) {
+        fprintf(f, ";%s", info.dli_sname);
+      } else {
+        fprintf(f, ";%p", s->stack[k]);
+      }
+    }
+    fprintf(f, " %lld\n", (long long)(bytes + 0.5));
+    i = j;
+  }
+}
+
+int leptonet_memory_profile_dump(FILE *f, int format) {
+  // copy out live samples, so that allocation isn't blocked by dumping
+  spinlock_lock(&MP.lock);
+  int n = 0;
+  for (int i = 0; i < SAMPLE_HASH; i ++) {
+    for (struct mem_sample *s = MP.hash[i]; s; s = s->next) {
+      n++;
+    }
+  }
+  struct mem_sample *copy = malloc(sizeof(struct mem_sample) * (n ? n : 1));
+  struct mem_sample **samples = malloc(sizeof(struct mem_sample*) * (n ? n : 1));
+  n = 0;
+  for (int i = 0; i < SAMPLE_HASH; i ++) {
+    for (struct mem_sample *s = MP.hash[i]; s; s = s->next) {
+      copy[n] = *s;
+      samples[n] = &copy[n];
+      n++;
+    }
+  }
+  spinlock_unlock(&MP.lock);
+  qsort(samples, n, sizeof(struct mem_sample*), sample_compare);
+  if (format == LEPTONET_PROFILE_FOLDED) {
+    dump_folded(f, samples, n);
+  } else {
+    dump_pprof(f, samples, n);
+  }
+  fflush(f);
+  free(samples);
+  free(copy);
+  return n;
+}
@@ -1,13 +1,34 @@
 #ifndef __LEPTONET_MALLOC_HOOK_H__
 #define __LEPTONET_MALLOC_HOOK_H__
 
+#include <stdio.h>
 #include <stdint.h>
 #include <stddef.h>
 
+#define LEPTONET_PROFILE_PPROF 0
+#define LEPTONET_PROFILE_FOLDED 1
+
 size_t leptonet_memory_usage_handle(uint32_t handle);
 uint64_t leptonet_memory_usage();
 uint64_t leptonet_memory_blocks();
 
+// hard is 1 if an allocation of handle is rejected, leptonet_malloc returns NULL then
+// otherwise handle has crossed its soft limit, it's reported once until limit is set again
+// called on the allocating thread, allocations inside it are never reported again
+typedef void (*leptonet_memory_limit_cb)(void *ud, uint32_t handle, size_t usage, int hard);
+
+// 0 disables a limit, limits may be passed by at most 64KB per thread before being noticed
+void leptonet_memory_limit(uint32_t handle, size_t soft, size_t hard);
+void leptonet_memory_limit_callback(leptonet_memory_limit_cb cb, void *ud);
+
+// sample an allocation about every rate bytes with its backtrace and handle, 0 turns sampling off
+// sampling off costs a subtraction per allocation
+void leptonet_memory_profile_rate(size_t rate);
+// write live samples in gperftools heap profile format for pprof (LEPTONET_PROFILE_PPROF),
+// or in folded stacks with estimated bytes for flame graph (LEPTONET_PROFILE_FOLDED)
+// return the number of live samples
+int leptonet_memory_profile_dump(FILE *f, int format);
+
 // for debug
 void* dleptonet_malloc(uint32_t handle, size_t sz);
 void dleptonet_free(void* ptr);
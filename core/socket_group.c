@@ -0,0 +1,173 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "socket_group.h"
+#include "leptonet_malloc.h"
+#include "atomic.h"
+
+struct reactor {
+  int id;
+  pthread_t thread;
+  struct socket_server *ss;
+  struct socket_group *g;
+};
+
+struct socket_group {
+  int n;
+  socket_group_cb cb;
+  void *ud;
+  ATOMIC_INT next;          // reactor of next connect
+  struct reactor *reactors;
+};
+
+// pin reactor i to core i, it wraps if there are fewer cores
+static void reactor_pin(struct reactor *r) {
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpu <= 0) {
+    return;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(r->id % ncpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof set, &set)) {
+    fprintf(stderr, "[socket-group]: pin reactor %d failed\n", r->id);
+  }
+}
+
+static void* reactor_thread(void *ud) {
+  struct reactor *r = ud;
+  struct socket_group *g = r->g;
+  reactor_pin(r);
+  struct socket_message sm;
+  for (;;) {
+    int type = socket_server_poll(r->ss, &sm);
+    if (type == SOCKET_EXIT) {
+      break;
+    }
+    g->cb(g->ud, type, &sm);
+  }
+  return NULL;
+}
+
+struct socket_group* socket_group_create(int n, uint64_t time, socket_group_cb cb, void *ud) {
+  assert(n > 0 && n <= SOCKET_SHARD_MAX);
+  struct socket_group *g = leptonet_malloc(sizeof *g);
+  g->n = n;
+  g->next = 0;
+  g->cb = cb;
+  g->ud = ud;
+  g->reactors = leptonet_malloc(sizeof(struct reactor) * n);
+  for (int i = 0; i < n; i ++) {
+    struct reactor *r = &g->reactors[i];
+    r->id = i;
+    r->g = g;
+    r->ss = socket_server_create(time);
+    if (r->ss == NULL) {
+      for (int j = 0; j < i; j ++) {
+        socket_server_release(g->reactors[j].ss);
+      }
+      leptonet_free(g->reactors);
+      leptonet_free(g);
+      return NULL;
+    }
+    socket_server_shard(r->ss, i);
+  }
+  for (int i = 0; i < n; i ++) {
+    struct reactor *r = &g->reactors[i];
+    if (pthread_create(&r->thread, NULL, reactor_thread, r)) {
+      fprintf(stderr, "[socket-group]: create reactor %d failed\n", i);
+    }
+  }
+  return g;
+}
+
+void socket_group_release(struct socket_group *g) {
+  for (int i = 0; i < g->n; i ++) {
+    socket_server_exit(g->reactors[i].ss);
+  }
+  for (int i = 0; i < g->n; i ++) {
+    pthread_join(g->reactors[i].thread, NULL);
+    socket_server_release(g->reactors[i].ss);
+  }
+  leptonet_free(g->reactors);
+  leptonet_free(g);
+}
+
+int socket_group_size(struct socket_group *g) {
+  return g->n;
+}
+
+struct socket_server* socket_group_server(struct socket_group *g, int id) {
+  int shard = socket_shard(id);
+  if (shard >= g->n) {
+    return NULL;
+  }
+  return g->reactors[shard].ss;
+}
+
+int socket_group_listen(struct socket_group *g, const char *host, const char *port, int backlog, uintptr_t opaque) {
+  int r = 0;
+  for (int i = 0; i < g->n; i ++) {
+    r |= socket_server_listen(g->reactors[i].ss, host, port, backlog, opaque);
+  }
+  return r;
+}
+
+void socket_group_close(struct socket_group *g, int id, int what, uintptr_t opaque) {
+  struct socket_server *ss = socket_group_server(g, id);
+  if (ss) {
+    socket_server_close(ss, id, what, opaque);
+  }
+}
+
+int socket_group_connect(struct socket_group *g, const char *host, const char *port, uintptr_t opaque) {
+  unsigned int i = (unsigned int)ATOMIC_INC(&g->next) % g->n;
+  return socket_server_connect(g->reactors[i].ss, host, port, opaque);
+}
+
+int socket_group_udp(struct socket_group *g, const char *host, const char *port, uintptr_t opaque) {
+  int r = 0;
+  for (int i = 0; i < g->n; i ++) {
+    r |= socket_server_udp(g->reactors[i].ss, host, port, opaque);
+  }
+  return r;
+}
+
+void socket_group_watermark(struct socket_group *g, int id, size_t high, size_t low, int link) {
+  struct socket_server *ss = socket_group_server(g, id);
+  if (ss) {
+    socket_server_watermark(ss, id, high, low, link);
+  }
+}
+
+void socket_group_sendhigh(struct socket_group *g, struct socket_buffer *buf) {
+  struct socket_server *ss = socket_group_server(g, buf->id);
+  if (ss == NULL) {
+    socket_server_buffer_free(buf->buffer);
+    return;
+  }
+  socket_server_sendhigh(ss, buf);
+}
+
+void socket_group_sendlow(struct socket_group *g, struct socket_buffer *buf) {
+  struct socket_server *ss = socket_group_server(g, buf->id);
+  if (ss == NULL) {
+    socket_server_buffer_free(buf->buffer);
+    return;
+  }
+  socket_server_sendlow(ss, buf);
+}
+
+void socket_group_sendto(struct socket_group *g, struct socket_buffer *buf, const struct socket_udp_address *addr) {
+  struct socket_server *ss = socket_group_server(g, buf->id);
+  if (ss == NULL) {
+    socket_server_buffer_free(buf->buffer);
+    return;
+  }
+  socket_server_sendto(ss, buf, addr);
+}
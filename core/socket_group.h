@@ -0,0 +1,39 @@
+#ifndef __LEPTONET_SOCKET_GROUP_H__
+#define __LEPTONET_SOCKET_GROUP_H__
+
+#include <stdint.h>
+
+#include "socket_server.h"
+
+// N socket server reactors, each one is polled by its own thread pinned to a core
+// every reactor listens on the same port by SO_REUSEPORT, so kernel spreads connections among them
+// a socket id carries the reactor which owns it, requests are routed by that
+struct socket_group;
+
+// called on reactor threads for each message, except SOCKET_EXIT
+typedef void (*socket_group_cb)(void *ud, int type, struct socket_message *sm);
+
+// n is in [1, SOCKET_SHARD_MAX], reactor threads are started at once
+struct socket_group* socket_group_create(int n, uint64_t time, socket_group_cb cb, void *ud);
+// stop and join reactor threads, then release them
+void socket_group_release(struct socket_group *g);
+
+int socket_group_size(struct socket_group *g);
+// reactor which owns id
+struct socket_server* socket_group_server(struct socket_group *g, int id);
+
+// each reactor reports SOCKET_OPEN with its own listen id
+// -1 if a reactor rejects it by memory limit of caller, others still report
+int socket_group_listen(struct socket_group *g, const char *host, const char *port, int backlog, uintptr_t opaque);
+void socket_group_close(struct socket_group *g, int id, int what, uintptr_t opaque);
+// reactors take connections in turn, see socket_server_connect
+int socket_group_connect(struct socket_group *g, const char *host, const char *port, uintptr_t opaque);
+// each reactor reports SOCKET_OPEN with its own udp id, kernel spreads datagrams among them by source, -1 as above
+int socket_group_udp(struct socket_group *g, const char *host, const char *port, uintptr_t opaque);
+void socket_group_sendhigh(struct socket_group *g, struct socket_buffer *buf);
+void socket_group_sendlow(struct socket_group *g, struct socket_buffer *buf);
+// link must be owned by the same reactor as id, e.g. a connection and the one made for it by socket_group_server
+void socket_group_watermark(struct socket_group *g, int id, size_t high, size_t low, int link);
+void socket_group_sendto(struct socket_group *g, struct socket_buffer *buf, const struct socket_udp_address *addr);
+
+#endif
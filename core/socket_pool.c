@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "socket_pool.h"
+#include "atomic.h"
+
+// each pool owns POOL_SIZE bytes of the arena, which are carved into pages of one size class
+#define POOL_NUM 64
+#define POOL_SHIFT 26
+#define POOL_SIZE (1ULL << POOL_SHIFT)
+#define PAGE_SHIFT 16
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define PAGE_NUM (POOL_SIZE >> PAGE_SHIFT)
+
+#define CLASS_MIN_SHIFT 6
+#define CLASS_NUM 11
+
+struct pool_node {
+  struct pool_node *next;
+};
+
+struct socket_pool {
+  ATOMIC_INT leased;
+  int pages;                                    // carved pages
+  char *base;
+  uint8_t page_class[PAGE_NUM];
+  struct pool_node *local[CLASS_NUM];           // taken by leasing thread only
+  struct pool_node *volatile remote[CLASS_NUM]; // returned by any thread, taken all at once by leasing thread
+};
+
+static char *ARENA;
+static pthread_once_t ONCE = PTHREAD_ONCE_INIT;
+static struct socket_pool POOLS[POOL_NUM];
+
+static void arena_init() {
+  // only touched pages take memory
+  void *p = mmap(NULL, POOL_NUM * POOL_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "[socket-pool]: reserve arena failed\n");
+    return;
+  }
+  for (int i = 0; i < POOL_NUM; i ++) {
+    POOLS[i].base = (char*)p + i * POOL_SIZE;
+  }
+  ATOMIC_STORE_REL(&ARENA, (char*)p);
+}
+
+static inline int size_class(size_t sz) {
+  int cls = 0;
+  while (((size_t)SOCKET_POOL_MIN << cls) < sz) {
+    cls++;
+  }
+  return cls;
+}
+
+struct socket_pool* socket_pool_lease() {
+  pthread_once(&ONCE, arena_init);
+  if (ARENA == NULL) {
+    return NULL;
+  }
+  for (int i = 0; i < POOL_NUM; i ++) {
+    if (ATOMIC_LOAD(&POOLS[i].leased) == 0 && ATOMIC_CAS(&POOLS[i].leased, 0, 1)) {
+      return &POOLS[i];
+    }
+  }
+  return NULL;
+}
+
+void socket_pool_return(struct socket_pool *p) {
+  ATOMIC_STORE_REL(&p->leased, 0);
+}
+
+// split a new page into free buffers of cls
+static struct pool_node* pool_carve(struct socket_pool *p, int cls) {
+  if (p->pages == PAGE_NUM) {
+    return NULL;
+  }
+  int page = p->pages++;
+  p->page_class[page] = cls;
+  char *begin = p->base + ((size_t)page << PAGE_SHIFT);
+  size_t sz = (size_t)SOCKET_POOL_MIN << cls;
+  struct pool_node *head = NULL;
+  for (size_t i = PAGE_SIZE / sz; i > 0; i --) {
+    struct pool_node *n = (struct pool_node*)(begin + (i - 1) * sz);
+    n->next = head;
+    head = n;
+  }
+  return head;
+}
+
+void* socket_pool_alloc(struct socket_pool *p, size_t sz) {
+  if (sz > SOCKET_POOL_MAX) {
+    return NULL;
+  }
+  int cls = size_class(sz);
+  struct pool_node *n = p->local[cls];
+  if (n == NULL) {
+    n = ATOMIC_XCHG(&p->remote[cls], NULL);
+    if (n == NULL) {
+      n = pool_carve(p, cls);
+      if (n == NULL) {
+        return NULL;
+      }
+    }
+  }
+  p->local[cls] = n->next;
+  return n;
+}
+
+static inline struct socket_pool* pool_of(void *ptr, size_t *page) {
+  char *arena = ATOMIC_LOAD_ACQ(&ARENA);
+  if (arena == NULL || (char*)ptr < arena || (char*)ptr >= arena + POOL_NUM * POOL_SIZE) {
+    return NULL;
+  }
+  size_t off = (char*)ptr - arena;
+  *page = (off & (POOL_SIZE - 1)) >> PAGE_SHIFT;
+  return &POOLS[off >> POOL_SHIFT];
+}
+
+bool socket_pool_free(void *ptr) {
+  size_t page;
+  struct socket_pool *p = pool_of(ptr, &page);
+  if (p == NULL) {
+    return false;
+  }
+  int cls = p->page_class[page];
+  struct pool_node *n = ptr;
+  // push only, leasing thread takes the whole list by exchange, so there is no ABA
+  struct pool_node *head;
+  do {
+    head = p->remote[cls];
+    n->next = head;
+  } while (!ATOMIC_CAS(&p->remote[cls], head, n));
+  return true;
+}
+
+size_t socket_pool_size(void *ptr) {
+  size_t page;
+  struct socket_pool *p = pool_of(ptr, &page);
+  if (p == NULL) {
+    return 0;
+  }
+  return (size_t)SOCKET_POOL_MIN << p->page_class[page];
+}
@@ -0,0 +1,27 @@
+#ifndef __LEPTONET_SOCKET_POOL_H__
+#define __LEPTONET_SOCKET_POOL_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// read buffers of a reactor, power of two size classes from 64B to 64KB
+// pools are carved from one reserved arena, so any thread can return a buffer to its pool by address
+#define SOCKET_POOL_MIN 64
+#define SOCKET_POOL_MAX (64 * 1024)
+
+struct socket_pool;
+
+// NULL if all pools are leased
+struct socket_pool* socket_pool_lease();
+// buffers of it stay valid, they are reused by next lease
+void socket_pool_return(struct socket_pool *p);
+
+// only the leasing thread can call it, capacity of buffer is sz rounded up to power of two
+// NULL if sz is beyond SOCKET_POOL_MAX or pool is full
+void* socket_pool_alloc(struct socket_pool *p, size_t sz);
+// any thread, false if ptr isn't from a pool
+bool socket_pool_free(void *ptr);
+// capacity of ptr, 0 if ptr isn't from a pool
+size_t socket_pool_size(void *ptr);
+
+#endif
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+
+#include "socket_resolver.h"
+#include "leptonet_malloc.h"
+
+// power of two
+#define CACHE_SLOTS 256
+// names beyond it aren't cached
+#define CACHE_MAX 4096
+
+struct resolve_job {
+  char *host;
+  char *port;
+  char *key;
+  int socktype;
+  bool passive;
+  socket_resolver_cb cb;
+  void *ud;
+  struct resolve_job *next;
+};
+
+struct cache_entry {
+  char *key;
+  uint64_t expire;
+  struct socket_resolved r;
+  struct cache_entry *next;
+};
+
+struct resolver {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  struct resolve_job *head;
+  struct resolve_job *tail;
+  int entries;
+  struct cache_entry *slots[CACHE_SLOTS];
+};
+
+static struct resolver R;
+static pthread_once_t ONCE = PTHREAD_ONCE_INIT;
+
+static inline uint64_t now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static inline uint32_t key_hash(const char *key) {
+  uint32_t h = 2166136261u;
+  for (; *key; key++) {
+    h = (h ^ (uint8_t)*key) * 16777619u;
+  }
+  return h;
+}
+
+// called with mutex, false if it's missing or expired
+static bool cache_get(const char *key, uint64_t now, struct socket_resolved *r) {
+  for (struct cache_entry *e = R.slots[key_hash(key) & (CACHE_SLOTS - 1)]; e; e = e->next) {
+    if (strcmp(e->key, key) == 0) {
+      if (e->expire <= now) {
+        return false;
+      }
+      *r = e->r;
+      return true;
+    }
+  }
+  return false;
+}
+
+// called with mutex, expired entries of the slot are dropped on the way
+static void cache_put(const char *key, uint64_t now, const struct socket_resolved *r) {
+  uint64_t expire = now + (r->err ? SOCKET_RESOLVER_NEGATIVE_TTL : SOCKET_RESOLVER_TTL);
+  struct cache_entry **pe = &R.slots[key_hash(key) & (CACHE_SLOTS - 1)];
+  while (*pe) {
+    struct cache_entry *e = *pe;
+    if (strcmp(e->key, key) == 0) {
+      e->r = *r;
+      e->expire = expire;
+      return;
+    }
+    if (e->expire <= now) {
+      *pe = e->next;
+      leptonet_free(e->key);
+      leptonet_free(e);
+      R.entries--;
+      continue;
+    }
+    pe = &e->next;
+  }
+  if (R.entries >= CACHE_MAX) {
+    return;
+  }
+  struct cache_entry *e = leptonet_malloc(sizeof *e);
+  if (e == NULL) {
+    return;
+  }
+  e->key = leptonet_strdup(key);
+  if (e->key == NULL) {
+    leptonet_free(e);
+    return;
+  }
+  e->expire = expire;
+  e->r = *r;
+  e->next = NULL;
+  *pe = e;
+  R.entries++;
+}
+
+static void resolve(struct resolve_job *job, struct socket_resolved *r) {
+  struct addrinfo hints, *res, *p;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = job->socktype;
+  hints.ai_flags = job->passive ? AI_PASSIVE : AI_ADDRCONFIG;
+  memset(r, 0, sizeof *r);
+  r->err = getaddrinfo(job->host, job->port, &hints, &res);
+  if (r->err) {
+    return;
+  }
+  for (p = res; p && r->n < SOCKET_RESOLVER_ADDRS; p = p->ai_next) {
+    if (p->ai_addrlen > sizeof r->addrs[0].addr) {
+      continue;
+    }
+    memcpy(&r->addrs[r->n].addr, p->ai_addr, p->ai_addrlen);
+    r->addrs[r->n].len = p->ai_addrlen;
+    r->n++;
+  }
+  freeaddrinfo(res);
+}
+
+static void job_free(struct resolve_job *job) {
+  if (job->host) {
+    leptonet_free(job->host);
+  }
+  if (job->port) {
+    leptonet_free(job->port);
+  }
+  if (job->key) {
+    leptonet_free(job->key);
+  }
+  leptonet_free(job);
+}
+
+static void* resolver_thread(void *ud) {
+  (void)ud;
+  for (;;) {
+    pthread_mutex_lock(&R.mutex);
+    while (R.head == NULL) {
+      pthread_cond_wait(&R.cond, &R.mutex);
+    }
+    struct resolve_job *job = R.head;
+    R.head = job->next;
+    if (R.head == NULL) {
+      R.tail = NULL;
+    }
+    // it may be resolved by another thread while it's queued
+    struct socket_resolved r;
+    bool hit = cache_get(job->key, now_sec(), &r);
+    pthread_mutex_unlock(&R.mutex);
+
+    if (!hit) {
+      resolve(job, &r);
+      pthread_mutex_lock(&R.mutex);
+      cache_put(job->key, now_sec(), &r);
+      pthread_mutex_unlock(&R.mutex);
+    }
+    job->cb(job->ud, &r);
+    job_free(job);
+  }
+  return NULL;
+}
+
+static void resolver_init() {
+  pthread_mutex_init(&R.mutex, NULL);
+  pthread_cond_init(&R.cond, NULL);
+  for (int i = 0; i < SOCKET_RESOLVER_THREADS; i ++) {
+    pthread_t pid;
+    if (pthread_create(&pid, NULL, resolver_thread, NULL)) {
+      fprintf(stderr, "[socket-resolver]: create resolver thread failed\n");
+      continue;
+    }
+    pthread_detach(pid);
+  }
+}
+
+void socket_resolver_query(const char *host, const char *port, int socktype, bool passive, socket_resolver_cb cb, void *ud) {
+  pthread_once(&ONCE, resolver_init);
+  char key[512];
+  snprintf(key, sizeof key, "%s|%s|%d|%d", host ? host : "", port ? port : "", socktype, passive);
+
+  pthread_mutex_lock(&R.mutex);
+  struct socket_resolved r;
+  if (cache_get(key, now_sec(), &r)) {
+    pthread_mutex_unlock(&R.mutex);
+    cb(ud, &r);
+    return;
+  }
+  struct resolve_job *job = leptonet_malloc(sizeof *job);
+  if (job) {
+    job->host = host ? leptonet_strdup(host) : NULL;
+    job->port = leptonet_strdup(port ? port : "0");
+    job->key = leptonet_strdup(key);
+  }
+  if (job == NULL || (host && job->host == NULL) || job->port == NULL || job->key == NULL) {
+    // caller is over its hard memory limit
+    pthread_mutex_unlock(&R.mutex);
+    if (job) {
+      job_free(job);
+    }
+    memset(&r, 0, sizeof r);
+    r.err = EAI_MEMORY;
+    cb(ud, &r);
+    return;
+  }
+  job->socktype = socktype;
+  job->passive = passive;
+  job->cb = cb;
+  job->ud = ud;
+  job->next = NULL;
+  if (R.tail) {
+    R.tail->next = job;
+  } else {
+    R.head = job;
+  }
+  R.tail = job;
+  pthread_cond_signal(&R.cond);
+  pthread_mutex_unlock(&R.mutex);
+}
@@ -0,0 +1,34 @@
+#ifndef __LEPTONET_SOCKET_RESOLVER_H__
+#define __LEPTONET_SOCKET_RESOLVER_H__
+
+#include <stdbool.h>
+#include <sys/socket.h>
+
+// getaddrinfo is run by a few resolver threads, so socket threads never block on dns
+// results are cached by host, port and socket type, getaddrinfo doesn't tell ttl, so a fixed one is used
+#define SOCKET_RESOLVER_THREADS 2
+// seconds of a resolved name
+#define SOCKET_RESOLVER_TTL 60
+// seconds of a failed name
+#define SOCKET_RESOLVER_NEGATIVE_TTL 5
+// addresses kept for a name
+#define SOCKET_RESOLVER_ADDRS 4
+
+struct socket_resolved {
+  int err;  // 0, or EAI_* of getaddrinfo
+  int n;    // number of addresses
+  struct {
+    socklen_t len;
+    struct sockaddr_storage addr;
+  } addrs[SOCKET_RESOLVER_ADDRS];
+};
+
+// called once for each query, on a resolver thread, or on the calling thread if it's cached
+// err is EAI_MEMORY if the query is rejected by memory limit of caller
+typedef void (*socket_resolver_cb)(void *ud, const struct socket_resolved *r);
+
+// host may be NULL for passive, i.e. any address to bind
+// host and port are copied, threads are started by the first query
+void socket_resolver_query(const char *host, const char *port, int socktype, bool passive, socket_resolver_cb cb, void *ud);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,22 +7,68 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/select.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sched.h>
+#include <sys/eventfd.h>
 #include <assert.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
 
 #include "epoll.h"
 #include "socket_server.h"
 #include "leptonet_malloc.h"
+#include "socket_pool.h"
+#include "socket_resolver.h"
+#include "atomic.h"
+#ifdef LEPTONET_USE_IO_URING
+#include "uring.h"
+#endif
 
 // socket server properties
 #define SOCKET_IDMAX (1 << 16)
+// low bits of id are shard of the reactor, see socket_shard
+#define HASH_ID(id) ((((unsigned)(id)) >> SOCKET_SHARD_BITS) % SOCKET_IDMAX)
 #define EVENT_MAX 256
-
-#define TMP_PACKAGE_SIZE 256
-#define TCP_MIN_READBYTES 64
+// pending requests, power of two
+#define CMD_RING_SIZE 4096
+// buffers gathered by one sendmsg
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// since linux 4.14, in case of old libc headers
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+// minread is a power of two in this range, which is a size class of read buffer pool
+#define TCP_MIN_READBYTES SOCKET_POOL_MIN
+#define TCP_MAX_READBYTES SOCKET_POOL_MAX
+
+// epoll is edge triggered, so a readable socket is kept in ready list until it's drained
+// a socket reads at most READ_BUDGET bytes in its turn, then it goes to the tail of ready list
+#define READ_BUDGET (256 * 1024)
+// a listen socket accepts at most ACCEPT_BUDGET connections in its turn
+#define ACCEPT_BUDGET 64
+
+// datagrams moved by one recvmmsg or sendmmsg
+#define UDP_BATCH 64
+// recvmmsg slot, it holds any udp payload
+#define UDP_MAX_DATAGRAM (64 * 1024)
+// source address is stored after data, aligned
+#define UDP_ADDRESS_OFFSET(sz) (((sz) + 7) & ~(size_t)7)
 
 // socket status
 #define SOCKET_TYPE_INVALID 0
@@ -32,10 +79,14 @@
 #define SOCKET_TYPE_CONNECTED 4
 #define SOCKET_TYPE_HALFCLOSE_WRITE 5
 #define SOCKET_TYPE_HALFCLOSE_READ 6
+// non-blocking connect is in progress, completed by EPOLLOUT
+#define SOCKET_TYPE_CONNECTING 7
 
 // for internal used
 #define SOCKET_MORE 1
 
+#define CACHELINE_SIZE 64
+
 struct socket_stat {
   uint64_t rbytes;
   uint64_t wbytes;
@@ -54,14 +105,36 @@ struct write_buffer {
   void *buffer;
   char *ptr;
   size_t sz;
+  bool zerocopy;              // sent by MSG_ZEROCOPY, pages are owned by kernel until completion
+  uint32_t zc_seq;            // sequence of the last MSG_ZEROCOPY send which refers to it
   struct write_buffer *next;
 };
 
+// datagram of udp socket, addr.len is 0 for the connected peer
+struct write_buffer_udp {
+  struct write_buffer wb;
+  struct socket_udp_address addr;
+};
+
 struct write_list {
   struct write_buffer *head;
   struct write_buffer *tail;
 };
 
+struct socket;
+
+// a sendmsg submitted to io_uring, buffers stay in write lists until it completes
+struct send_op {
+  struct socket *s;           // NULL if socket is closed meanwhile, then lists below are owned by it
+  struct write_list high;
+  struct write_list low;
+  size_t hbytes;              // bytes gathered from high list, new buffers may be appended to it meanwhile
+  struct write_buffer *large; // sent by MSG_ZEROCOPY
+  int flags;
+  struct msghdr msg;
+  struct iovec iov[];
+};
+
 struct socket {
   int id;                     // unique socket id
   int fd;                     // socket file descriptor
@@ -70,56 +143,222 @@ struct socket {
   int protocol;               // IPPROTO_TCP, IPPROTO_UDP
   int status;                 // socket status
   bool read;                  // read flag
-  bool write;                 // write flag
-  bool closing;               // user close flag
+  bool closing;               // user close flag, or closed by user before a reserved connect is opened
+
+  bool ready;                 // in ready list, kept across reuse of slot
+  struct socket *ready_next;
+  int budget;                 // bytes left in current turn
 
   struct socket_stat stat;    // socket statistics
 
   struct write_list high;     // high priority write list
   struct write_list low;      // low priority write list
-  size_t wb_size;             // total size of write buffer
+  size_t wb_size;             // total size of write buffer and dw, changed with dw_lock
+
+  bool zerocopy;              // SO_ZEROCOPY is enabled
+  uint32_t zc_next;           // sequence of next MSG_ZEROCOPY send, counted by kernel in the same way
+  struct write_list zc;       // sent buffers waiting for zerocopy completion
 
   int minread;                // for tcp, min read bytes, may grow up by the power of two
+
+  bool completion;            // reads (or accepts) and writes are io_uring completions, it isn't polled for them
+  struct send_op *op;         // sendmsg in io_uring, one at a time
+
+  // a sending thread writes directly if nothing is queued, dw_lock keeps socket thread from writing meanwhile
+  struct spinlock dw_lock;    // for fd writes, write lists, dw and closing
+  struct write_buffer *dw;    // remainder of a direct write, socket thread puts it at the head of high list
+  ATOMIC_INT sending;         // send requests in command ring for this slot, direct write mustn't overtake them
+
+  size_t wb_high;             // SOCKET_WARNING when wb_size grows to it, 0 means off
+  size_t wb_low;              // SOCKET_WARNING with 0 when wb_size drains to it
+  bool warned;                // wb_size has been beyond wb_high, and not drained yet
+  int link;                   // socket whose reads are paused while warned, -1 for none
+};
+
+#define REQUEST_CLOSE 'X'
+#define REQUEST_LISTEN 'L'
+#define REQUEST_SEND 'W'
+#define REQUEST_EXIT 'E'
+#define REQUEST_UDP 'U'
+#define REQUEST_SENDTO 'T'
+#define REQUEST_CONNECT 'C'
+#define REQUEST_WATERMARK 'M'
+#define REQUEST_CHECK 'K'
+
+struct request_close {
+  uintptr_t opaque;
+  int id;
+  int what;
+};
+
+// listen, udp and connect requests are sent by resolver after name is resolved
+struct request_open {
+  struct socket_server *ss;
+  int type;         // REQUEST_LISTEN, REQUEST_UDP or REQUEST_CONNECT
+  int id;           // for connect, reserved by caller
+  uintptr_t opaque;
+  int backlog;      // for listen
+  struct socket_resolved addr;
+};
+
+struct request_send {
+  int id;
+  char *buf;
+  size_t sz;
+  bool high;
+};
+
+struct request_watermark {
+  int id;
+  int link;
+  size_t high;
+  size_t low;
+};
+
+// a direct write has parked a remainder, beyond high watermark or to be submitted to io_uring
+struct request_check {
+  int id;
+};
+
+struct request_sendto {
+  struct request_send send;
+  struct socket_udp_address addr;
+};
+
+struct request {
+  int type;
+  union {
+    struct request_close rclose;
+    struct request_open *ropen;
+    struct request_send rsend;
+    struct request_sendto rsendto;
+    struct request_watermark rwatermark;
+    struct request_check rcheck;
+  } u;
+};
+
+// a request is published when seq becomes pos + 1, and the slot is free again when seq becomes pos + CMD_RING_SIZE
+struct cmd_slot {
+  ATOMIC_UINT seq;
+  struct request req;
+};
+
+// bounded multi-producer/single-consumer ring (Vyukov's bounded queue)
+// producers claim a position by CAS on tail, then publish the slot by its sequence number
+// socket thread takes requests from head without any atomic read-modify-write
+struct cmd_ring {
+  ATOMIC_UINT tail;
+  char pad0[CACHELINE_SIZE - sizeof(unsigned int)];
+  unsigned int head;
+  char pad1[CACHELINE_SIZE - sizeof(unsigned int)];
+  struct cmd_slot slots[CMD_RING_SIZE];
 };
 
 struct socket_server {
   int epfd;                           // epoll file descriptor
+#ifdef LEPTONET_USE_IO_URING
+  struct uring *uring;                // used instead of epoll if kernel supports it
+  int sends;                          // sendmsg in io_uring, including those of closed sockets
+#endif
   int evid;                           // current handled event id
   int evnum;                          // all active events
 
-  int checkctrl;                      // server side control, whether we should check pipe
-  int sendctrl;                       // pipe send side control
-  int recvctrl;                       // pipe recv side control
-  fd_set rfds;                        // for select
+  int checkctrl;                      // server side control, whether we should check command ring
+  int ctrlfd;                         // eventfd, registered in epoll with NULL pointer
+  ATOMIC_INT signaled;                // set by the producer which signals ctrlfd, cleared by socket thread before draining
+  struct cmd_ring cmd;                // pending requests
 
   int reserved;                       // reserved socket id, for EMFILE
+  ATOMIC_INT resolving;               // requests waiting for resolver
 
-  int allocated;               // allocated unique socket id
+  int allocated;                      // allocated unique socket id, without shard bits
+  uint64_t shed;                      // connections dropped for lack of fd or slot
+  int shard;                          // index of this reactor, it's in low bits of every id
 
   uint64_t time;                      // timestemp
-  struct spinlock lock;               // lock
+  struct spinlock lock;               // for socket id allocation
+
+  size_t zerocopy;                    // buffers of at least this size are sent by MSG_ZEROCOPY, 0 means off
+
+  int readmode;                       // SOCKET_READ_POOL or SOCKET_READ_COPY
+  struct socket_pool *pool;           // read buffers, NULL if all pools are leased
+  char *scratch;                      // for SOCKET_READ_COPY, TCP_MAX_READBYTES bytes
+
+  char *udp_scratch;                  // UDP_BATCH slots of UDP_MAX_DATAGRAM bytes, allocated by first udp socket
+  struct socket_message udp[UDP_BATCH]; // datagrams received by last recvmmsg, delivered one per poll
+  int udp_next;
+  int udp_num;
+
+  struct socket *ready_head;          // sockets which may have more to read or accept
+  struct socket *ready_tail;
+  int ready_turns;                    // ready sockets served before next epoll wait
 
   struct socket slots[SOCKET_IDMAX];  // socket slots
   struct event events[EVENT_MAX];     // epoll events
-  char *tmpbuf[TMP_PACKAGE_SIZE];     // temporary buffer
 };
 
-// if success, return zero
-static inline int enable_read(struct socket_server *ss, struct socket *s, bool read) {
-  if (s->read == read) {
-    return 0;
+// poller is io_uring if it's built in and supported by kernel, otherwise epoll
+static inline int poller_regist(struct socket_server *ss, int fd, void *ptr) {
+#ifdef LEPTONET_USE_IO_URING
+  if (ss->uring) {
+    return uring_regist(ss->uring, fd, ptr);
   }
-  s->read = read;
-  return epread(ss->epfd, s->fd, s, read);
+#endif
+  return epregist(ss->epfd, fd, ptr);
 }
 
-// if success, return zero
-static inline int enable_write(struct socket_server *ss, struct socket *s, bool write) {
-  if (s->write == write) {
-    return 0;
+static inline void poller_del(struct socket_server *ss, int fd) {
+#ifdef LEPTONET_USE_IO_URING
+  if (ss->uring) {
+    uring_del(ss->uring, fd);
+    return;
+  }
+#endif
+  epdel(ss->epfd, fd);
+}
+
+static inline int poller_wait(struct socket_server *ss, int timeout) {
+#ifdef LEPTONET_USE_IO_URING
+  if (ss->uring) {
+    return uring_wait(ss->uring, ss->events, EVENT_MAX, timeout);
   }
-  s->write = write;
-  return epwrite(ss->epfd, s->fd, s, write);
+#endif
+  return epwait(ss->epfd, ss->events, EVENT_MAX, timeout);
+}
+
+// with io_uring, a connected tcp socket is read by multishot recv and written by sendmsg completions
+static inline void poller_stream(struct socket_server *ss, struct socket *s) {
+#ifdef LEPTONET_USE_IO_URING
+  if (ss->uring && uring_recv(ss->uring, s->fd, true) == 0) {
+    s->completion = true;
+  }
+#else
+  (void)ss;
+  (void)s;
+#endif
+}
+
+// with io_uring, a listen socket is accepted by multishot accept
+static inline void poller_accept(struct socket_server *ss, struct socket *s) {
+#ifdef LEPTONET_USE_IO_URING
+  if (ss->uring && uring_accept(ss->uring, s->fd) == 0) {
+    s->completion = true;
+  }
+#else
+  (void)ss;
+  (void)s;
+#endif
+}
+
+// pause or resume multishot recv of a completion socket
+static inline void poller_recv(struct socket_server *ss, struct socket *s, bool on) {
+#ifdef LEPTONET_USE_IO_URING
+  uring_recv(ss->uring, s->fd, on);
+#else
+  (void)ss;
+  (void)s;
+  (void)on;
+#endif
 }
 
 static inline void enable_nonblocking(struct socket *s) {
@@ -143,26 +382,69 @@ static inline void stat_write(struct socket_stat *st, uint64_t time, uint64_t by
   st->wbytes += bytes;
 }
 
+static inline void ready_push(struct socket_server *ss, struct socket *s) {
+  if (s->ready) {
+    return;
+  }
+  s->ready = true;
+  s->ready_next = NULL;
+  s->budget = s->status == SOCKET_TYPE_LISTEN ? ACCEPT_BUDGET : READ_BUDGET;
+  if (ss->ready_tail) {
+    ss->ready_tail->ready_next = s;
+  } else {
+    ss->ready_head = s;
+  }
+  ss->ready_tail = s;
+}
+
+static inline struct socket* ready_pop(struct socket_server *ss) {
+  struct socket *s = ss->ready_head;
+  ss->ready_head = s->ready_next;
+  if (ss->ready_head == NULL) {
+    ss->ready_tail = NULL;
+  }
+  s->ready = false;
+  s->ready_next = NULL;
+  return s;
+}
+
+// reading is paused by not reading, socket is drained when it's enabled again
+static inline void enable_read(struct socket_server *ss, struct socket *s, bool read) {
+  s->read = read;
+  if (s->completion) {
+    poller_recv(ss, s, read);
+    return;
+  }
+  if (read) {
+    ready_push(ss, s);
+  }
+}
+
+void socket_server_buffer_free(void *buffer) {
+  if (!socket_pool_free(buffer)) {
+    leptonet_free(buffer);
+  }
+}
+
 static inline void write_buffer_free(struct write_buffer *wb) {
   assert(wb && wb->buffer);
-  leptonet_free(wb->buffer);
+  socket_server_buffer_free(wb->buffer);
   leptonet_free(wb);
 }
 
 static inline void write_list_push_head(struct write_list *wl, struct write_buffer *wb) {
-  if (wl->head == NULL) {
-    assert(wl->tail == NULL);
-    wl->head = wl->tail = wb; 
-  } else {
-    wl->head = wb->next;
-    wl->head = wb;
+  wb->next = wl->head;
+  wl->head = wb;
+  if (wl->tail == NULL) {
+    wl->tail = wb;
   }
 }
 
 static inline void write_list_push_tail(struct write_list *wl, struct write_buffer *wb) {
+  wb->next = NULL;
   if (wl->head == NULL) {
     assert(wl->tail == NULL);
-    wl->head = wl->tail = wb; 
+    wl->head = wl->tail = wb;
   } else {
     assert(wl->tail);
     wl->tail->next = wb;
@@ -174,7 +456,7 @@ static inline struct write_buffer* write_list_pop_head(struct write_list *wl) {
   if (wl->head == NULL) {
     assert(wl->tail == NULL);
     return NULL;
-  } 
+  }
   struct write_buffer *tmp = wl->head;
   wl->head = tmp->next;
   if(wl->head == NULL) {
@@ -196,23 +478,24 @@ static inline void write_list_clear(struct write_list *wl) {
   wl->head = wl->tail = NULL;
 }
 
+// only the head may be sent partially, and one which is sent by MSG_ZEROCOPY may still be referred by kernel
+static inline bool write_list_zerocopy(struct write_list *wl) {
+  return wl->head && wl->head->zerocopy;
+}
+
 static inline int write_list_empty(struct write_list *wl) {
   return wl->head == NULL && wl->tail == NULL;
 }
 
 static int reserved_id(struct socket_server *ss) {
-  if (!spinlock_trylock(&ss->lock)) {
-    return -1;
-  }
+  spinlock_lock(&ss->lock);
   for (int i = 0; i < SOCKET_IDMAX; i ++){
-    int newid = ++ss->allocated;
-    if (newid < 0) {
-      newid = 0;
-      ss->allocated = 0;
-    }
-    struct socket *s = &ss->slots[newid];
+    ss->allocated = (ss->allocated + 1) & (0x7fffffff >> SOCKET_SHARD_BITS);
+    int newid = ss->allocated << SOCKET_SHARD_BITS | ss->shard;
+    struct socket *s = &ss->slots[HASH_ID(newid)];
     if (s->status == SOCKET_TYPE_INVALID) {
       s->id = newid;
+      s->closing = false;
       s->status = SOCKET_TYPE_RESERVE;
       spinlock_unlock(&ss->lock);
       return newid;
@@ -222,11 +505,17 @@ static int reserved_id(struct socket_server *ss) {
   return -1;
 }
 
-static struct socket* newsocket(struct socket_server *ss, int id, int fd, uintptr_t opaque, int type, int protocol) {
-  if (!spinlock_trylock(&ss->lock)) {
+// return NULL if id is not a live socket
+static inline struct socket* query_socket(struct socket_server *ss, int id) {
+  struct socket *s = &ss->slots[HASH_ID(id)];
+  if (s->id != id || s->status == SOCKET_TYPE_INVALID || s->status == SOCKET_TYPE_RESERVE) {
     return NULL;
   }
-  struct socket *s = &ss->slots[id];
+  return s;
+}
+
+static struct socket* newsocket(struct socket_server *ss, int id, int fd, uintptr_t opaque, int type, int protocol) {
+  struct socket *s = &ss->slots[HASH_ID(id)];
   if (s->status != SOCKET_TYPE_RESERVE) {
     return NULL;
   }
@@ -234,157 +523,289 @@ static struct socket* newsocket(struct socket_server *ss, int id, int fd, uintpt
   s->socket_type = type;
   s->opaque = opaque;
   s->protocol = protocol;
-  s->read = false;
-  s->write = false;
+  s->read = true;
   s->closing = false;
   stat_init(&s->stat);
   s->minread = TCP_MIN_READBYTES;
+  s->completion = false;
+  s->op = NULL;
   write_list_clear(&s->high);
   write_list_clear(&s->low);
   s->wb_size = 0;
-  enable_nonblocking(s);
-  epregist(ss->epfd, s->fd, s);
-  if (enable_read(ss, s, true)) {
-    sprintf(stderr, "[socket-server]: enable read for %d fd error: %s\n", s->fd, strerror(errno));
+  s->zerocopy = false;
+  s->zc_next = 0;
+  write_list_clear(&s->zc);
+  s->wb_high = 0;
+  s->wb_low = 0;
+  s->warned = false;
+  s->link = -1;
+  if (poller_regist(ss, s->fd, s)) {
+    fprintf(stderr, "[socket-server]: register %d fd error: %s\n", s->fd, strerror(errno));
+    s->status = SOCKET_TYPE_INVALID;
     return NULL;
   }
   return s;
 }
 
-struct request_close {
-  uintptr_t opaque;
-  int id;
-  int what;
-};
-
-struct request_listen {
-  uintptr_t opaque;
-  const char *host;
-  const char *port;
-  int backlog;
-};
-
-struct request_send {
-  int id;
-  char *buf;
-  size_t sz;
-  bool high;
-};
+static void cmd_push(struct cmd_ring *q, struct request *req) {
+  for (;;) {
+    unsigned int pos = ATOMIC_LOAD(&q->tail);
+    struct cmd_slot *slot = &q->slots[pos & (CMD_RING_SIZE - 1)];
+    unsigned int seq = ATOMIC_LOAD_ACQ(&slot->seq);
+    int diff = (int)(seq - pos);
+    if (diff == 0) {
+      if (ATOMIC_CAS(&q->tail, pos, pos + 1)) {
+        slot->req = *req;
+        ATOMIC_STORE_REL(&slot->seq, pos + 1);
+        return;
+      }
+    } else if (diff < 0) {
+      // ring is full, socket thread has been signaled already, wait for it to catch up
+      sched_yield();
+    }
+  }
+}
 
-struct request_package {
-  // first six bytes are dummy
-  // idx: 6 -> type
-  // idx: 7 -> len
-  char header[8];
-  union {
-    char buf[256];
-    struct request_close rclose;      // 'X'
-    struct request_listen rlisten;    // 'L'
-    struct request_send rsend;        // 'W'
-  } u;
-  // not used
-  char dummy[256];
-};
+// only socket thread can call it, return false if ring is empty
+static bool cmd_pop(struct cmd_ring *q, struct request *req) {
+  unsigned int pos = q->head;
+  struct cmd_slot *slot = &q->slots[pos & (CMD_RING_SIZE - 1)];
+  if (ATOMIC_LOAD_ACQ(&slot->seq) != pos + 1) {
+    return false;
+  }
+  *req = slot->req;
+  ATOMIC_STORE_REL(&slot->seq, pos + CMD_RING_SIZE);
+  q->head = pos + 1;
+  return true;
+}
 
-static void send_request(struct socket_server *ss, struct request_package *request, uint8_t type, uint8_t len) {
-  request->header[6] = type;
-  request->header[7] = len;
-  char *buf = (char*)request + offsetof(struct request_package, header[6]);
-  int cnt = write(ss->sendctrl, buf, len + 2);
-  if (cnt < 0) {
-    fprintf(stderr, "[socket_server]: send request error: %s\n", strerror(errno));
-    return;
+// only the producer which turns signaled from 0 to 1 writes eventfd, so a burst of requests costs one syscall
+static void send_request(struct socket_server *ss, struct request *req, int type) {
+  req->type = type;
+  cmd_push(&ss->cmd, req);
+  if (ATOMIC_XCHG(&ss->signaled, 1) == 0) {
+    uint64_t one = 1;
+    while (write(ss->ctrlfd, &one, sizeof one) < 0 && errno == EINTR) {}
   }
-  // atomic write
-  assert(cnt == len + 2);
 }
 
 void socket_server_close(struct socket_server *ss, int id, int what, uintptr_t opaque) {
-  struct request_package pkg;
-  pkg.u.rclose.id = id;
-  pkg.u.rclose.opaque = opaque;
-  pkg.u.rclose.what = what;
-  send_request(ss, &pkg, 'X', sizeof pkg.u.rclose);
-}
-
-static int try_listen(const char *host, const char *port, int backlog) {
-  int status = 0;
-  int fd = 0;
-  struct addrinfo hints, *servinfo, *p;
-  memset(&hints, 0, sizeof hints);
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_flags = AI_PASSIVE;
-
-  if ((status = getaddrinfo(host, port, &hints, &servinfo)) < 0) {
-    sprintf(stderr, "[socket-server]: get address info failed: %s\n", strerror(errno));
+  struct request req;
+  req.u.rclose.id = id;
+  req.u.rclose.opaque = opaque;
+  req.u.rclose.what = what;
+  send_request(ss, &req, REQUEST_CLOSE);
+}
+
+// socket of socktype bound to one of addresses, both tcp and udp sockets can be shared by reactors with SO_REUSEPORT
+static int try_bind(struct socket_resolved *addr, int socktype) {
+  if (addr->err) {
+    fprintf(stderr, "[socket-server]: get address info failed: %s\n", gai_strerror(addr->err));
     return -1;
   }
-
-  for (p = servinfo; p; p = p->ai_next) {
-    if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
-      sprintf(stderr, "[socket-server]: create socket failed: %s\n", strerror(errno));
+  for (int i = 0; i < addr->n; i ++) {
+    struct sockaddr *sa = (struct sockaddr*)&addr->addrs[i].addr;
+    int fd = socket(sa->sa_family, socktype, 0);
+    if (fd < 0) {
+      fprintf(stderr, "[socket-server]: create socket failed: %s\n", strerror(errno));
       continue;
     }
     int tmp = 1;
-    if ((status = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &tmp, sizeof tmp)) < 0) {
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &tmp, sizeof tmp) < 0) {
       close(fd);
-      sprintf(stderr, "[socket-server]: set socket options failed: %s\n", strerror(errno));
+      fprintf(stderr, "[socket-server]: set socket options failed: %s\n", strerror(errno));
       continue;
     }
     tmp = 1;
-    if ((status = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &tmp, sizeof tmp)) < 0) {
-      close(fd);
-      sprintf(stderr, "[socket-server]: set socket options failed: %s\n", strerror(errno));
-      continue;
-    }
-    if ((status = bind(fd, p->ai_addr, p->ai_addrlen)) < 0) {
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &tmp, sizeof tmp) < 0) {
       close(fd);
-      sprintf(stderr, "[socket-server]: bind socket failed: %s\n", strerror(errno));
+      fprintf(stderr, "[socket-server]: set socket options failed: %s\n", strerror(errno));
       continue;
     }
-    if ((status = listen(fd, backlog)) < 0) {
+    if (bind(fd, sa, addr->addrs[i].len) < 0) {
       close(fd);
-      sprintf(stderr, "[socket-server]: listen socket failed: %s\n", strerror(errno));
+      fprintf(stderr, "[socket-server]: bind socket failed: %s\n", strerror(errno));
       continue;
     }
-    break;
+    return fd;
+  }
+  fprintf(stderr, "[socket-server]: failed to bind specific port\n");
+  return -1;
+}
+
+static int try_listen(struct socket_resolved *addr, int backlog) {
+  int fd = try_bind(addr, SOCK_STREAM);
+  if (fd < 0) {
+    return -1;
   }
-  freeaddrinfo(servinfo);
-  if (p == NULL) {
-    fprintf(stderr, "[socket-server]: failed to listen specific port: %s", strerror(errno));
+  if (listen(fd, backlog) < 0) {
+    fprintf(stderr, "[socket-server]: listen socket failed: %s\n", strerror(errno));
+    close(fd);
     return -1;
   }
   return fd;
 }
 
-void socket_server_listen(struct socket_server *ss, const char *host, const char *port, int backlog, uintptr_t opaque) {
-  /* int fd = try_listen(host, port, backlog); */
-  /* int id = reserved_id(ss); */
-  struct request_package pkg;
-  pkg.u.rlisten.opaque = opaque;
-  pkg.u.rlisten.host = host;
-  pkg.u.rlisten.port = port;
-  pkg.u.rlisten.backlog = backlog;
-  send_request(ss, &pkg, 'L', sizeof pkg.u.rlisten);
+// on resolver thread, or caller thread if name is cached
+static void resolve_done(void *ud, const struct socket_resolved *r) {
+  struct request_open *ropen = ud;
+  struct socket_server *ss = ropen->ss;
+  ropen->addr = *r;
+  struct request req;
+  req.u.ropen = ropen;
+  send_request(ss, &req, ropen->type);
+  ATOMIC_DEC(&ss->resolving);
+}
+
+// name is resolved by resolver, and then it's sent to socket thread
+// return -1 if caller is over its hard memory limit
+static int request_open(struct socket_server *ss, int type, const char *host, const char *port, int id, int backlog, uintptr_t opaque) {
+  struct request_open *ropen = leptonet_malloc(sizeof *ropen);
+  if (ropen == NULL) {
+    return -1;
+  }
+  ropen->ss = ss;
+  ropen->type = type;
+  ropen->id = id;
+  ropen->opaque = opaque;
+  ropen->backlog = backlog;
+  ATOMIC_INC(&ss->resolving);
+  socket_resolver_query(host, port, type == REQUEST_UDP ? SOCK_DGRAM : SOCK_STREAM, type != REQUEST_CONNECT, resolve_done, ropen);
+  return 0;
+}
+
+int socket_server_listen(struct socket_server *ss, const char *host, const char *port, int backlog, uintptr_t opaque) {
+  return request_open(ss, REQUEST_LISTEN, host, port, -1, backlog, opaque);
+}
+
+int socket_server_udp(struct socket_server *ss, const char *host, const char *port, uintptr_t opaque) {
+  return request_open(ss, REQUEST_UDP, host, port, -1, 0, opaque);
+}
+
+int socket_server_connect(struct socket_server *ss, const char *host, const char *port, uintptr_t opaque) {
+  int id = reserved_id(ss);
+  if (id < 0) {
+    return -1;
+  }
+  if (request_open(ss, REQUEST_CONNECT, host, port, id, 0, opaque)) {
+    ss->slots[HASH_ID(id)].status = SOCKET_TYPE_INVALID;
+    return -1;
+  }
+  return id;
+}
+
+void socket_server_watermark(struct socket_server *ss, int id, size_t high, size_t low, int link) {
+  struct request req;
+  req.u.rwatermark.id = id;
+  req.u.rwatermark.high = high;
+  req.u.rwatermark.low = low;
+  req.u.rwatermark.link = link;
+  send_request(ss, &req, REQUEST_WATERMARK);
+}
+
+// on sending thread, it's taken only if nothing is queued or being sent for the socket
+// bytes written here aren't counted in socket statistics, which are owned by socket thread
+static bool direct_write(struct socket_server *ss, struct socket_buffer *buf) {
+  struct socket *s = &ss->slots[HASH_ID(buf->id)];
+  if (ATOMIC_LOAD_ACQ(&s->sending) > 0 || !spinlock_trylock(&s->dw_lock)) {
+    return false;
+  }
+  if (s->id != buf->id || s->status != SOCKET_TYPE_CONNECTED || s->protocol != IPPROTO_TCP ||
+      s->dw || !write_list_empty(&s->high) || !write_list_empty(&s->low) ||
+      ATOMIC_LOAD_ACQ(&s->sending) > 0 || (s->zerocopy && (size_t)buf->sz >= ss->zerocopy)) {
+    spinlock_unlock(&s->dw_lock);
+    return false;
+  }
+  ssize_t cnt = send(s->fd, buf->buffer, buf->sz, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (cnt < 0) {
+    // full or failed, socket thread takes it, and reports the error if any
+    spinlock_unlock(&s->dw_lock);
+    return false;
+  }
+  if (cnt < buf->sz) {
+    struct write_buffer *wb = leptonet_malloc(sizeof *wb);
+    if (wb == NULL) {
+      // caller is over its hard memory limit, and it can't be sent by socket thread either
+      spinlock_unlock(&s->dw_lock);
+      fprintf(stderr, "[socket-server]: socket %d remainder of %d bytes dropped, out of memory\n", buf->id, buf->sz - (int)cnt);
+      socket_server_buffer_free(buf->buffer);
+      socket_server_close(ss, buf->id, SHUT_RDWR, s->opaque);
+      return true;
+    }
+    wb->buffer = buf->buffer;
+    wb->ptr = buf->buffer + cnt;
+    wb->sz = buf->sz - cnt;
+    wb->zerocopy = false;
+    wb->zc_seq = 0;
+    wb->next = NULL;
+    // socket buffer is full, EPOLLOUT edge comes for it
+    s->dw = wb;
+    s->wb_size += wb->sz;
+    // SOCKET_WARNING is reported by socket thread, and a completion socket is written by it
+    bool check = s->completion || (s->wb_high && s->wb_size >= s->wb_high);
+    spinlock_unlock(&s->dw_lock);
+    if (check) {
+      struct request req;
+      req.u.rcheck.id = buf->id;
+      send_request(ss, &req, REQUEST_CHECK);
+    }
+    return true;
+  }
+  spinlock_unlock(&s->dw_lock);
+  socket_server_buffer_free(buf->buffer);
+  return true;
+}
+
+static inline void send_buffer(struct socket_server *ss, struct socket_buffer *buf, bool high) {
+  if (direct_write(ss, buf)) {
+    return;
+  }
+  ATOMIC_INC(&ss->slots[HASH_ID(buf->id)].sending);
+  struct request req;
+  req.u.rsend.id = buf->id;
+  req.u.rsend.sz = buf->sz;
+  req.u.rsend.buf = buf->buffer;
+  req.u.rsend.high = high;
+  send_request(ss, &req, REQUEST_SEND);
 }
 
 void socket_server_sendhigh(struct socket_server *ss, struct socket_buffer *buf) {
-  struct request_package pkg;
-  pkg.u.rsend.id = buf->id;
-  pkg.u.rsend.sz = buf->sz;
-  pkg.u.rsend.buf = buf->buffer;
-  pkg.u.rsend.high = true;
-  send_request(ss, &pkg, 'W', sizeof pkg.u.rsend);
+  send_buffer(ss, buf, true);
 }
 
 void socket_server_sendlow(struct socket_server *ss, struct socket_buffer *buf) {
-  struct request_package pkg;
-  pkg.u.rsend.id = buf->id;
-  pkg.u.rsend.sz = buf->sz;
-  pkg.u.rsend.buf = buf->buffer;
-  pkg.u.rsend.high = false;
-  send_request(ss, &pkg, 'W', sizeof pkg.u.rsend);
+  send_buffer(ss, buf, false);
+}
+
+void socket_server_sendto(struct socket_server *ss, struct socket_buffer *buf, const struct socket_udp_address *addr) {
+  struct request req;
+  req.u.rsendto.send.id = buf->id;
+  req.u.rsendto.send.sz = buf->sz;
+  req.u.rsendto.send.buf = buf->buffer;
+  req.u.rsendto.send.high = false;
+  req.u.rsendto.addr = *addr;
+  send_request(ss, &req, REQUEST_SENDTO);
+}
+
+const struct socket_udp_address* socket_server_udp_source(struct socket_message *sm) {
+  return (const struct socket_udp_address*)(sm->buffer + UDP_ADDRESS_OFFSET(sm->ud));
+}
+
+bool socket_server_udp_address(const char *ip, int port, struct socket_udp_address *addr) {
+  memset(addr, 0, sizeof *addr);
+  if (inet_pton(AF_INET, ip, &addr->u.v4.sin_addr) == 1) {
+    addr->u.v4.sin_family = AF_INET;
+    addr->u.v4.sin_port = htons(port);
+    addr->len = sizeof addr->u.v4;
+    return true;
+  }
+  if (inet_pton(AF_INET6, ip, &addr->u.v6.sin6_addr) == 1) {
+    addr->u.v6.sin6_family = AF_INET6;
+    addr->u.v6.sin6_port = htons(port);
+    addr->len = sizeof addr->u.v6;
+    return true;
+  }
+  return false;
 }
 
 struct socket_server* socket_server_create(uint64_t time) {
@@ -392,41 +813,205 @@ struct socket_server* socket_server_create(uint64_t time) {
   memset(ss, 0, sizeof *ss);
   ss->epfd = epinit();
   if (!epvalid(ss->epfd)) {
-    sprintf(stderr, "[socket-server]: epoll create failed: %s\n", strerror(errno));
+    fprintf(stderr, "[socket-server]: epoll create failed: %s\n", strerror(errno));
+    leptonet_free(ss);
     return NULL;
   }
-  int pipefd[2];
-  if (pipe(pipefd) < 0) {
+  for (unsigned int i = 0; i < CMD_RING_SIZE; i ++) {
+    ss->cmd.slots[i].seq = i;
+  }
+  for (int i = 0; i < SOCKET_IDMAX; i ++) {
+    spinlock_init(&ss->slots[i].dw_lock);
+  }
+  ss->ctrlfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (ss->ctrlfd < 0) {
     close(ss->epfd);
-    sprintf(stderr, "[socket-server]: pipe create failed: %s\n", strerror(errno));
+    fprintf(stderr, "[socket-server]: eventfd create failed: %s\n", strerror(errno));
+    leptonet_free(ss);
     return NULL;
   }
-  ss->recvctrl = pipefd[0];
-  ss->sendctrl = pipefd[1];
   ss->reserved = dup(1);
 
   if (ss->reserved < 0) {
     close(ss->epfd);
-    close(ss->recvctrl);
-    close(ss->sendctrl);
-    sprintf(stderr, "[socket-server]: duplicate fd failed: %s\n", strerror(errno));
+    close(ss->ctrlfd);
+    fprintf(stderr, "[socket-server]: duplicate fd failed: %s\n", strerror(errno));
+    leptonet_free(ss);
+    return NULL;
+  }
+#ifdef LEPTONET_USE_IO_URING
+  ss->uring = uring_create(EVENT_MAX);
+  if (ss->uring == NULL) {
+    fprintf(stderr, "[socket-server]: io_uring isn't supported, fall back to epoll\n");
+  }
+#endif
+  // requests wake up epoll wait
+  if (poller_regist(ss, ss->ctrlfd, NULL)) {
+#ifdef LEPTONET_USE_IO_URING
+    if (ss->uring) {
+      uring_release(ss->uring);
+    }
+#endif
+    close(ss->epfd);
+    close(ss->ctrlfd);
+    close(ss->reserved);
+    fprintf(stderr, "[socket-server]: register eventfd failed: %s\n", strerror(errno));
+    leptonet_free(ss);
     return NULL;
   }
-  FD_ZERO(&ss->rfds);
   spinlock_init(&ss->lock);
   ss->time = time;
   ss->checkctrl = 1;
+  ss->pool = socket_pool_lease();
 
   return ss;
 }
 
+const char* socket_server_backend(struct socket_server *ss) {
+#ifdef LEPTONET_USE_IO_URING
+  if (ss->uring) {
+    return "io_uring";
+  }
+#else
+  (void)ss;
+#endif
+  return "epoll";
+}
+
+void socket_server_zerocopy(struct socket_server *ss, size_t threshold) {
+  ss->zerocopy = threshold;
+}
+
+void socket_server_readmode(struct socket_server *ss, int mode) {
+  assert(mode == SOCKET_READ_POOL || mode == SOCKET_READ_COPY);
+  if (mode == SOCKET_READ_COPY && ss->scratch == NULL) {
+    ss->scratch = leptonet_malloc(TCP_MAX_READBYTES);
+  }
+  ss->readmode = mode;
+}
+
+void socket_server_shard(struct socket_server *ss, int shard) {
+  assert(shard >= 0 && shard < SOCKET_SHARD_MAX);
+  ss->shard = shard;
+}
+
+void socket_server_exit(struct socket_server *ss) {
+  struct request req;
+  send_request(ss, &req, REQUEST_EXIT);
+}
+
+static void enable_zerocopy(struct socket_server *ss, struct socket *s) {
+  if (ss->zerocopy == 0) {
+    return;
+  }
+  int on = 1;
+  // not supported by kernel, keep copying
+  s->zerocopy = setsockopt(s->fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof on) == 0;
+}
+
+// read completion notifications from error queue, free buffers which are released by kernel
+// return the number of notifications
+static int zerocopy_complete(struct socket *s) {
+  int n = 0;
+  for (;;) {
+    char control[128];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+    if (recvmsg(s->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return n;
+    }
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+      struct sock_extended_err *ee = (struct sock_extended_err*)CMSG_DATA(cm);
+      if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+      n++;
+      // sends in [ee_info, ee_data] are completed, they are completed in order for tcp
+      uint32_t hi = ee->ee_data;
+      while (s->zc.head && (int32_t)(hi - s->zc.head->zc_seq) >= 0) {
+        write_buffer_free(write_list_pop_head(&s->zc));
+      }
+      if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        // kernel copied it anyway (e.g. loopback), zerocopy only costs more here
+        s->zerocopy = false;
+      }
+    }
+  }
+}
+
+// reads of a half closed socket stay off
+static void pause_link(struct socket_server *ss, struct socket *s, bool pause) {
+  struct socket *l = s->link < 0 ? NULL : query_socket(ss, s->link);
+  if (l && l != s && l->status != SOCKET_TYPE_HALFCLOSE_READ && l->status != SOCKET_TYPE_LISTEN) {
+    enable_read(ss, l, !pause);
+  }
+}
+
+// watermarks are checked after wb_size changes, they're edge triggered by warned
+static int report_watermark(struct socket_server *ss, struct socket *s, struct socket_message *sm) {
+  if (s->wb_high == 0) {
+    return -1;
+  }
+  // a direct write may add its remainder meanwhile
+  spinlock_lock(&s->dw_lock);
+  size_t wb_size = s->wb_size;
+  spinlock_unlock(&s->dw_lock);
+  if (!s->warned && wb_size >= s->wb_high) {
+    s->warned = true;
+    pause_link(ss, s, true);
+  } else if (s->warned && wb_size <= s->wb_low) {
+    s->warned = false;
+    pause_link(ss, s, false);
+  } else {
+    return -1;
+  }
+  sm->id = s->id;
+  sm->opaque = s->opaque;
+  sm->ud = s->warned ? wb_size : 0;
+  sm->buffer = NULL;
+  return SOCKET_WARNING;
+}
+
 static int force_close(struct socket_server *ss, struct socket *s) {
   // temporary set it to true
   s->closing = true;
+  // a direct write in progress finishes before fd is closed, and no one starts after it
+  spinlock_lock(&s->dw_lock);
   s->status = SOCKET_TYPE_INVALID;
+  if (s->dw) {
+    write_buffer_free(s->dw);
+    s->dw = NULL;
+  }
+  struct send_op *op = s->op;
+  s->op = NULL;
+  spinlock_unlock(&s->dw_lock);
 
   int hasdata = 0;
 
+  if (op) {
+    // kernel may still read them, they're freed by its completion
+    op->s = NULL;
+    op->high = s->high;
+    op->low = s->low;
+    write_list_clear(&s->high);
+    write_list_clear(&s->low);
+    hasdata = 1;
+  }
+
+  // a partially sent zerocopy buffer waits for its completion like fully sent ones, it's freed after close below
+  if (write_list_zerocopy(&s->high)) {
+    write_list_push_tail(&s->zc, write_list_pop_head(&s->high));
+    hasdata = 1;
+  }
+  if (write_list_zerocopy(&s->low)) {
+    write_list_push_tail(&s->zc, write_list_pop_head(&s->low));
+    hasdata = 1;
+  }
   if (!write_list_empty(&s->high)) {
     write_list_free(&s->high);
     hasdata = 1;
@@ -440,12 +1025,28 @@ static int force_close(struct socket_server *ss, struct socket *s) {
   write_list_clear(&s->low);
   s->wb_size = 0;
   s->minread = 0;
+  s->read = false;
+  if (s->warned) {
+    // nothing is buffered for it any more
+    pause_link(ss, s, false);
+    s->warned = false;
+  }
+
+  if (!write_list_empty(&s->zc)) {
+    zerocopy_complete(s);
+  }
+  if (!write_list_empty(&s->zc) || (op && (op->large || write_list_zerocopy(&op->high) || write_list_zerocopy(&op->low)))) {
+    // kernel may still send from these pages after close, so abort the connection before freeing them
+    struct linger l = {.l_onoff = 1, .l_linger = 0};
+    setsockopt(s->fd, SOL_SOCKET, SO_LINGER, &l, sizeof l);
+  }
 
-  enable_read(ss, s, false);
-  enable_write(ss, s, false);
-  epdel(ss->epfd, s->fd);
+  // it may be still in ready list, it's skipped there
+  poller_del(ss, s->fd);
   close(s->fd);
+  write_list_free(&s->zc);
 
+  s->completion = false;
   s->closing = false;
   if (hasdata == 1) {
     return SOCKET_ERR;
@@ -453,7 +1054,36 @@ static int force_close(struct socket_server *ss, struct socket *s) {
   return SOCKET_CLOSE;
 }
 
+// free what a request which is never handled holds
+static void request_free(struct request *req) {
+  switch (req->type) {
+    case REQUEST_SEND:
+      socket_server_buffer_free(req->u.rsend.buf);
+      break;
+    case REQUEST_SENDTO:
+      socket_server_buffer_free(req->u.rsendto.send.buf);
+      break;
+    case REQUEST_LISTEN:
+    case REQUEST_UDP:
+    case REQUEST_CONNECT:
+      leptonet_free(req->u.ropen);
+      break;
+  }
+}
+
+#ifdef LEPTONET_USE_IO_URING
+static void drain_sends(struct socket_server *ss);
+#endif
+
 void socket_server_release(struct socket_server *ss) {
+  // resolver sends requests to ss, wait for them
+  while (ATOMIC_LOAD_ACQ(&ss->resolving) > 0) {
+    sched_yield();
+  }
+  struct request req;
+  while (cmd_pop(&ss->cmd, &req)) {
+    request_free(&req);
+  }
   spinlock_lock(&ss->lock);
   for (int i = 0; i < SOCKET_IDMAX; i ++) {
     struct socket *s = &ss->slots[i];
@@ -462,9 +1092,28 @@ void socket_server_release(struct socket_server *ss) {
       force_close(ss, s);
     }
   }
+#ifdef LEPTONET_USE_IO_URING
+  if (ss->uring) {
+    drain_sends(ss);
+    uring_release(ss->uring);
+  }
+#endif
   close(ss->epfd);
-  close(ss->sendctrl);
-  close(ss->recvctrl);
+  close(ss->ctrlfd);
+  if (ss->pool) {
+    // buffers held by user are still returned to it
+    socket_pool_return(ss->pool);
+  }
+  if (ss->scratch) {
+    leptonet_free(ss->scratch);
+  }
+  if (ss->udp_scratch) {
+    leptonet_free(ss->udp_scratch);
+  }
+  // datagrams which are received but not delivered
+  for (int i = ss->udp_next; i < ss->udp_num; i ++) {
+    socket_server_buffer_free(ss->udp[i].buffer);
+  }
   if (ss->reserved > 0) {
     close(ss->reserved);
   }
@@ -473,285 +1122,1098 @@ void socket_server_release(struct socket_server *ss) {
   leptonet_free(ss);
 }
 
-static int hascmd(struct socket_server *ss) {
-  struct timeval tv = {.tv_sec = 0, .tv_usec = 0};
-  FD_SET(ss->recvctrl, &ss->rfds);
-  int cnt = select(ss->recvctrl + 1, &ss->rfds, NULL, NULL, &tv);
-  return cnt;
-}
-
-static int readfrompipe(int fd, char *buf, size_t sz) {
-  int cnt = read(fd, buf, sz);
-  if (cnt < 0) {
-    if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
-      return 0;
-    }
-    fprintf(stderr, "[socket-server] can't read from pipe: %s\n", strerror(errno));
-    return -1;
-  }
-  assert(cnt == sz);
-  return cnt;
+static int report_error(struct socket *s, struct socket_message *sm) {
+  sm->id = s->id;
+  sm->opaque = s->opaque;
+  sm->ud = 0;
+  sm->buffer = NULL;
+  return SOCKET_ERR;
 }
 
 static int report_close(struct socket_server *ss, struct request_close *rclose, struct socket_message *sm) {
   int id = rclose->id;
-  struct socket *s = &ss->slots[id];
+  struct socket *s = query_socket(ss, id);
+  if (s == NULL) {
+    s = &ss->slots[HASH_ID(id)];
+    if (s->id == id && s->status == SOCKET_TYPE_RESERVE && rclose->what == SHUT_RDWR) {
+      // connect is still resolving, it's closed instead of being opened, see report_connect
+      s->closing = true;
+      s->opaque = rclose->opaque;
+    }
+    return -1;
+  }
   int what = rclose->what;
   if (what == SHUT_RD) {
     s->status = SOCKET_TYPE_HALFCLOSE_READ;
+    enable_read(ss, s, false);
     shutdown(s->fd, SHUT_RD);
+    return -1;
   } else if (what == SHUT_WR) {
     s->status = SOCKET_TYPE_HALFCLOSE_WRITE;
     shutdown(s->fd, SHUT_WR);
-  } else if (what == SHUT_RDWR) {
-    force_close(ss, s);
-  } else {
+    return -1;
+  } else if (what != SHUT_RDWR) {
     fprintf(stderr, "[socket-server]: rclose: close type error\n");
-    return SOCKET_ERR;
+    return -1;
   }
+  force_close(ss, s);
+  sm->id = id;
+  sm->opaque = rclose->opaque;
+  sm->ud = 0;
+  sm->buffer = NULL;
   return SOCKET_CLOSE;
 }
 
-static int report_listen(struct socket_server *ss, struct request_listen *rlisten, struct socket_message *sm) {
-  const char *host = rlisten->host;
-  const char *port = rlisten->port;
-  int backlog = rlisten->backlog;
-  uintptr_t opaque = rlisten->opaque;
-
-  int fd = try_listen(host, port, backlog);
+static int report_listen(struct socket_server *ss, struct request_open *ropen, struct socket_message *sm) {
+  uintptr_t opaque = ropen->opaque;
+  sm->opaque = opaque;
+  sm->id = -1;
+  sm->buffer = NULL;
+  sm->ud = 0;
+  int fd = try_listen(&ropen->addr, ropen->backlog);
+  leptonet_free(ropen);
+  if (fd < 0) {
+    return SOCKET_ERR;
+  }
   int id = reserved_id(ss);
+  if (id < 0) {
+    close(fd);
+    return SOCKET_ERR;
+  }
   struct socket *s = newsocket(ss, id, fd, opaque, SOCK_STREAM, IPPROTO_TCP);
-
+  if (s == NULL) {
+    close(fd);
+    return SOCKET_ERR;
+  }
+  enable_nonblocking(s);
   s->status = SOCKET_TYPE_LISTEN;
+  poller_accept(ss, s);
+  sm->id = id;
+  return SOCKET_OPEN;
+}
 
+static int report_udp(struct socket_server *ss, struct request_open *ropen, struct socket_message *sm) {
+  uintptr_t opaque = ropen->opaque;
   sm->opaque = opaque;
-  sm->id = id;
+  sm->id = -1;
   sm->buffer = NULL;
   sm->ud = 0;
+  int fd = try_bind(&ropen->addr, SOCK_DGRAM);
+  leptonet_free(ropen);
+  if (fd < 0) {
+    return SOCKET_ERR;
+  }
+  if (ss->udp_scratch == NULL) {
+    ss->udp_scratch = leptonet_malloc(UDP_BATCH * UDP_MAX_DATAGRAM);
+    if (ss->udp_scratch == NULL) {
+      close(fd);
+      return SOCKET_ERR;
+    }
+  }
+  int id = reserved_id(ss);
+  if (id < 0) {
+    close(fd);
+    return SOCKET_ERR;
+  }
+  struct socket *s = newsocket(ss, id, fd, opaque, SOCK_DGRAM, IPPROTO_UDP);
+  if (s == NULL) {
+    close(fd);
+    return SOCKET_ERR;
+  }
+  enable_nonblocking(s);
+  s->status = SOCKET_TYPE_CONNECTED;
+  sm->id = id;
   return SOCKET_OPEN;
 }
 
-static int report_send(struct socket_server *ss, struct request_send *rsend, struct socket_message *sm) {
-  int id = rsend->id;
-  bool high = rsend->high;
-
-  struct socket *s = &ss->slots[id];
-  struct write_buffer wb;
-  wb.buffer = rsend->buf;
-  wb.ptr = rsend->buf;
-  wb.sz = rsend->sz;
-  wb.next = NULL;
-  if (high) {
-    write_list_push_tail(&s->high, &wb);
-  } else {
-    write_list_push_tail(&s->low, &wb);
+// try resolved addresses in order, the first one which connects or is in progress is taken
+static int report_connect(struct socket_server *ss, struct request_open *ropen, struct socket_message *sm) {
+  int id = ropen->id;
+  sm->id = id;
+  sm->opaque = ropen->opaque;
+  sm->buffer = NULL;
+  sm->ud = 0;
+  struct socket *rs = &ss->slots[HASH_ID(id)];
+  if (rs->closing) {
+    // user closed it while its name was being resolved
+    leptonet_free(ropen);
+    sm->opaque = rs->opaque;
+    rs->closing = false;
+    rs->status = SOCKET_TYPE_INVALID;
+    return SOCKET_CLOSE;
+  }
+  struct socket_resolved *addr = &ropen->addr;
+  if (addr->err) {
+    fprintf(stderr, "[socket-server]: get address info failed: %s\n", gai_strerror(addr->err));
+  }
+  int fd = -1;
+  int r = -1;
+  for (int i = 0; i < addr->n; i ++) {
+    struct sockaddr *sa = (struct sockaddr*)&addr->addrs[i].addr;
+    fd = socket(sa->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      continue;
+    }
+    r = connect(fd, sa, addr->addrs[i].len);
+    if (r == 0 || errno == EINPROGRESS) {
+      break;
+    }
+    fprintf(stderr, "[socket-server]: connect failed: %s\n", strerror(errno));
+    close(fd);
+    fd = -1;
+  }
+  struct socket *s = fd < 0 ? NULL : newsocket(ss, id, fd, ropen->opaque, SOCK_STREAM, IPPROTO_TCP);
+  leptonet_free(ropen);
+  if (s == NULL) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    // give the reserved id back
+    ss->slots[HASH_ID(id)].status = SOCKET_TYPE_INVALID;
+    return SOCKET_ERR;
   }
+  if (r == 0) {
+    // e.g. loopback may connect at once
+    s->status = SOCKET_TYPE_CONNECTED;
+    enable_zerocopy(ss, s);
+    poller_stream(ss, s);
+    return SOCKET_OPEN;
+  }
+  // EPOLLOUT tells it's done
+  s->status = SOCKET_TYPE_CONNECTING;
   return -1;
 }
 
-static int process_cmd(struct socket_server *ss, struct socket_message *sm) {
-  char header[2];
-  char request_buf[256];
-  int r;
-  r = readfrompipe(ss->recvctrl, header, sizeof header);
-  if (r == 0) {
+static inline int write_list_uncomplete(struct write_list *wl) {
+  if (write_list_empty(wl)) {
+    return 0;
+  }
+  return wl->head->buffer != wl->head->ptr;
+}
+
+static void raise_writelist(struct socket *s) {
+  struct write_buffer *wb = write_list_pop_head(&s->low);
+  write_list_push_head(&s->high, wb);
+}
+
+// append buffers of wl to iov, return the new count
+// it stops before a buffer of at least zc bytes, which is sent by MSG_ZEROCOPY alone
+static inline int write_list_iov(struct write_list *wl, struct iovec *iov, int n, size_t *total, size_t zc, bool *stop) {
+  for (struct write_buffer *wb = wl->head; wb && n < IOV_MAX; wb = wb->next) {
+    if (wb->sz >= zc) {
+      *stop = true;
+      break;
+    }
+    iov[n].iov_base = wb->ptr;
+    iov[n].iov_len = wb->sz;
+    *total += wb->sz;
+    n++;
+  }
+  return n;
+}
+
+// consume sz bytes from the head of wl, return bytes which are left for next list
+// a buffer which is sent by MSG_ZEROCOPY goes to zc list instead of being freed
+static inline size_t write_list_advance(struct socket *s, struct write_list *wl, size_t sz) {
+  while (wl->head && sz >= wl->head->sz) {
+    sz -= wl->head->sz;
+    struct write_buffer *wb = write_list_pop_head(wl);
+    if (wb->zerocopy) {
+      write_list_push_tail(&s->zc, wb);
+    } else {
+      write_buffer_free(wb);
+    }
+  }
+  if (wl->head && sz > 0) {
+    wl->head->ptr += sz;
+    wl->head->sz -= sz;
+    sz = 0;
+  }
+  return sz;
+}
+
+// append datagrams of wl to msgs, return the new count
+static inline int udp_list_msgs(struct write_list *wl, struct mmsghdr *msgs, struct iovec *iov, int n) {
+  for (struct write_buffer *wb = wl->head; wb && n < UDP_BATCH; wb = wb->next) {
+    struct socket_udp_address *addr = &((struct write_buffer_udp*)wb)->addr;
+    iov[n].iov_base = wb->ptr;
+    iov[n].iov_len = wb->sz;
+    memset(&msgs[n], 0, sizeof msgs[n]);
+    msgs[n].msg_hdr.msg_name = addr->len ? &addr->u.addr : NULL;
+    msgs[n].msg_hdr.msg_namelen = addr->len;
+    msgs[n].msg_hdr.msg_iov = &iov[n];
+    msgs[n].msg_hdr.msg_iovlen = 1;
+    n++;
+  }
+  return n;
+}
+
+// a datagram is sent entirely or not at all
+static inline void udp_list_drop(struct socket_server *ss, struct socket *s, bool sent) {
+  struct write_list *wl = write_list_empty(&s->high) ? &s->low : &s->high;
+  struct write_buffer *wb = write_list_pop_head(wl);
+  if (sent) {
+    stat_write(&s->stat, ss->time, wb->sz);
+  }
+  s->wb_size -= wb->sz;
+  write_buffer_free(wb);
+}
+
+// datagrams of high list and then low list are sent by one sendmmsg, UDP_BATCH at most
+// a datagram which is refused (e.g. too large or unreachable) is dropped, it doesn't close the socket
+static int process_udp_write(struct socket_server *ss, struct socket *s) {
+  struct mmsghdr msgs[UDP_BATCH];
+  struct iovec iov[UDP_BATCH];
+  for (;;) {
+    int n = udp_list_msgs(&s->high, msgs, iov, 0);
+    n = udp_list_msgs(&s->low, msgs, iov, n);
+    if (n == 0) {
+      return -1;
+    }
+    int cnt = sendmmsg(s->fd, msgs, n, MSG_NOSIGNAL);
+    if (cnt < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return -1;
+      }
+      fprintf(stderr, "[socket-server]: udp socket %d sendto failed: %s\n", s->id, strerror(errno));
+      udp_list_drop(ss, s, false);
+      continue;
+    }
+    // if cnt < n, next one fails or blocks, it's told by next call
+    for (int i = 0; i < cnt; i ++) {
+      udp_list_drop(ss, s, true);
+    }
+  }
+}
+
+// gather buffers of high list and then low list into iov, or the head one alone if it's sent by MSG_ZEROCOPY
+// return the count, 0 if nothing is queued, hbytes of total are from high list
+static int write_lists_iov(struct socket_server *ss, struct socket *s, struct iovec *iov, size_t *total, size_t *hbytes, struct write_buffer **large) {
+  size_t zc = s->zerocopy ? ss->zerocopy : SIZE_MAX;
+  bool stop = false;
+  *total = 0;
+  *large = NULL;
+  int n = write_list_iov(&s->high, iov, 0, total, zc, &stop);
+  *hbytes = *total;
+  if (!stop) {
+    n = write_list_iov(&s->low, iov, n, total, zc, &stop);
+  }
+  if (n == 0 && stop) {
+    *large = s->high.head ? s->high.head : s->low.head;
+    iov[0].iov_base = (*large)->ptr;
+    iov[0].iov_len = (*large)->sz;
+    *total = (*large)->sz;
+    *hbytes = s->high.head ? *total : 0;
+    n = 1;
+  }
+  return n;
+}
+
+// consume cnt sent bytes, which are gathered with hbytes from high list
+// if the head of low list is sent partially, we raise it to high, so that later high buffers don't break it
+static void write_lists_advance(struct socket *s, size_t cnt, size_t hbytes) {
+  size_t high = cnt < hbytes ? cnt : hbytes;
+  write_list_advance(s, &s->high, high);
+  write_list_advance(s, &s->low, cnt - high);
+  if (write_list_uncomplete(&s->low)) {
+    raise_writelist(s);
+  }
+}
+
+// each socket has two write list: high and low
+// buffers are gathered from high list and then low list, and flushed by one sendmsg
+// so low list is only sent after high list is empty
+// called with dw_lock, return SOCKET_ERR if socket should be closed
+static int send_lists(struct socket_server *ss, struct socket *s) {
+  struct iovec iov[IOV_MAX];
+  for (;;) {
+    size_t total, hbytes;
+    struct write_buffer *large;
+    int n = write_lists_iov(ss, s, iov, &total, &hbytes, &large);
+    if (n == 0) {
+      return -1;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    ssize_t cnt = sendmsg(s->fd, &msg, large ? MSG_NOSIGNAL | MSG_ZEROCOPY : MSG_NOSIGNAL);
+    if (cnt < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == ENOBUFS && large) {
+        // out of optmem for notifications, copy it this time
+        cnt = sendmsg(s->fd, &msg, MSG_NOSIGNAL);
+        large = NULL;
+      }
+    }
+    if (cnt < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // wait for next EPOLLOUT edge
+        return -1;
+      }
+      return SOCKET_ERR;
+    }
+    if (large) {
+      // each successful zerocopy send takes one sequence number, even if it's partial
+      large->zerocopy = true;
+      large->zc_seq = s->zc_next++;
+    }
+    stat_write(&s->stat, ss->time, cnt);
+    s->wb_size -= cnt;
+    write_lists_advance(s, cnt, hbytes);
+    if ((size_t)cnt < total) {
+      // socket buffer is full
+      return -1;
+    }
+  }
+}
+
+#ifdef LEPTONET_USE_IO_URING
+// send_lists of a completion socket, gathered buffers are sent by one sendmsg in io_uring
+// sendmsg of all sockets in a round are submitted together by next wait, the rest is submitted after it completes
+// called with dw_lock, return SOCKET_ERR if socket should be closed
+static int submit_lists(struct socket_server *ss, struct socket *s) {
+  if (s->op) {
     return -1;
   }
-  r = readfrompipe(ss->recvctrl, request_buf, sizeof request_buf);
-  if (r == 0) {
+  struct iovec iov[IOV_MAX];
+  size_t total, hbytes;
+  struct write_buffer *large;
+  int n = write_lists_iov(ss, s, iov, &total, &hbytes, &large);
+  if (n == 0) {
     return -1;
   }
-  uint8_t type = header[0];
-  uint8_t len = header[1];
-  switch(type) {
-    case 'X': {
-      spinlock_lock(&ss->lock);
-      r = report_close(ss, (struct request_close*)request_buf, sm);
-      spinlock_unlock(&ss->lock);
-      return r;
+  struct send_op *op = leptonet_malloc(sizeof *op + n * sizeof(struct iovec));
+  if (op == NULL) {
+    fprintf(stderr, "[socket-server]: socket %d send of %zu bytes, out of memory\n", s->id, total);
+    return SOCKET_ERR;
+  }
+  op->s = s;
+  write_list_clear(&op->high);
+  write_list_clear(&op->low);
+  op->hbytes = hbytes;
+  op->large = large;
+  op->flags = large ? MSG_NOSIGNAL | MSG_ZEROCOPY : MSG_NOSIGNAL;
+  memcpy(op->iov, iov, n * sizeof(struct iovec));
+  memset(&op->msg, 0, sizeof op->msg);
+  op->msg.msg_iov = op->iov;
+  op->msg.msg_iovlen = n;
+  s->op = op;
+  ss->sends++;
+  uring_sendmsg(ss->uring, s->fd, &op->msg, op->flags, op);
+  return -1;
+}
+#endif
+
+// called with dw_lock, remainder of a direct write goes before anything queued after it
+// it's counted in wb_size since it's parked
+static inline void dw_flush(struct socket *s) {
+  if (s->dw) {
+    write_list_push_head(&s->high, s->dw);
+    s->dw = NULL;
+  }
+}
+
+static int process_write_event(struct socket_server *ss, struct socket *s, struct socket_message *sm) {
+  if (s->protocol == IPPROTO_UDP) {
+    return process_udp_write(ss, s);
+  }
+  spinlock_lock(&s->dw_lock);
+  dw_flush(s);
+#ifdef LEPTONET_USE_IO_URING
+  int r = s->completion ? submit_lists(ss, s) : send_lists(ss, s);
+#else
+  int r = send_lists(ss, s);
+#endif
+  spinlock_unlock(&s->dw_lock);
+  if (r == SOCKET_ERR) {
+    report_error(s, sm);
+    force_close(ss, s);
+  }
+  return r;
+}
+
+// addr is destination of a datagram, NULL for tcp socket or the connected peer
+static int report_send(struct socket_server *ss, struct request_send *rsend, struct socket_udp_address *addr, struct socket_message *sm) {
+  struct socket *s = query_socket(ss, rsend->id);
+  if (s == NULL || s->status == SOCKET_TYPE_LISTEN || s->status == SOCKET_TYPE_HALFCLOSE_WRITE ||
+      (addr && s->protocol != IPPROTO_UDP)) {
+    socket_server_buffer_free(rsend->buf);
+    return -1;
+  }
+  struct write_buffer *wb;
+  if (s->protocol == IPPROTO_UDP) {
+    struct write_buffer_udp *wbu = leptonet_malloc(sizeof *wbu);
+    if (wbu == NULL) {
+      // a datagram can be dropped alone
+      socket_server_buffer_free(rsend->buf);
+      return -1;
     }
-    case 'L': {
-      spinlock_lock(&ss->lock);
-      r = report_listen(ss, (struct request_listen*)request_buf, sm);
-      spinlock_unlock(&ss->lock);
+    if (addr) {
+      wbu->addr = *addr;
+    } else {
+      wbu->addr.len = 0;
+    }
+    wb = &wbu->wb;
+  } else {
+    wb = leptonet_malloc(sizeof *wb);
+    if (wb == NULL) {
+      // stream is broken without it
+      fprintf(stderr, "[socket-server]: socket %d buffer of %zu bytes dropped, out of memory\n", s->id, rsend->sz);
+      socket_server_buffer_free(rsend->buf);
+      report_error(s, sm);
+      force_close(ss, s);
+      return SOCKET_ERR;
+    }
+  }
+  wb->buffer = rsend->buf;
+  wb->ptr = rsend->buf;
+  wb->sz = rsend->sz;
+  wb->zerocopy = false;
+  wb->zc_seq = 0;
+  wb->next = NULL;
+  spinlock_lock(&s->dw_lock);
+  dw_flush(s);
+  // no EPOLLOUT edge comes for a socket which is already writable, so try to send it now
+  // a connecting socket flushes them when it's connected
+  bool idle = s->status != SOCKET_TYPE_CONNECTING && write_list_empty(&s->high) && write_list_empty(&s->low);
+  if (rsend->high) {
+    write_list_push_tail(&s->high, wb);
+  } else {
+    write_list_push_tail(&s->low, wb);
+  }
+  s->wb_size += wb->sz;
+  spinlock_unlock(&s->dw_lock);
+  if (idle) {
+    int r = process_write_event(ss, s, sm);
+    if (r != -1) {
       return r;
     }
-    case 'W': {
-      spinlock_lock(&ss->lock);
-      r = report_send(ss, (struct request_send*)request_buf, sm);
-      spinlock_unlock(&ss->lock);
+  }
+  return report_watermark(ss, s, sm);
+}
+
+static int report_setwatermark(struct socket_server *ss, struct request_watermark *rwatermark, struct socket_message *sm) {
+  struct socket *s = query_socket(ss, rwatermark->id);
+  if (s == NULL) {
+    return -1;
+  }
+  if (s->warned) {
+    // it's replaced, let old link go
+    pause_link(ss, s, false);
+    s->warned = false;
+  }
+  // direct write reads them
+  spinlock_lock(&s->dw_lock);
+  s->wb_high = rwatermark->high;
+  s->wb_low = rwatermark->low < rwatermark->high ? rwatermark->low : rwatermark->high / 2;
+  spinlock_unlock(&s->dw_lock);
+  s->link = rwatermark->link;
+  return report_watermark(ss, s, sm);
+}
+
+// on EPOLLOUT of a connecting socket
+static int report_connected(struct socket_server *ss, struct socket *s, struct socket_message *sm) {
+  int err = 0;
+  socklen_t len = sizeof err;
+  if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+    err = errno;
+  }
+  if (err != 0) {
+    fprintf(stderr, "[socket-server]: connect failed: %s\n", strerror(err));
+    report_error(s, sm);
+    force_close(ss, s);
+    return SOCKET_ERR;
+  }
+  s->status = SOCKET_TYPE_CONNECTED;
+  enable_zerocopy(ss, s);
+  poller_stream(ss, s);
+  // buffers queued while connecting, this edge is the only one for them
+  if (process_write_event(ss, s, sm) == SOCKET_ERR) {
+    return SOCKET_ERR;
+  }
+  sm->id = s->id;
+  sm->opaque = s->opaque;
+  sm->buffer = NULL;
+  sm->ud = 0;
+  return SOCKET_OPEN;
+}
+
+static int process_cmd(struct socket_server *ss, struct socket_message *sm) {
+  struct request req;
+  if (!cmd_pop(&ss->cmd, &req)) {
+    // a request which isn't published yet signals eventfd again, since signaled has been cleared
+    ss->checkctrl = 0;
+    return -1;
+  }
+  switch(req.type) {
+    case REQUEST_CLOSE:
+      return report_close(ss, &req.u.rclose, sm);
+    case REQUEST_LISTEN:
+      return report_listen(ss, req.u.ropen, sm);
+    case REQUEST_CONNECT:
+      return report_connect(ss, req.u.ropen, sm);
+    case REQUEST_WATERMARK:
+      return report_setwatermark(ss, &req.u.rwatermark, sm);
+    case REQUEST_CHECK: {
+      struct socket *s = query_socket(ss, req.u.rcheck.id);
+      if (s == NULL) {
+        return -1;
+      }
+      if (s->completion) {
+        // submit the remainder
+        int r = process_write_event(ss, s, sm);
+        if (r != -1) {
+          return r;
+        }
+      }
+      return report_watermark(ss, s, sm);
+    }
+    case REQUEST_SEND: {
+      int r = report_send(ss, &req.u.rsend, NULL, sm);
+      // it's queued or sent, a direct write can go after it now
+      ATOMIC_DEC(&ss->slots[HASH_ID(req.u.rsend.id)].sending);
       return r;
     }
+    case REQUEST_UDP:
+      return report_udp(ss, req.u.ropen, sm);
+    case REQUEST_SENDTO:
+      return report_send(ss, &req.u.rsendto.send, &req.u.rsendto.addr, sm);
+    case REQUEST_EXIT:
+      sm->id = -1;
+      sm->opaque = 0;
+      sm->ud = 0;
+      sm->buffer = NULL;
+      return SOCKET_EXIT;
   }
   return -1;
 }
 
-static int report_error(struct socket *s, struct socket_message *sm) {
+// called on eventfd event, clear signaled before draining the ring
+static void drain_signal(struct socket_server *ss) {
+  uint64_t cnt;
+  while (read(ss->ctrlfd, &cnt, sizeof cnt) < 0 && errno == EINTR) {}
+  ATOMIC_XCHG(&ss->signaled, 0);
+  ss->checkctrl = 1;
+}
+
+// "ip:port" of peer, it's freed by user, NULL if it's out of memory
+static char* address_string(union socketaddr *u) {
+  char ip[INET6_ADDRSTRLEN];
+  char *buf = leptonet_malloc(INET6_ADDRSTRLEN + 16);
+  if (buf == NULL) {
+    return NULL;
+  }
+  if (u->addr.sa_family == AF_INET6) {
+    inet_ntop(AF_INET6, &u->addrv6.sin6_addr, ip, sizeof ip);
+    snprintf(buf, INET6_ADDRSTRLEN + 16, "[%s]:%d", ip, ntohs(u->addrv6.sin6_port));
+  } else if (u->addr.sa_family == AF_INET) {
+    inet_ntop(AF_INET, &u->addrv4.sin_addr, ip, sizeof ip);
+    snprintf(buf, INET6_ADDRSTRLEN + 16, "%s:%d", ip, ntohs(u->addrv4.sin_port));
+  } else {
+    buf[0] = '\0';
+  }
+  return buf;
+}
+
+// drop a connection that we can't keep, so that it doesn't stay in backlog and wake us up again
+static void shed_connection(struct socket_server *ss, int fd) {
+  if (fd >= 0) {
+    close(fd);
+  }
+  ss->shed++;
+  // log at 1, 2, 4, 8 ... so that a storm doesn't flood stderr
+  if ((ss->shed & (ss->shed - 1)) == 0) {
+    fprintf(stderr, "[socket-server]: %llu connections are dropped\n", (unsigned long long)ss->shed);
+  }
+}
+
+// out of fd, free the reserved one to accept and close the connection, then reserve it again
+static bool shed_with_reserved(struct socket_server *ss, struct socket *s) {
+  if (ss->reserved < 0) {
+    return false;
+  }
+  close(ss->reserved);
+  int fd = accept(s->fd, NULL, NULL);
+  if (fd >= 0) {
+    shed_connection(ss, fd);
+  }
+  ss->reserved = dup(1);
+  return fd >= 0;
+}
+
+// keep a connection accepted by s, return false if it's shed for lack of slot
+static bool accept_socket(struct socket_server *ss, struct socket *s, int fd, union socketaddr *u, struct socket_message *sm) {
+  int id = reserved_id(ss);
+  struct socket *ns = id < 0 ? NULL : newsocket(ss, id, fd, s->opaque, SOCK_STREAM, IPPROTO_TCP);
+  if (ns == NULL) {
+    shed_connection(ss, fd);
+    return false;
+  }
+  ns->status = SOCKET_TYPE_CONNECTED;
+  enable_zerocopy(ss, ns);
+  poller_stream(ss, ns);
   sm->id = s->id;
   sm->opaque = s->opaque;
-  sm->ud = 0;
-  sm->buffer = NULL;
-  return SOCKET_ERR;
+  sm->ud = id;
+  sm->buffer = address_string(u);
+  return true;
+}
+
+// listen socket stays at the head of ready list until EAGAIN or its budget is used up
+static int process_accept(struct socket_server *ss, struct socket *s, struct socket_message *sm) {
+  for (;;) {
+    union socketaddr u;
+    socklen_t len = sizeof u;
+    int fd = accept4(s->fd, &u.addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      switch (errno) {
+        case EINTR:
+        case ECONNABORTED:
+        case EPROTO:
+        case EPERM:
+          // peer gives up before we accept it
+          continue;
+        case EMFILE:
+        case ENFILE:
+          if (shed_with_reserved(ss, s)) {
+            if (--s->budget > 0) {
+              continue;
+            }
+            ready_push(ss, ready_pop(ss));
+            return -1;
+          }
+          // no reserved fd, give up until next connection
+          break;
+        case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+        case EWOULDBLOCK:
+#endif
+          break;
+        default:
+          fprintf(stderr, "[socket-server]: accept failed: %s\n", strerror(errno));
+          break;
+      }
+      ready_pop(ss);
+      return -1;
+    }
+    if (!accept_socket(ss, s, fd, &u, sm)) {
+      if (--s->budget > 0) {
+        continue;
+      }
+      ready_push(ss, ready_pop(ss));
+      return -1;
+    }
+    if (--s->budget <= 0) {
+      // accept storm, let others go
+      ready_push(ss, ready_pop(ss));
+    }
+    return SOCKET_ACCEPT;
+  }
+}
+
+// NULL if pool is used up and it's out of memory
+static inline char* read_buffer(struct socket_server *ss, size_t sz) {
+  char *buf = ss->pool ? socket_pool_alloc(ss->pool, sz) : NULL;
+  if (buf == NULL) {
+    buf = leptonet_malloc(sz);
+  }
+  return buf;
 }
 
+// called for the head of ready list, one recv per call
+// for SOCKET_READ_POOL, recv into a pooled buffer of minread bytes, and hand it to user
+// for SOCKET_READ_COPY, recv into scratch, and copy exact bytes out, so a small message doesn't hold a large buffer
 static int process_read_event(struct socket_server *ss, struct socket *s, struct socket_message *sm) {
-  size_t sz = s->minread;
-  char *buf = leptonet_malloc(sz);
+  bool copy = ss->readmode == SOCKET_READ_COPY;
+  size_t sz = copy ? TCP_MAX_READBYTES : (size_t)s->minread;
+  char *buf = copy ? ss->scratch : read_buffer(ss, sz);
+  if (buf == NULL) {
+    // data left in kernel brings no more edge, so socket can't wait for memory
+    fprintf(stderr, "[socket-server]: socket %d read buffer of %zu bytes, out of memory\n", s->id, sz);
+    ready_pop(ss);
+    report_error(s, sm);
+    force_close(ss, s);
+    return SOCKET_ERR;
+  }
   int cnt = recv(s->fd, buf, sz, 0);
 
+  if (cnt <= 0 && !copy) {
+    socket_server_buffer_free(buf);
+  }
   if (cnt < 0) {
-    if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+    if (errno == EINTR) {
+      return -1;
+    }
+    ready_pop(ss);
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
       return -1;
     }
-    return report_error(s, sm);
+    report_error(s, sm);
+    force_close(ss, s);
+    return SOCKET_ERR;
+  }
+  if (cnt == 0) {
+    // remote closed
+    ready_pop(ss);
+    report_error(s, sm);
+    force_close(ss, s);
+    return SOCKET_CLOSE;
+  }
+
+  if (copy) {
+    char *data = leptonet_malloc(cnt);
+    if (data == NULL) {
+      fprintf(stderr, "[socket-server]: socket %d data of %d bytes dropped, out of memory\n", s->id, cnt);
+      ready_pop(ss);
+      report_error(s, sm);
+      force_close(ss, s);
+      return SOCKET_ERR;
+    }
+    memcpy(data, buf, cnt);
+    buf = data;
   }
-  
   stat_read(&s->stat, ss->time, cnt);
   sm->id = s->id;
   sm->opaque = s->opaque;
   sm->ud = cnt;
   sm->buffer = buf;
-  if (cnt == sz) {
-    s->minread *= 2;
-  } else if (cnt > TCP_MIN_READBYTES && 2 * cnt < sz) {
-    s->minread /= 2;
+  if (cnt == (int)sz) {
+    if (s->minread < TCP_MAX_READBYTES) {
+      s->minread *= 2;
+    }
+    // there may be more, keep it ready until EAGAIN, but let others go when its budget is used up
+    s->budget -= cnt;
+    if (s->budget <= 0) {
+      ready_push(ss, ready_pop(ss));
+    }
+  } else {
+    // a short read has drained the receive queue, new data will trigger another edge
+    ready_pop(ss);
+    // halve it when less than half is used, so buffer class follows traffic down
+    if (!copy && s->minread > TCP_MIN_READBYTES && 2 * cnt < (int)sz) {
+      s->minread /= 2;
+    }
   }
   return SOCKET_DATA;
 }
 
-static int send_writelist(struct socket *s, struct write_list *wl, struct socket_message *sm) {
-  while (wl->head) {
-    struct write_buffer *wb = wl->head;
-    int cnt = send(s->fd, wb->ptr, wb->sz, 0);
-    if (cnt < 0) {
-      if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
-        return -1;
-      }
-      return report_error(s, sm);
-    }
-    if (cnt != wb->sz) {
-      wb->ptr += cnt;
-      wb->sz -= cnt;
+// one recvmmsg takes UDP_BATCH datagrams at most, each one is copied out with its source, and delivered by later polls
+static int process_udp_read(struct socket_server *ss, struct socket *s, struct socket_message *sm) {
+  struct mmsghdr msgs[UDP_BATCH];
+  struct iovec iov[UDP_BATCH];
+  struct socket_udp_address addrs[UDP_BATCH];
+  for (int i = 0; i < UDP_BATCH; i ++) {
+    iov[i].iov_base = ss->udp_scratch + (size_t)i * UDP_MAX_DATAGRAM;
+    iov[i].iov_len = UDP_MAX_DATAGRAM;
+    memset(&msgs[i], 0, sizeof msgs[i]);
+    msgs[i].msg_hdr.msg_name = &addrs[i].u;
+    msgs[i].msg_hdr.msg_namelen = sizeof addrs[i].u;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  int n = recvmmsg(s->fd, msgs, UDP_BATCH, 0, NULL);
+  if (n < 0) {
+    if (errno == EINTR) {
       return -1;
     }
-    wl->head = wb->next;
-    write_buffer_free(wb);
+    ready_pop(ss);
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      // e.g. icmp error of an earlier datagram, socket is still usable
+      fprintf(stderr, "[socket-server]: udp socket %d recv failed: %s\n", s->id, strerror(errno));
+    }
+    return -1;
   }
-  wl->tail = NULL;
-  return -1;
+  size_t total = 0;
+  int delivered = 0;
+  for (int i = 0; i < n; i ++) {
+    size_t sz = msgs[i].msg_len;
+    size_t off = UDP_ADDRESS_OFFSET(sz);
+    char *buf = read_buffer(ss, off + sizeof(struct socket_udp_address));
+    if (buf == NULL) {
+      // out of memory, drop the datagram
+      continue;
+    }
+    memcpy(buf, iov[i].iov_base, sz);
+    addrs[i].len = msgs[i].msg_hdr.msg_namelen;
+    memcpy(buf + off, &addrs[i], sizeof addrs[i]);
+    struct socket_message *m = &ss->udp[delivered++];
+    m->id = s->id;
+    m->opaque = s->opaque;
+    m->ud = sz;
+    m->buffer = buf;
+    total += sz;
+  }
+  stat_read(&s->stat, ss->time, total);
+  ss->udp_next = 0;
+  ss->udp_num = delivered;
+  if (n < UDP_BATCH) {
+    // drained
+    ready_pop(ss);
+  } else {
+    s->budget -= total;
+    if (s->budget <= 0) {
+      ready_push(ss, ready_pop(ss));
+    }
+  }
+  if (delivered == 0) {
+    return -1;
+  }
+  *sm = ss->udp[ss->udp_next++];
+  return SOCKET_UDP;
 }
 
-static inline int write_list_uncomplete(struct write_list *wl) {
-  if (write_list_empty(wl)) {
-    return 0;
+#ifdef LEPTONET_USE_IO_URING
+// data of multishot recv is copied out of provided buffer, which is given back to kernel by next wait
+static int process_recv_done(struct socket_server *ss, struct socket *s, struct event *e, struct socket_message *sm) {
+  if (s->status == SOCKET_TYPE_HALFCLOSE_READ) {
+    // it's shut down for reading, and eof is caused by that
+    return -1;
   }
-  return wl->head->buffer != wl->head->ptr;
+  if (e->res <= 0) {
+    // remote closed, or error
+    report_error(s, sm);
+    force_close(ss, s);
+    return e->res == 0 ? SOCKET_CLOSE : SOCKET_ERR;
+  }
+  size_t sz = e->res;
+  char *buf = ss->readmode == SOCKET_READ_COPY ? leptonet_malloc(sz) : read_buffer(ss, sz);
+  if (buf == NULL) {
+    fprintf(stderr, "[socket-server]: socket %d data of %zu bytes dropped, out of memory\n", s->id, sz);
+    report_error(s, sm);
+    force_close(ss, s);
+    return SOCKET_ERR;
+  }
+  memcpy(buf, e->data, sz);
+  stat_read(&s->stat, ss->time, sz);
+  sm->id = s->id;
+  sm->opaque = s->opaque;
+  sm->ud = sz;
+  sm->buffer = buf;
+  return SOCKET_DATA;
 }
 
-static void raise_writelist(struct socket *s) {
-  struct write_buffer *wb = write_list_pop_head(&s->low);
-  write_list_push_head(&s->high, wb);
+// fd is accepted by multishot accept, or -errno which ends it
+static int process_accept_done(struct socket_server *ss, struct socket *s, int fd, struct socket_message *sm) {
+  if (fd < 0) {
+    if (fd == -EMFILE || fd == -ENFILE) {
+      shed_with_reserved(ss, s);
+    } else if (fd != -ECONNABORTED && fd != -EPROTO && fd != -EPERM && fd != -EINTR) {
+      fprintf(stderr, "[socket-server]: accept failed: %s\n", strerror(-fd));
+    }
+    uring_accept(ss->uring, s->fd);
+    return -1;
+  }
+  union socketaddr u;
+  socklen_t len = sizeof u;
+  if (getpeername(fd, &u.addr, &len) < 0) {
+    u.addr.sa_family = AF_UNSPEC;
+  }
+  return accept_socket(ss, s, fd, &u, sm) ? SOCKET_ACCEPT : -1;
 }
 
-// each socket has two write list: high and low
-// if high list is not empty, send it as far as possible
-// if high list is empty, send low list as far as possible
-// after sending low list, if it's uncomplete, we raise it to high
-static int process_write_event(struct socket_server *ss, struct socket *s, struct socket_message *sm) {
-  if (!write_list_empty(&s->high)) {
-    return send_writelist(s, &s->high, sm);
+// completion of submit_lists, the rest of lists is submitted after it
+static int process_send_done(struct socket_server *ss, struct send_op *op, int res, struct socket_message *sm) {
+  struct socket *s = op->s;
+  if (s == NULL) {
+    // socket is closed, kernel has released its buffers
+    write_list_free(&op->high);
+    write_list_free(&op->low);
+    leptonet_free(op);
+    ss->sends--;
+    return -1;
   }
-  if (!write_list_empty(&s->high) && !write_list_empty(&s->low)) {
-    return send_writelist(s, &s->low, sm);
+  spinlock_lock(&s->dw_lock);
+  if (res == -EINTR || res == -EAGAIN || (res == -ENOBUFS && op->large)) {
+    if (res == -ENOBUFS) {
+      // out of optmem for notifications, copy it this time
+      op->large = NULL;
+      op->flags = MSG_NOSIGNAL;
+    }
+    uring_sendmsg(ss->uring, s->fd, &op->msg, op->flags, op);
+    spinlock_unlock(&s->dw_lock);
+    return -1;
   }
-  if (write_list_uncomplete(&s->low)) {
-    raise_writelist(s);
+  s->op = NULL;
+  int r = SOCKET_ERR;
+  if (res >= 0) {
+    if (op->large) {
+      // each successful zerocopy send takes one sequence number, even if it's partial
+      op->large->zerocopy = true;
+      op->large->zc_seq = s->zc_next++;
+    }
+    stat_write(&s->stat, ss->time, res);
+    s->wb_size -= res;
+    write_lists_advance(s, res, op->hbytes);
+    r = submit_lists(ss, s);
   }
-  sm->id = s->id;
-  sm->opaque = s->opaque;
-  sm->ud = 0;
-  sm->buffer = NULL;
-  return -1;
+  spinlock_unlock(&s->dw_lock);
+  leptonet_free(op);
+  ss->sends--;
+  if (r == SOCKET_ERR) {
+    report_error(s, sm);
+    force_close(ss, s);
+    return SOCKET_ERR;
+  }
+  return report_watermark(ss, s, sm);
+}
+
+static int process_completion(struct socket_server *ss, struct event *e, struct socket_message *sm) {
+  if (e->kind == EVENT_SEND) {
+    return process_send_done(ss, e->data, e->res, sm);
+  }
+  struct socket *s = e->socket;
+  if (s->status == SOCKET_TYPE_INVALID || s->status == SOCKET_TYPE_RESERVE) {
+    // closed by an earlier event of this round
+    if (e->kind == EVENT_ACCEPT && e->res >= 0) {
+      close(e->res);
+    }
+    return -1;
+  }
+  if (e->kind == EVENT_ACCEPT) {
+    return process_accept_done(ss, s, e->res, sm);
+  }
+  return process_recv_done(ss, s, e, sm);
+}
+
+// sends of closed sockets are canceled, wait for their completions to free buffers
+static void drain_sends(struct socket_server *ss) {
+  struct socket_message sm;
+  for (;;) {
+    for (; ss->evid < ss->evnum; ss->evid++) {
+      struct event *e = &ss->events[ss->evid];
+      if (e->kind == EVENT_SEND) {
+        process_send_done(ss, e->data, e->res, &sm);
+      }
+    }
+    if (ss->sends == 0) {
+      return;
+    }
+    int cnt = poller_wait(ss, -1);
+    ss->evnum = cnt < 0 ? 0 : cnt;
+    ss->evid = 0;
+  }
+}
+#endif
+
+static int process_ready(struct socket_server *ss, struct socket_message *sm) {
+  struct socket *s = ss->ready_head;
+  if (!s->read || s->completion || s->status == SOCKET_TYPE_INVALID || s->status == SOCKET_TYPE_RESERVE) {
+    ready_pop(ss);
+    return -1;
+  }
+  if (s->status == SOCKET_TYPE_LISTEN) {
+    return process_accept(ss, s, sm);
+  }
+  if (s->protocol == IPPROTO_UDP) {
+    return process_udp_read(ss, s, sm);
+  }
+  return process_read_event(ss, s, sm);
 }
 
 int socket_server_poll(struct socket_server *ss, struct socket_message *sm) {
   for (;;) {
+    if (ss->udp_next < ss->udp_num) {
+      // rest of last recvmmsg, before anything which may close their socket
+      *sm = ss->udp[ss->udp_next++];
+      return SOCKET_UDP;
+    }
     if (ss->checkctrl) {
-      if (hascmd(ss)) {
-        int r = process_cmd(ss, sm);
+      int r = process_cmd(ss, sm);
+      if (r == -1) {
+        continue;
+      }
+      return r;
+    }
+    if (ss->evid == ss->evnum) {
+      if (ss->ready_head && ss->ready_turns > 0) {
+        ss->ready_turns--;
+        int r = process_ready(ss, sm);
         if (r == -1) {
           continue;
         }
         return r;
-      } else {
-        ss->checkctrl = 0;
       }
-    }
-    if (ss->evid == ss->evnum) {
-      int cnt = epwait(ss->epfd, ss->events, EVENT_MAX);
+      // block only if there is nothing left to read, commands and sockets both wake it up
+      int cnt = poller_wait(ss, ss->ready_head ? 0 : -1);
       if (cnt < 0) {
-        fprintf(stderr, "[socket-server]: epoll wait failed: %s\n", strerror(errno));
-        continue;
-      }
-      ss->evnum = cnt;
-      ss->checkctrl = 1;
-    }
-    struct event *e = &ss->events[ss->evid];
-    struct socket *s = e->socket;
-    switch(s->status) {
-      case SOCKET_TYPE_INVALID:
-      case SOCKET_TYPE_RESERVE: {
-        int r = force_close(ss, s);
-        if (r == SOCKET_ERR) {
-          return report_error(s, sm);
+        if (errno != EINTR) {
+          fprintf(stderr, "[socket-server]: epoll wait failed: %s\n", strerror(errno));
         }
-        break;
-      }
-      case SOCKET_TYPE_LISTEN: {
-
+        cnt = 0;
       }
+      ss->evnum = cnt;
+      ss->evid = 0;
+      // new events and commands are checked again after at most EVENT_MAX reads
+      ss->ready_turns = EVENT_MAX;
+      continue;
     }
-    if (e->read) {
-      spinlock_lock(&ss->lock);
-      int r = process_read_event(ss, s, sm);
-      spinlock_unlock(&ss->lock);
-      if (r == SOCKET_ERR) {
-        fprintf(stderr, "[socket_server]: socket: %d error: %s\n", s->id, strerror(errno));
-        return r;
-      } else {
-        ss->evid--;
-        return r;
+    struct event *e = &ss->events[ss->evid++];
+#ifdef LEPTONET_USE_IO_URING
+    if (e->kind != EVENT_READY) {
+      int r = process_completion(ss, e, sm);
+      if (r == -1) {
+        continue;
       }
+      return r;
     }
-    if (e->write) {
-      spinlock_lock(&ss->lock);
-      int r = process_write_event(ss, s, sm);
-      spinlock_unlock(&ss->lock);
-      if (r == SOCKET_ERR) {
-        fprintf(stderr, "[socket_server]: socket: %d error: %s\n", s->id, strerror(errno));
-        return r;
-      }
+#endif
+    struct socket *s = e->socket;
+    if (s == NULL) {
+      drain_signal(ss);
+      continue;
     }
-    if (e->eof) {
-      // remote has close write side, we should close read side
-      if (s->status == SOCKET_TYPE_HALFCLOSE_READ) {
-        break;
-      }
-      s->status = SOCKET_TYPE_HALFCLOSE_READ;
-      if (enable_read(ss, s, false)) {
-        fprintf(stderr, "[socket-server]: close read for %d failed: %s\n", s->id, strerror(errno));
-        return report_error(s, sm);
-      }
+    if (s->status == SOCKET_TYPE_INVALID || s->status == SOCKET_TYPE_RESERVE) {
+      // closed by an earlier event of this round
+      continue;
     }
-    if (e->error) {
+    if (e->error && s->protocol == IPPROTO_UDP) {
+      // icmp error of an earlier datagram, clear it and keep the socket
+      int err = 0;
+      socklen_t len = sizeof err;
+      getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    } else if (e->error) {
+      // zerocopy completions are reported as EPOLLERR, it's an error only if SO_ERROR is set
+      bool completed = s->zerocopy || !write_list_empty(&s->zc) ? zerocopy_complete(s) > 0 : false;
       // we retrive errors and log it
       int err = 0;
       socklen_t len = sizeof err;
       int r = getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len);
       err = r < 0 ? errno : err;
-      fprintf(stderr, "[socket-server]: socket error: %s\n", strerror(err));
-      report_error(s, sm);
-      return force_close(ss, s);
+      if (err != 0 || !completed) {
+        fprintf(stderr, "[socket-server]: socket %d error: %s\n", s->id, strerror(err));
+        report_error(s, sm);
+        force_close(ss, s);
+        return SOCKET_ERR;
+      }
+    }
+    if (s->completion) {
+      // only errors are polled
+      continue;
+    }
+    if (e->read || e->eof) {
+      // eof is found by recv after the remaining data
+      ready_push(ss, s);
+    }
+    if (e->write && s->status == SOCKET_TYPE_CONNECTING) {
+      return report_connected(ss, s, sm);
+    }
+    if (e->write && s->status != SOCKET_TYPE_LISTEN) {
+      int r = process_write_event(ss, s, sm);
+      if (r == -1) {
+        r = report_watermark(ss, s, sm);
+      }
+      if (r != -1) {
+        return r;
+      }
     }
   }
 }
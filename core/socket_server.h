@@ -3,6 +3,8 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 #include "socket_info.h"
 #include "spinlock.h"
@@ -18,6 +20,37 @@
 #define SOCKET_CLOSE 3
 // socket has error
 #define SOCKET_ERR 4
+// socket_server_exit is called, poll loop should stop
+#define SOCKET_EXIT 5
+// a datagram is received by udp socket, its source is got by socket_server_udp_source
+#define SOCKET_UDP 6
+// write buffer of socket is beyond its high watermark, ud is buffered bytes
+// it's reported again with ud 0 when write buffer drains to low watermark
+#define SOCKET_WARNING 7
+
+// how SOCKET_DATA buffers are allocated
+// a pooled buffer of the adaptive read size, default
+#define SOCKET_READ_POOL 0
+// recv into a per-reactor scratch area and copy exact bytes out
+#define SOCKET_READ_COPY 1
+
+// low bits of socket id is the reactor which owns it
+#define SOCKET_SHARD_BITS 6
+#define SOCKET_SHARD_MAX (1 << SOCKET_SHARD_BITS)
+
+static inline int socket_shard(int id) {
+  return id & (SOCKET_SHARD_MAX - 1);
+}
+
+// source of a datagram, or destination of socket_server_sendto
+struct socket_udp_address {
+  socklen_t len;
+  union {
+    struct sockaddr addr;
+    struct sockaddr_in v4;
+    struct sockaddr_in6 v6;
+  } u;
+};
 
 struct socket_buffer {
   int id;     // unique socket id
@@ -28,22 +61,59 @@ struct socket_buffer {
 struct socket_message {
   int id;           // unique socket id
   uintptr_t opaque; // user data
-  char *buffer;     // for SOCKET_OPEN, which is ip addr
-  size_t ud;        // for SOCKET_DATA, which is buffer size
+  char *buffer;     // for SOCKET_DATA and SOCKET_UDP, which is data, freed by socket_server_buffer_free; for SOCKET_ACCEPT, which is peer address "ip:port", freed by leptonet_free
+  size_t ud;        // for SOCKET_DATA and SOCKET_UDP, which is buffer size; for SOCKET_ACCEPT, which is new socket id; for SOCKET_WARNING, which is buffered bytes
 };
 
 struct socket;
 struct socket_server;
 
 struct socket_server* socket_server_create(uint64_t time);
+// send buffers of at least threshold bytes by MSG_ZEROCOPY, they are freed after kernel releases them
+// 0 turns it off (default), it applies to sockets accepted afterwards, call it before polling
+void socket_server_zerocopy(struct socket_server *ss, size_t threshold);
+// call it before polling
+void socket_server_readmode(struct socket_server *ss, int mode);
+// ids allocated by ss carry shard in their low bits, 0 by default, call it before polling
+void socket_server_shard(struct socket_server *ss, int shard);
+// "io_uring" if it's built with LEPTONET_USE_IO_URING and supported by kernel, otherwise "epoll"
+const char* socket_server_backend(struct socket_server *ss);
+// make socket_server_poll return SOCKET_EXIT
+void socket_server_exit(struct socket_server *ss);
 
+// it waits for names which are being resolved for ss
 void socket_server_release(struct socket_server *ss);
 int socket_server_poll(struct socket_server *ss, struct socket_message *sm);
 
-void socket_server_listen(struct socket_server *ss, const char *host, const char *port, int backlog, uintptr_t opaque);
+// names of listen, udp and connect are resolved by resolver threads, host and port are copied
+// listen and udp return -1 if caller is over its hard memory limit, otherwise the result is reported later
+int socket_server_listen(struct socket_server *ss, const char *host, const char *port, int backlog, uintptr_t opaque);
 void socket_server_close(struct socket_server *ss, int id, int what, uintptr_t opaque);
+// bind a udp socket, host may be NULL for any address, it's reported as SOCKET_OPEN
+int socket_server_udp(struct socket_server *ss, const char *host, const char *port, uintptr_t opaque);
+// non-blocking connect, the returned id is reported as SOCKET_OPEN once it's connected, or SOCKET_ERR
+// buffers sent before SOCKET_OPEN may be dropped, -1 if no id is left or caller is over its hard memory limit
+// it may be closed before SOCKET_OPEN, then it's reported as SOCKET_CLOSE instead, half close is ignored until then
+int socket_server_connect(struct socket_server *ss, const char *host, const char *port, uintptr_t opaque);
+
+// SOCKET_DATA buffer may be from a read buffer pool, it must be freed by this or passed to socket_server_send*
+// it's thread safe, and buffers allocated by leptonet_malloc are accepted too
+void socket_server_buffer_free(void *buffer);
 
+// report SOCKET_WARNING when write buffer of id grows to high bytes, and when it drains to low bytes
+// reads of socket link, which must be owned by ss too, are paused in between, -1 for none
+// high 0 turns it off (default)
+void socket_server_watermark(struct socket_server *ss, int id, size_t high, size_t low, int link);
+
+// buffer is owned by socket server afterwards
 void socket_server_sendhigh(struct socket_server *ss, struct socket_buffer *buf);
 void socket_server_sendlow(struct socket_server *ss, struct socket_buffer *buf);
+// send a datagram by udp socket buf->id, datagrams are flushed by sendmmsg in batch
+void socket_server_sendto(struct socket_server *ss, struct socket_buffer *buf, const struct socket_udp_address *addr);
+
+// source of a SOCKET_UDP message, it's stored after data and freed together
+const struct socket_udp_address* socket_server_udp_source(struct socket_message *sm);
+// numeric ip of v4 or v6, false if ip is invalid
+bool socket_server_udp_address(const char *ip, int port, struct socket_udp_address *addr);
 
 #endif
@@ -0,0 +1,691 @@
+#ifdef LEPTONET_USE_IO_URING
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+#include "leptonet_malloc.h"
+#include "atomic.h"
+
+// it's user_data of requests whose completion is ignored, e.g. POLL_REMOVE
+#define URING_IGNORE 0
+// user_data of others is a watch or a send token, its low bits tell the request
+#define TAG_POLL 0
+#define TAG_RECV 1
+#define TAG_ACCEPT 2
+#define TAG_SEND 3
+#define TAG_MASK 3
+
+#define WATCH_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP)
+
+// provided buffers of multishot recv, one group is shared by all fds
+#define BUF_GROUP 0
+// power of two
+#define BUF_COUNT 256
+#define BUF_SIZE (16 * 1024)
+
+// one registration, it's user_data of its POLL_ADD, and of its RECV or ACCEPT with a tag
+// it's freed after the last completion of them, so a stale completion never refers to a reused one
+struct uring_watch {
+  int fd;
+  bool dead;                  // removed by user, completions are dropped
+  bool poll;                  // poll is in kernel, a completion without IORING_CQE_F_MORE ends it
+  bool recv;                  // multishot recv is wanted, it's armed again after it's ended by kernel
+  bool recv_armed;            // multishot recv is in kernel
+  bool accept_armed;          // multishot accept is in kernel
+  unsigned events;            // poll mask
+  void *ptr;
+  struct uring_watch *prev;
+  struct uring_watch *next;
+};
+
+struct uring {
+  int fd;
+  // submission queue
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned tail;              // local tail, published before each enter
+  // completion queue
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  // mappings
+  void *sq_ring;
+  size_t sq_ring_sz;
+  void *cq_ring;
+  size_t cq_ring_sz;
+  size_t sqes_sz;
+  // watch of each fd
+  struct uring_watch **watch;
+  int watch_cap;
+  struct uring_watch *watches; // all of them, including dead ones waiting for last completion
+  // provided buffer ring
+  struct io_uring_buf_ring *br;
+  char *bufs;
+  unsigned short br_tail;     // local tail, published by buf_recycle
+  unsigned short lent[BUF_COUNT]; // buffers of reported or dropped completions, given back by next wait
+  int nlent;
+};
+
+static inline int sys_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int sys_enter(int fd, unsigned submit, unsigned complete, unsigned flags, void *arg, size_t argsz) {
+  return (int)syscall(__NR_io_uring_enter, fd, submit, complete, flags, arg, argsz);
+}
+
+static inline int sys_register(int fd, unsigned opcode, void *arg, unsigned nr) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+static void uring_unmap(struct uring *u) {
+  if (u->bufs) {
+    munmap(u->bufs, (size_t)BUF_COUNT * BUF_SIZE);
+  }
+  if (u->br) {
+    munmap(u->br, BUF_COUNT * sizeof(struct io_uring_buf));
+  }
+  if (u->sqes) {
+    munmap(u->sqes, u->sqes_sz);
+  }
+  if (u->cq_ring && u->cq_ring != u->sq_ring) {
+    munmap(u->cq_ring, u->cq_ring_sz);
+  }
+  if (u->sq_ring) {
+    munmap(u->sq_ring, u->sq_ring_sz);
+  }
+}
+
+static int uring_map(struct uring *u, struct io_uring_params *p) {
+  u->sq_ring_sz = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+  u->cq_ring_sz = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+  if (p->features & IORING_FEAT_SINGLE_MMAP) {
+    if (u->cq_ring_sz > u->sq_ring_sz) {
+      u->sq_ring_sz = u->cq_ring_sz;
+    }
+    u->cq_ring_sz = u->sq_ring_sz;
+  }
+  u->sq_ring = mmap(NULL, u->sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (u->sq_ring == MAP_FAILED) {
+    u->sq_ring = NULL;
+    return -1;
+  }
+  if (p->features & IORING_FEAT_SINGLE_MMAP) {
+    u->cq_ring = u->sq_ring;
+  } else {
+    u->cq_ring = mmap(NULL, u->cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if (u->cq_ring == MAP_FAILED) {
+      u->cq_ring = NULL;
+      return -1;
+    }
+  }
+  u->sqes_sz = p->sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED) {
+    u->sqes = NULL;
+    return -1;
+  }
+  char *sq = u->sq_ring;
+  u->sq_head = (unsigned*)(sq + p->sq_off.head);
+  u->sq_tail = (unsigned*)(sq + p->sq_off.tail);
+  u->sq_mask = *(unsigned*)(sq + p->sq_off.ring_mask);
+  u->sq_entries = *(unsigned*)(sq + p->sq_off.ring_entries);
+  u->sq_array = (unsigned*)(sq + p->sq_off.array);
+  u->tail = *u->sq_tail;
+  char *cq = u->cq_ring;
+  u->cq_head = (unsigned*)(cq + p->cq_off.head);
+  u->cq_tail = (unsigned*)(cq + p->cq_off.tail);
+  u->cq_mask = *(unsigned*)(cq + p->cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe*)(cq + p->cq_off.cqes);
+  return 0;
+}
+
+// return the number of submitted requests, or -1
+static int uring_submit(struct uring *u, unsigned complete, unsigned flags, void *arg, size_t argsz) {
+  ATOMIC_STORE_REL(u->sq_tail, u->tail);
+  unsigned submit = u->tail - ATOMIC_LOAD_ACQ(u->sq_head);
+  if (submit == 0 && complete == 0) {
+    return 0;
+  }
+  if (complete > 0) {
+    flags |= IORING_ENTER_GETEVENTS;
+  }
+  return sys_enter(u->fd, submit, complete, flags, arg, argsz);
+}
+
+// never NULL, queue is submitted if it's full
+static struct io_uring_sqe* uring_sqe(struct uring *u) {
+  while (u->tail - ATOMIC_LOAD_ACQ(u->sq_head) >= u->sq_entries) {
+    if (uring_submit(u, 0, 0, NULL, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      fprintf(stderr, "[uring]: submit failed: %s\n", strerror(errno));
+    }
+  }
+  unsigned idx = u->tail & u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[idx];
+  memset(sqe, 0, sizeof *sqe);
+  u->sq_array[idx] = idx;
+  u->tail++;
+  return sqe;
+}
+
+
+static void uring_poll_add(struct uring *u, struct uring_watch *w) {
+  struct io_uring_sqe *sqe = uring_sqe(u);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = w->fd;
+  sqe->poll32_events = w->events;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = (uintptr_t)w | TAG_POLL;
+  w->poll = true;
+}
+
+// poll mask is changed in place, it isn't ended by that, errors and hangups are always polled
+static void uring_poll_update(struct uring *u, struct uring_watch *w, unsigned events) {
+  if (w->events == events) {
+    return;
+  }
+  w->events = events;
+  if (!w->poll) {
+    // it's armed with the new mask
+    return;
+  }
+  struct io_uring_sqe *sqe = uring_sqe(u);
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = (uintptr_t)w | TAG_POLL;
+  sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;
+  sqe->poll32_events = events;
+  sqe->user_data = URING_IGNORE;
+}
+
+static void uring_recv_add(struct uring *u, struct uring_watch *w) {
+  struct io_uring_sqe *sqe = uring_sqe(u);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = w->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUF_GROUP;
+  sqe->user_data = (uintptr_t)w | TAG_RECV;
+  w->recv_armed = true;
+}
+
+static void uring_accept_add(struct uring *u, struct uring_watch *w) {
+  struct io_uring_sqe *sqe = uring_sqe(u);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = w->fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = (uintptr_t)w | TAG_ACCEPT;
+  w->accept_armed = true;
+}
+
+// submit queued requests now instead of next wait
+static void uring_flush(struct uring *u) {
+  while (uring_submit(u, 0, 0, NULL, 0) < 0) {
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      fprintf(stderr, "[uring]: submit failed: %s\n", strerror(errno));
+      break;
+    }
+  }
+}
+
+// cancel one request by its user_data, it's submitted at once, so that it stops before next wait
+static void uring_cancel(struct uring *u, uint64_t user_data) {
+  struct io_uring_sqe *sqe = uring_sqe(u);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = user_data;
+  sqe->user_data = URING_IGNORE;
+  uring_flush(u);
+}
+
+// cancel all requests of fd, it's submitted at once, since fd is looked up by kernel when it's submitted
+static void uring_cancel_fd(struct uring *u, int fd) {
+  struct io_uring_sqe *sqe = uring_sqe(u);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = fd;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data = URING_IGNORE;
+  uring_flush(u);
+}
+
+static struct uring_watch* watch_new(struct uring *u, int fd, void *ptr) {
+  struct uring_watch *w = leptonet_malloc(sizeof *w);
+  if (w == NULL) {
+    return NULL;
+  }
+  memset(w, 0, sizeof *w);
+  w->fd = fd;
+  w->events = WATCH_EVENTS;
+  w->ptr = ptr;
+  w->prev = NULL;
+  w->next = u->watches;
+  if (u->watches) {
+    u->watches->prev = w;
+  }
+  u->watches = w;
+  return w;
+}
+
+static void watch_free(struct uring *u, struct uring_watch *w) {
+  if (w->prev) {
+    w->prev->next = w->next;
+  } else {
+    u->watches = w->next;
+  }
+  if (w->next) {
+    w->next->prev = w->prev;
+  }
+  leptonet_free(w);
+}
+
+static inline bool watch_armed(struct uring_watch *w) {
+  return w->poll || w->recv_armed || w->accept_armed;
+}
+
+static inline struct uring_watch* watch_of(struct uring *u, int fd) {
+  if (fd < 0 || fd >= u->watch_cap) {
+    return NULL;
+  }
+  return u->watch[fd];
+}
+
+static inline void buf_put(struct uring *u, unsigned short bid) {
+  struct io_uring_buf *b = &u->br->bufs[u->br_tail & (BUF_COUNT - 1)];
+  b->addr = (uintptr_t)(u->bufs + (size_t)bid * BUF_SIZE);
+  b->len = BUF_SIZE;
+  b->bid = bid;
+  u->br_tail++;
+}
+
+// give lent buffers back to kernel
+static void buf_recycle(struct uring *u) {
+  if (u->nlent == 0) {
+    return;
+  }
+  for (int i = 0; i < u->nlent; i ++) {
+    buf_put(u, u->lent[i]);
+  }
+  u->nlent = 0;
+  ATOMIC_STORE_REL(&u->br->tail, u->br_tail);
+}
+
+// provided buffer ring is since 5.19, ring and buffers are allocated by us
+static int uring_buffers(struct uring *u) {
+  void *br = mmap(NULL, BUF_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (br == MAP_FAILED) {
+    return -1;
+  }
+  u->br = br;
+  void *bufs = mmap(NULL, (size_t)BUF_COUNT * BUF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (bufs == MAP_FAILED) {
+    return -1;
+  }
+  u->bufs = bufs;
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof reg);
+  reg.ring_addr = (uintptr_t)u->br;
+  reg.ring_entries = BUF_COUNT;
+  reg.bgid = BUF_GROUP;
+  if (sys_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    return -1;
+  }
+  for (int i = 0; i < BUF_COUNT; i ++) {
+    u->lent[u->nlent++] = i;
+  }
+  buf_recycle(u);
+  return 0;
+}
+
+// submit queued requests and wait for a completion, timeout in milliseconds, -1 blocks
+static int uring_enter(struct uring *u, int timeout) {
+  if (timeout == 0) {
+    return uring_submit(u, 0, 0, NULL, 0);
+  }
+  if (timeout < 0) {
+    return uring_submit(u, 1, 0, NULL, 0);
+  }
+  struct __kernel_timespec ts = {.tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000LL};
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof arg);
+  arg.sigmask_sz = _NSIG / 8;
+  arg.ts = (uintptr_t)&ts;
+  return uring_submit(u, 1, IORING_ENTER_EXT_ARG, &arg, sizeof arg);
+}
+
+// multishot poll is since 5.13, multishot recv with provided buffers and cancel by fd are since 6.0
+// older kernels reject them or never set IORING_CQE_F_MORE
+static bool uring_probe(struct uring *u) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    return false;
+  }
+  struct uring_watch *w = watch_new(u, sv[0], NULL);
+  if (w == NULL) {
+    close(sv[0]);
+    close(sv[1]);
+    return false;
+  }
+  // it's writable at once, and readable after a byte is written
+  uring_poll_add(u, w);
+  uring_recv_add(u, w);
+  bool poll = false, recv = false, polled = false, received = false, canceled = false;
+  if (write(sv[1], "", 1) == 1) {
+    // wait for the first completion of both, then for the last one of both after cancel
+    for (int i = 0; i < 16 && watch_armed(w); i ++) {
+      if (uring_enter(u, 100) < 0 && errno != ETIME && errno != EINTR) {
+        break;
+      }
+      unsigned head = *u->cq_head;
+      for (; head != ATOMIC_LOAD_ACQ(u->cq_tail); head++) {
+        struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+        if (cqe->user_data == URING_IGNORE) {
+          continue;
+        }
+        bool more = cqe->flags & IORING_CQE_F_MORE;
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+          u->lent[u->nlent++] = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        }
+        if ((cqe->user_data & TAG_MASK) == TAG_POLL) {
+          poll |= !polled && cqe->res >= 0 && more;
+          polled = true;
+          w->poll = w->poll && more;
+        } else {
+          recv |= !received && cqe->res == 1 && more && (cqe->flags & IORING_CQE_F_BUFFER);
+          received = true;
+          w->recv_armed = w->recv_armed && more;
+        }
+      }
+      ATOMIC_STORE_REL(u->cq_head, head);
+      if (polled && received && !canceled) {
+        uring_cancel_fd(u, sv[0]);
+        canceled = true;
+      }
+    }
+  }
+  bool done = !watch_armed(w);
+  // otherwise kernel may still complete them, ring is closed by caller anyway
+  watch_free(u, w);
+  close(sv[0]);
+  close(sv[1]);
+  return done && poll && recv;
+}
+
+struct uring* uring_create(unsigned entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof p);
+  // every watch may have completions of poll and recv in flight, besides sends
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = entries * 8;
+  int fd = sys_setup(entries, &p);
+  if (fd < 0) {
+    return NULL;
+  }
+  // waiting with timeout needs IORING_FEAT_EXT_ARG, completions mustn't be dropped on overflow
+  unsigned need = IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP;
+  if ((p.features & need) != need) {
+    close(fd);
+    return NULL;
+  }
+  struct uring *u = leptonet_malloc(sizeof *u);
+  if (u == NULL) {
+    close(fd);
+    return NULL;
+  }
+  memset(u, 0, sizeof *u);
+  u->fd = fd;
+  if (uring_map(u, &p) < 0 || uring_buffers(u) < 0 || !uring_probe(u)) {
+    close(fd);
+    uring_unmap(u);
+    leptonet_free(u);
+    return NULL;
+  }
+  return u;
+}
+
+void uring_release(struct uring *u) {
+  // closing ring cancels all requests, buffers are unmapped after it
+  close(u->fd);
+  uring_unmap(u);
+  while (u->watches) {
+    watch_free(u, u->watches);
+  }
+  leptonet_free(u->watch);
+  leptonet_free(u);
+}
+
+int uring_regist(struct uring *u, int fd, void *ptr) {
+  if (fd < 0) {
+    errno = EBADF;
+    return -1;
+  }
+  if (fd >= u->watch_cap) {
+    int cap = u->watch_cap ? u->watch_cap : 64;
+    while (cap <= fd) {
+      cap *= 2;
+    }
+    struct uring_watch **watch = leptonet_malloc(sizeof(*watch) * cap);
+    if (watch == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    memset(watch, 0, sizeof(*watch) * cap);
+    if (u->watch) {
+      memcpy(watch, u->watch, sizeof(*watch) * u->watch_cap);
+      leptonet_free(u->watch);
+    }
+    u->watch = watch;
+    u->watch_cap = cap;
+  }
+  if (u->watch[fd]) {
+    errno = EEXIST;
+    return -1;
+  }
+  struct uring_watch *w = watch_new(u, fd, ptr);
+  if (w == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  u->watch[fd] = w;
+  uring_poll_add(u, w);
+  return 0;
+}
+
+int uring_del(struct uring *u, int fd) {
+  struct uring_watch *w = watch_of(u, fd);
+  if (w == NULL) {
+    return 0;
+  }
+  u->watch[fd] = NULL;
+  w->dead = true;
+  w->recv = false;
+  // sends of fd are canceled too, a blocked one would keep fd open after close
+  uring_cancel_fd(u, fd);
+  if (!watch_armed(w)) {
+    watch_free(u, w);
+  }
+  return 1;
+}
+
+int uring_recv(struct uring *u, int fd, bool on) {
+  struct uring_watch *w = watch_of(u, fd);
+  if (w == NULL) {
+    errno = ENOENT;
+    return -1;
+  }
+  w->recv = on;
+  if (on) {
+    uring_poll_update(u, w, 0);
+    if (!w->recv_armed) {
+      uring_recv_add(u, w);
+      // data which is waiting in socket is reported by next wait
+      uring_flush(u);
+    }
+  } else if (w->recv_armed) {
+    uring_cancel(u, (uintptr_t)w | TAG_RECV);
+  }
+  return 0;
+}
+
+int uring_accept(struct uring *u, int fd) {
+  struct uring_watch *w = watch_of(u, fd);
+  if (w == NULL) {
+    errno = ENOENT;
+    return -1;
+  }
+  uring_poll_update(u, w, 0);
+  if (!w->accept_armed) {
+    uring_accept_add(u, w);
+  }
+  return 0;
+}
+
+void uring_sendmsg(struct uring *u, int fd, struct msghdr *msg, int flags, void *token) {
+  struct io_uring_sqe *sqe = uring_sqe(u);
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)msg;
+  sqe->len = 1;
+  sqe->msg_flags = flags;
+  sqe->user_data = (uintptr_t)token | TAG_SEND;
+}
+
+static inline struct event* event_new(struct event *evs, int *n, void *socket, int kind, int res, void *data) {
+  struct event *e = &evs[(*n)++];
+  e->socket = socket;
+  e->read = e->write = e->error = e->eof = false;
+  e->kind = kind;
+  e->res = res;
+  e->data = data;
+  return e;
+}
+
+// a request of w is ended by kernel, arm it again if it's still wanted
+// recv which is ended by eof or error, and accept which is ended by error, are left to user
+static void watch_ended(struct uring *u, struct uring_watch *w, int tag, int res) {
+  switch (tag) {
+    case TAG_POLL:
+      w->poll = false;
+      if (res >= 0) {
+        // e.g. completion queue is overflowed
+        uring_poll_add(u, w);
+      }
+      break;
+    case TAG_RECV:
+      w->recv_armed = false;
+      if (res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED)) {
+        // eof or error, it's reported
+        w->recv = false;
+      } else if (w->recv) {
+        // out of buffers, which are given back by next wait, or paused and resumed
+        uring_recv_add(u, w);
+      }
+      break;
+    case TAG_ACCEPT:
+      w->accept_armed = false;
+      if (res >= 0) {
+        uring_accept_add(u, w);
+      }
+      break;
+  }
+}
+
+// take completions into evs, return the number of events
+static int uring_reap(struct uring *u, struct event *evs, int maxevents) {
+  int n = 0;
+  unsigned head = *u->cq_head;
+  unsigned tail = ATOMIC_LOAD_ACQ(u->cq_tail);
+  for (; head != tail && n < maxevents; head++) {
+    struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+    if (cqe->user_data == URING_IGNORE) {
+      continue;
+    }
+    int tag = cqe->user_data & TAG_MASK;
+    void *p = (void*)(uintptr_t)(cqe->user_data & ~(uint64_t)TAG_MASK);
+    int res = cqe->res;
+    char *data = NULL;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+      unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      u->lent[u->nlent++] = bid;
+      data = u->bufs + (size_t)bid * BUF_SIZE;
+    }
+    if (tag == TAG_SEND) {
+      event_new(evs, &n, NULL, EVENT_SEND, res, p);
+      continue;
+    }
+    struct uring_watch *w = p;
+    if (w->dead && tag == TAG_ACCEPT && res >= 0) {
+      // accepted after removal
+      close(res);
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+      if (w->dead) {
+        switch (tag) {
+          case TAG_POLL: w->poll = false; break;
+          case TAG_RECV: w->recv_armed = false; break;
+          case TAG_ACCEPT: w->accept_armed = false; break;
+        }
+        if (!watch_armed(w)) {
+          watch_free(u, w);
+        }
+        continue;
+      }
+      watch_ended(u, w, tag, res);
+    }
+    if (w->dead || res == -ECANCELED || (tag == TAG_RECV && res == -ENOBUFS)) {
+      continue;
+    }
+    if (tag == TAG_RECV) {
+      event_new(evs, &n, w->ptr, EVENT_RECV, res, data);
+      continue;
+    }
+    if (tag == TAG_ACCEPT) {
+      event_new(evs, &n, w->ptr, EVENT_ACCEPT, res, NULL);
+      continue;
+    }
+    struct event *e = event_new(evs, &n, w->ptr, EVENT_READY, 0, NULL);
+    if (res < 0) {
+      // poll can't be armed, report it as an error of that fd
+      e->error = true;
+      continue;
+    }
+    e->read = (res & EPOLLIN);
+    e->write = (res & EPOLLOUT);
+    e->error = (res & EPOLLERR);
+    e->eof = (res & (EPOLLHUP | EPOLLRDHUP));
+  }
+  ATOMIC_STORE_REL(u->cq_head, head);
+  return n;
+}
+
+int uring_wait(struct uring *u, struct event *evs, int maxevents, int timeout) {
+  for (;;) {
+    // data of last events has been taken by caller, and nothing is reported if it loops
+    buf_recycle(u);
+    // submit queued requests only if there are completions already
+    int n = uring_enter(u, *u->cq_head != ATOMIC_LOAD_ACQ(u->cq_tail) ? 0 : timeout);
+    if (n < 0 && errno != ETIME && errno != EBUSY) {
+      return -1;
+    }
+    int cnt = uring_reap(u, evs, maxevents);
+    // all completions may be dropped, it never returns 0 without timeout like epoll_wait
+    if (cnt > 0 || timeout >= 0) {
+      return cnt;
+    }
+  }
+}
+
+#endif
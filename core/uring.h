@@ -0,0 +1,39 @@
+#ifndef __LEPTONET_URING_H__
+#define __LEPTONET_URING_H__
+
+#include <stdbool.h>
+#include <sys/socket.h>
+
+#include "epoll.h"
+
+// io_uring backend of socket server, built with LEPTONET_USE_IO_URING
+// each fd is watched by a multishot POLL_ADD, which is edge triggered like EPOLLET
+// a stream fd can be switched to completions: multishot recv into provided buffers, multishot accept, and sendmsg
+// requests are queued and submitted by the next uring_wait in one batch, in the same syscall as waiting
+struct uring;
+
+// NULL if kernel doesn't support it (before 6.0, or disabled), then use epoll
+struct uring* uring_create(unsigned entries);
+void uring_release(struct uring *u);
+
+// watch fd for read and write in one registration, 0 on success like epregist
+int uring_regist(struct uring *u, int fd, void *ptr);
+// stop watching fd and cancel all requests of it, including sends, it must be called before fd is closed
+// 1 on success like epdel
+int uring_del(struct uring *u, int fd);
+
+// a registered fd is read by multishot recv instead of being polled, only its errors are polled afterwards
+// data is reported as EVENT_RECV, it's in a provided buffer which is valid until next uring_wait
+// on is false to pause it, it's canceled at once, and data which is received before that is still reported
+// it's armed at once when it's resumed
+int uring_recv(struct uring *u, int fd, bool on);
+// a registered listen fd is accepted by multishot accept instead of being polled
+// accepted fd is reported as EVENT_ACCEPT, after an error it must be armed again
+int uring_accept(struct uring *u, int fd);
+// msg is owned by kernel until EVENT_SEND of token is reported, token must be 4 bytes aligned
+void uring_sendmsg(struct uring *u, int fd, struct msghdr *msg, int flags, void *token);
+
+// timeout in milliseconds, -1 blocks until any event
+int uring_wait(struct uring *u, struct event *evs, int maxevents, int timeout);
+
+#endif
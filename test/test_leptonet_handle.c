@@ -0,0 +1,154 @@
+#include <pthread.h>
+
+#include "framework.h"
+#include "../core/leptonet_handle.h"
+#include "../core/atomic.h"
+
+// contexts are opaque for handle module, any stable address works
+#define CTX(i) ((struct leptonet_context*)(uintptr_t)(((i) + 1) * 16))
+
+#define HANDLE_NUM 10000
+#define READER_NUM 4
+
+bool test_handle_basic() {
+  TEST_BEGIN;
+
+  leptonet_handle_init();
+
+  uint32_t h1 = leptonet_handle_register(CTX(1));
+  uint32_t h2 = leptonet_handle_register(CTX(2));
+  ASSERT_NE(0, h1);
+  ASSERT_NE(0, h2);
+  ASSERT_NE(h1, h2);
+  ASSERT_EQ(CTX(1), leptonet_handle_query(h1));
+  ASSERT_EQ(CTX(2), leptonet_handle_query(h2));
+  ASSERT_EQ(NULL, leptonet_handle_query(0));
+  ASSERT_EQ(NULL, leptonet_handle_query(h2 + 100));
+
+  ASSERT_EQ(1, leptonet_handle_retire(h1));
+  ASSERT_EQ(0, leptonet_handle_retire(h1));
+  ASSERT_EQ(NULL, leptonet_handle_query(h1));
+  ASSERT_EQ(CTX(2), leptonet_handle_query(h2));
+
+  // handles are not reused at once
+  uint32_t h3 = leptonet_handle_register(CTX(3));
+  ASSERT_NE(h1, h3);
+  ASSERT_EQ(CTX(3), leptonet_handle_query(h3));
+
+  leptonet_handle_release();
+
+  TEST_END;
+}
+
+bool test_handle_grow() {
+  TEST_BEGIN;
+
+  leptonet_handle_init();
+
+  static uint32_t handles[HANDLE_NUM];
+  for (int i = 0; i < HANDLE_NUM; i ++) {
+    handles[i] = leptonet_handle_register(CTX(i));
+  }
+  for (int i = 0; i < HANDLE_NUM; i ++) {
+    ASSERT_EQ(CTX(i), leptonet_handle_query(handles[i]));
+  }
+  for (int i = 0; i < HANDLE_NUM; i += 2) {
+    ASSERT_EQ(1, leptonet_handle_retire(handles[i]));
+  }
+  for (int i = 0; i < HANDLE_NUM; i ++) {
+    struct leptonet_context *ctx = i % 2 ? CTX(i) : NULL;
+    ASSERT_EQ(ctx, leptonet_handle_query(handles[i]));
+  }
+
+  leptonet_handle_release();
+
+  TEST_END;
+}
+
+bool test_handle_name() {
+  TEST_BEGIN;
+
+  leptonet_handle_init();
+
+  uint32_t h1 = leptonet_handle_register(CTX(1));
+  uint32_t h2 = leptonet_handle_register(CTX(2));
+  ASSERT_EQ(0, leptonet_handle_findname("logger"));
+  ASSERT_NE(NULL, leptonet_handle_namehandle(h1, "logger"));
+  ASSERT_EQ(NULL, leptonet_handle_namehandle(h2, "logger"));
+  ASSERT_NE(NULL, leptonet_handle_namehandle(h1, "console"));
+  ASSERT_EQ(h1, leptonet_handle_findname("logger"));
+  ASSERT_EQ(h1, leptonet_handle_findname("console"));
+
+  // many names grow the index
+  char name[32];
+  for (int i = 0; i < 100; i ++) {
+    snprintf(name, sizeof(name), "service%d", i);
+    ASSERT_NE(NULL, leptonet_handle_namehandle(h2, name));
+  }
+  for (int i = 0; i < 100; i ++) {
+    snprintf(name, sizeof(name), "service%d", i);
+    ASSERT_EQ(h2, leptonet_handle_findname(name));
+  }
+
+  // names go away with handle, and can be used again
+  leptonet_handle_retire(h1);
+  ASSERT_EQ(0, leptonet_handle_findname("logger"));
+  ASSERT_EQ(0, leptonet_handle_findname("console"));
+  ASSERT_NE(NULL, leptonet_handle_namehandle(h2, "logger"));
+  ASSERT_EQ(h2, leptonet_handle_findname("logger"));
+
+  leptonet_handle_release();
+
+  TEST_END;
+}
+
+struct reader_arg {
+  uint32_t handle;
+  ATOMIC_INT *quit;
+  int error;
+};
+
+static void* reader(void *ud) {
+  struct reader_arg *arg = ud;
+  while (!ATOMIC_LOAD(arg->quit)) {
+    if (leptonet_handle_query(arg->handle) != CTX(0)) {
+      arg->error++;
+    }
+  }
+  return NULL;
+}
+
+// readers must always see a registered handle while table grows
+bool test_handle_concurrent() {
+  TEST_BEGIN;
+
+  leptonet_handle_init();
+
+  ATOMIC_INT quit = 0;
+  uint32_t h = leptonet_handle_register(CTX(0));
+  pthread_t pid[READER_NUM];
+  struct reader_arg args[READER_NUM];
+  for (int i = 0; i < READER_NUM; i ++) {
+    args[i].handle = h;
+    args[i].quit = &quit;
+    args[i].error = 0;
+    pthread_create(&pid[i], NULL, reader, &args[i]);
+  }
+  for (int i = 1; i < HANDLE_NUM; i ++) {
+    leptonet_handle_register(CTX(i));
+  }
+  ATOMIC_STORE(&quit, 1);
+  for (int i = 0; i < READER_NUM; i ++) {
+    pthread_join(pid[i], NULL);
+    ASSERT_EQ(0, args[i].error);
+  }
+
+  leptonet_handle_release();
+
+  TEST_END;
+}
+
+TEST_REGIST(handletest, basic, test_handle_basic);
+TEST_REGIST(handletest, grow, test_handle_grow);
+TEST_REGIST(handletest, name, test_handle_name);
+TEST_REGIST(handletest, concurrent, test_handle_concurrent);
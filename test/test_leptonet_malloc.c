@@ -167,8 +167,202 @@ bool test_multithread() {
   TEST_END;
 }
 
+// handles which used to share a hash slot are counted separately
+bool test_handle_collision() {
+  TEST_BEGIN;
+
+  const int limit = 1000;
+  void *ptrs[limit];
+  for (int i = 0; i < limit; i ++) {
+    ptrs[i] = dleptonet_malloc(1 + (i % 4) * 0x10000, 96);
+  }
+  for (int i = 0; i < 4; i ++) {
+    ASSERT_EQ((size_t)(limit / 4 * 96), leptonet_memory_usage_handle(1 + i * 0x10000));
+  }
+  for (int i = 0; i < limit; i ++) {
+    dleptonet_free(ptrs[i]);
+  }
+  for (int i = 0; i < 4; i ++) {
+    ASSERT_EQ(0, leptonet_memory_usage_handle(1 + i * 0x10000));
+  }
+
+  TEST_END;
+}
+
+#define CROSS_NUM 10000
+static void *cross_ptrs[CROSS_NUM];
+
+void* thread_free(void* arg) {
+  (void)arg;
+  for (int i = 0; i < CROSS_NUM; i ++) {
+    dleptonet_free(cross_ptrs[i]);
+  }
+  return NULL;
+}
+
+// memory allocated on one thread and freed on another is still exact, also after thread exit
+bool test_cross_thread() {
+  TEST_BEGIN;
+
+  uint64_t usage = leptonet_memory_usage();
+  uint64_t blocks = leptonet_memory_blocks();
+  for (int i = 0; i < CROSS_NUM; i ++) {
+    cross_ptrs[i] = dleptonet_malloc(7 + i % 3, 64 + i % 256);
+  }
+  ASSERT_EQ(blocks + CROSS_NUM, leptonet_memory_blocks());
+  ASSERT_NE(0, leptonet_memory_usage_handle(7));
+  pthread_t pid;
+  pthread_create(&pid, NULL, thread_free, NULL);
+  pthread_join(pid, NULL);
+  for (int i = 0; i < 3; i ++) {
+    ASSERT_EQ(0, leptonet_memory_usage_handle(7 + i));
+  }
+  ASSERT_EQ(usage, leptonet_memory_usage());
+  ASSERT_EQ(blocks, leptonet_memory_blocks());
+
+  TEST_END;
+}
+
+struct limit_event {
+  int soft;
+  int hard;
+  uint32_t handle;
+};
+
+static void limit_cb(void *ud, uint32_t handle, size_t usage, int hard) {
+  (void)usage;
+  struct limit_event *ev = ud;
+  ev->handle = handle;
+  if (hard) {
+    ev->hard++;
+  } else {
+    ev->soft++;
+  }
+  // allocation in callback is not reported again
+  dleptonet_free(dleptonet_malloc(handle, 1024 * 1024));
+}
+
+bool test_limit() {
+  TEST_BEGIN;
+
+  struct limit_event ev = {0, 0, 0};
+  const uint32_t handle = 100;
+  const int limit = 100;
+  void *ptrs[limit];
+  leptonet_memory_limit_callback(limit_cb, &ev);
+  leptonet_memory_limit(handle, 10 * 1024, 20 * 1024);
+
+  // soft limit fires once
+  for (int i = 0; i < 15; i ++) {
+    ptrs[i] = dleptonet_malloc(handle, 1024);
+    ASSERT_NE(NULL, ptrs[i]);
+  }
+  ASSERT_EQ(1, ev.soft);
+  ASSERT_EQ(0, ev.hard);
+  ASSERT_EQ(handle, ev.handle);
+
+  // hard limit rejects, and rejected allocation is not counted
+  int n = 15;
+  while (n < limit && (ptrs[n] = dleptonet_malloc(handle, 1024)) != NULL) {
+    n++;
+  }
+  ASSERT_EQ(20, n);
+  ASSERT_EQ(1, ev.hard);
+  ASSERT_EQ(20 * 1024, leptonet_memory_usage_handle(handle));
+  ASSERT_EQ(NULL, dleptonet_malloc(handle, 1));
+  ASSERT_EQ(2, ev.hard);
+  ASSERT_EQ(1, ev.soft);
+
+  // other handles are not affected
+  void *other = dleptonet_malloc(handle + 1, 64 * 1024);
+  ASSERT_NE(NULL, other);
+  dleptonet_free(other);
+
+  // room is given back by free
+  dleptonet_free(ptrs[--n]);
+  ptrs[n] = dleptonet_malloc(handle, 1024);
+  ASSERT_NE(NULL, ptrs[n++]);
+
+  // disable limits
+  leptonet_memory_limit(handle, 0, 0);
+  ptrs[n] = dleptonet_malloc(handle, 1024);
+  ASSERT_NE(NULL, ptrs[n++]);
+  ASSERT_EQ(1, ev.soft);
+  ASSERT_EQ(2, ev.hard);
+
+  for (int i = 0; i < n; i ++) {
+    dleptonet_free(ptrs[i]);
+  }
+  ASSERT_EQ(0, leptonet_memory_usage_handle(handle));
+  leptonet_memory_limit_callback(NULL, NULL);
+
+  TEST_END;
+}
+
+static void* __attribute__((noinline)) profile_alloc_site(uint32_t handle, size_t sz) {
+  return dleptonet_malloc(handle, sz);
+}
+
+// read whole dump into buf
+static int profile_read(int format, char *buf, int sz, int *samples) {
+  FILE *f = tmpfile();
+  *samples = leptonet_memory_profile_dump(f, format);
+  rewind(f);
+  int n = fread(buf, 1, sz - 1, f);
+  buf[n] = '\0';
+  fclose(f);
+  return n;
+}
+
+bool test_profile() {
+  TEST_BEGIN;
+
+  const int limit = 100;
+  const uint32_t handle = 42;
+  void *ptrs[limit];
+  static char buf[1024 * 1024];
+  int samples = 0;
+
+  // off by default
+  ptrs[0] = profile_alloc_site(handle, 256);
+  profile_read(LEPTONET_PROFILE_FOLDED, buf, sizeof buf, &samples);
+  ASSERT_EQ(0, samples);
+  dleptonet_free(ptrs[0]);
+
+  // rate 1 samples every allocation
+  leptonet_memory_profile_rate(1);
+  for (int i = 0; i < limit; i ++) {
+    ptrs[i] = profile_alloc_site(handle, 256);
+  }
+  profile_read(LEPTONET_PROFILE_FOLDED, buf, sizeof buf, &samples);
+  ASSERT_EQ(limit, samples);
+  // same stack is merged into one line
+  ASSERT_NE(NULL, strstr(buf, "handle_0000002a;"));
+  ASSERT_NE(NULL, strstr(buf, " 25600\n"));
+
+  profile_read(LEPTONET_PROFILE_PPROF, buf, sizeof buf, &samples);
+  ASSERT_EQ(limit, samples);
+  ASSERT_EQ(0, strncmp(buf, "heap profile:", 13));
+  ASSERT_NE(NULL, strstr(buf, "@ heap_v2/1\n"));
+  ASSERT_NE(NULL, strstr(buf, "MAPPED_LIBRARIES:"));
+
+  // freed samples are gone
+  for (int i = 0; i < limit; i ++) {
+    dleptonet_free(ptrs[i]);
+  }
+  profile_read(LEPTONET_PROFILE_FOLDED, buf, sizeof buf, &samples);
+  ASSERT_EQ(0, samples);
+  leptonet_memory_profile_rate(0);
+
+  TEST_END;
+}
+
 TEST_REGIST(test_leptonet_malloc, basic, test_basic);
 TEST_REGIST(test_leptonet_malloc, basic_loop, test_basic_loop);
 TEST_REGIST(test_leptonet_malloc, sequence_order, test_sequence_order);
 TEST_REGIST(test_leptonet_malloc, random_order, test_random_order);
 TEST_REGIST(test_leptonet_malloc, multithread, test_multithread);
+TEST_REGIST(test_leptonet_malloc, handle_collision, test_handle_collision);
+TEST_REGIST(test_leptonet_malloc, cross_thread, test_cross_thread);
+TEST_REGIST(test_leptonet_malloc, limit, test_limit);
+TEST_REGIST(test_leptonet_malloc, profile, test_profile);
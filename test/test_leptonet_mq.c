@@ -1,5 +1,12 @@
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/time.h>
+
 #include "framework.h"
 #include "../core/leptonet_mq.h"
+#include "../core/leptonet_server.h"
+#include "../core/malloc_hook.h"
 
 bool test_mq_basic() {
   TEST_BEGIN;
@@ -10,4 +17,427 @@ bool test_mq_basic() {
   TEST_END;
 }
 
+bool test_mq_push_pop() {
+  TEST_BEGIN;
+
+  leptonet_global_message_queue_init();
+
+  const int limit = 10000;
+  struct message_queue *mq = leptonet_mq_create(1);
+  for (int i = 0; i < limit; i ++) {
+    struct leptonet_message msg = {.type = 0, .sission = i, .data = NULL, .sz = 0};
+    leptonet_mq_push(mq, &msg);
+  }
+  ASSERT_EQ(limit, leptonet_mq_length(mq));
+
+  // mq is scheduled only once
+  struct message_queue *q = NULL;
+  ASSERT_EQ(1, leptonet_globalmq_pop(&q));
+  ASSERT_EQ(mq, q);
+  ASSERT_EQ(0, leptonet_globalmq_pop(&q));
+
+  struct leptonet_message msg;
+  for (int i = 0; i < limit; i ++) {
+    ASSERT_EQ(1, leptonet_mq_pop(mq, &msg));
+    ASSERT_EQ((uint32_t)i, msg.sission);
+  }
+  ASSERT_EQ(0, leptonet_mq_pop(mq, &msg));
+  ASSERT_EQ(0, leptonet_mq_length(mq));
+
+  // an idle mq should be scheduled again by next push
+  leptonet_mq_push(mq, &msg);
+  ASSERT_EQ(1, leptonet_globalmq_pop(&q));
+  ASSERT_EQ(mq, q);
+  ASSERT_EQ(1, leptonet_mq_pop(mq, &msg));
+  ASSERT_EQ(0, leptonet_mq_pop(mq, &msg));
+
+  leptonet_mq_release(mq, NULL, NULL);
+  leptonet_global_message_queue_release();
+
+  TEST_END;
+}
+
+bool test_mq_batch() {
+  TEST_BEGIN;
+
+  leptonet_global_message_queue_init();
+
+  const int limit = 1000;
+  struct message_queue *mq = leptonet_mq_create(1);
+  struct leptonet_message msgs[limit];
+  for (int i = 0; i < limit; i ++) {
+    msgs[i].type = 0;
+    msgs[i].sission = i;
+    msgs[i].data = NULL;
+    msgs[i].sz = 0;
+  }
+  leptonet_mq_push_batch(mq, msgs, limit / 2);
+  leptonet_mq_push_batch(mq, msgs + limit / 2, limit / 2);
+  ASSERT_EQ(limit, leptonet_mq_length(mq));
+
+  struct message_queue *q = NULL;
+  ASSERT_EQ(1, leptonet_globalmq_pop(&q));
+  ASSERT_EQ(mq, q);
+
+  struct leptonet_message out[64];
+  int total = 0;
+  int n;
+  while ((n = leptonet_mq_pop_batch(mq, out, 64)) > 0) {
+    for (int i = 0; i < n; i ++) {
+      ASSERT_EQ((uint32_t)total, out[i].sission);
+      total++;
+    }
+  }
+  ASSERT_EQ(limit, total);
+  ASSERT_EQ(0, leptonet_mq_length(mq));
+  ASSERT_EQ(0, leptonet_globalmq_pop(&q));
+
+  leptonet_mq_release(mq, NULL, NULL);
+  leptonet_global_message_queue_release();
+
+  TEST_END;
+}
+
+bool test_mq_overload() {
+  TEST_BEGIN;
+
+  leptonet_global_message_queue_init();
+
+  struct message_queue *mq = leptonet_mq_create(7);
+  leptonet_mq_watermark(mq, 8, 2);
+  struct leptonet_message msg = {.type = 0, .sission = 0, .data = NULL, .sz = 0};
+  for (int i = 0; i < 7; i ++) {
+    ASSERT_EQ(0, leptonet_mq_trypush(mq, &msg));
+  }
+  ASSERT_EQ(0, leptonet_mq_overload(mq));
+  leptonet_mq_push(mq, &msg);
+  ASSERT_EQ(1, leptonet_mq_overload(mq));
+  // senders are pushed back until mq drops to low watermark
+  ASSERT_EQ(-1, leptonet_mq_trypush(mq, &msg));
+  ASSERT_EQ(8, leptonet_mq_length(mq));
+
+  struct message_queue *q = NULL;
+  ASSERT_EQ(1, leptonet_globalmq_pop(&q));
+  struct leptonet_mq_overload ev;
+  ASSERT_EQ(1, leptonet_mq_overload_event(mq, &ev));
+  ASSERT_EQ(7, ev.handle);
+  ASSERT_EQ(8, ev.length);
+  ASSERT_EQ(true, ev.overload);
+  ASSERT_EQ(0, leptonet_mq_overload_event(mq, &ev));
+
+  // hysteresis, still overloaded between two watermarks
+  for (int i = 0; i < 5; i ++) {
+    ASSERT_EQ(1, leptonet_mq_pop(mq, &msg));
+  }
+  ASSERT_EQ(1, leptonet_mq_overload(mq));
+  ASSERT_EQ(0, leptonet_mq_overload_event(mq, &ev));
+  ASSERT_EQ(1, leptonet_mq_pop(mq, &msg));
+  ASSERT_EQ(0, leptonet_mq_overload(mq));
+  ASSERT_EQ(1, leptonet_mq_overload_event(mq, &ev));
+  ASSERT_EQ(2, ev.length);
+  ASSERT_EQ(false, ev.overload);
+  ASSERT_EQ(0, leptonet_mq_trypush(mq, &msg));
+
+  while (leptonet_mq_pop(mq, &msg)) {}
+  leptonet_mq_release(mq, NULL, NULL);
+  leptonet_global_message_queue_release();
+
+  TEST_END;
+}
+
+bool test_mq_hard_limit() {
+  TEST_BEGIN;
+
+  leptonet_global_message_queue_init();
+
+  const uint32_t handle = 200;
+  struct message_queue *mq = leptonet_mq_create(1);
+  leptonet_memory_limit(handle, 0, 64 * 1024);
+  // sender has used up its quota, nodes are charged to it
+  void *quota = dleptonet_malloc(handle, 64 * 1024);
+  ASSERT_NE(NULL, quota);
+  struct leptonet_message msgs[4];
+  memset(msgs, 0, sizeof msgs);
+  leptonet_context_set_current_handle(handle);
+  ASSERT_EQ(-1, leptonet_mq_push(mq, &msgs[0]));
+  ASSERT_EQ(-1, leptonet_mq_trypush(mq, &msgs[0]));
+  ASSERT_EQ(-1, leptonet_mq_push_batch(mq, msgs, 4));
+  leptonet_context_set_current_handle(0);
+  // nothing is queued or scheduled
+  ASSERT_EQ(0, leptonet_mq_length(mq));
+  struct message_queue *q = NULL;
+  ASSERT_EQ(0, leptonet_globalmq_pop(&q));
+
+  dleptonet_free(quota);
+  leptonet_context_set_current_handle(handle);
+  ASSERT_EQ(0, leptonet_mq_push(mq, &msgs[0]));
+  ASSERT_EQ(0, leptonet_mq_push_batch(mq, msgs, 4));
+  leptonet_context_set_current_handle(0);
+  ASSERT_EQ(5, leptonet_mq_length(mq));
+  ASSERT_EQ(1, leptonet_globalmq_pop(&q));
+  ASSERT_EQ(mq, q);
+  struct leptonet_message msg;
+  while (leptonet_mq_pop(mq, &msg)) {}
+  leptonet_memory_limit(handle, 0, 0);
+  leptonet_mq_release(mq, NULL, NULL);
+  leptonet_global_message_queue_release();
+
+  TEST_END;
+}
+
+#define PRODUCER_NUM 4
+#define PRODUCER_LOOP 100000
+
+struct producer_arg {
+  struct message_queue *mq;
+  uint32_t id;
+};
+
+static void* producer_func(void *arg) {
+  struct producer_arg *p = arg;
+  for (int i = 0; i < PRODUCER_LOOP; i ++) {
+    struct leptonet_message msg = {.type = p->id, .sission = i, .data = NULL, .sz = 0};
+    leptonet_mq_push(p->mq, &msg);
+  }
+  return NULL;
+}
+
+bool test_mq_multi_producer() {
+  TEST_BEGIN;
+
+  leptonet_global_message_queue_init();
+
+  struct message_queue *mq = leptonet_mq_create(1);
+  pthread_t threads[PRODUCER_NUM];
+  struct producer_arg args[PRODUCER_NUM];
+  for (int i = 0; i < PRODUCER_NUM; i ++) {
+    args[i].mq = mq;
+    args[i].id = i;
+    pthread_create(&threads[i], NULL, producer_func, &args[i]);
+  }
+
+  // messages from the same producer should keep their order
+  uint32_t expected[PRODUCER_NUM] = {0};
+  int total = 0;
+  while (total < PRODUCER_NUM * PRODUCER_LOOP) {
+    struct message_queue *q;
+    if (!leptonet_globalmq_pop(&q)) {
+      continue;
+    }
+    ASSERT_EQ(mq, q);
+    struct leptonet_message msg;
+    while (leptonet_mq_pop(q, &msg)) {
+      ASSERT_EQ(expected[msg.type], msg.sission);
+      expected[msg.type]++;
+      total++;
+    }
+  }
+
+  for (int i = 0; i < PRODUCER_NUM; i ++) {
+    pthread_join(threads[i], NULL);
+    ASSERT_EQ(PRODUCER_LOOP, expected[i]);
+  }
+  struct message_queue *q;
+  ASSERT_EQ(0, leptonet_globalmq_pop(&q));
+
+  leptonet_mq_release(mq, NULL, NULL);
+  leptonet_global_message_queue_release();
+
+  TEST_END;
+}
+
+#define GLOBAL_MQ_NUM 64
+#define GLOBAL_WORKER_NUM 4
+#define GLOBAL_WORKER_LOOP 100000
+
+static void* global_worker_func(void *arg) {
+  int *seen = arg;
+  int loop = 0;
+  while (loop < GLOBAL_WORKER_LOOP) {
+    struct message_queue *mq;
+    if (!leptonet_globalmq_pop(&mq)) {
+      continue;
+    }
+    seen[leptonet_mq_handle(mq)]++;
+    leptonet_globalmq_push(mq);
+    loop++;
+  }
+  return NULL;
+}
+
+bool test_globalmq_multi_consumer() {
+  TEST_BEGIN;
+
+  leptonet_global_message_queue_init();
+
+  struct message_queue *mqs[GLOBAL_MQ_NUM];
+  for (int i = 0; i < GLOBAL_MQ_NUM; i ++) {
+    mqs[i] = leptonet_mq_create(i);
+    leptonet_globalmq_push(mqs[i]);
+  }
+
+  pthread_t threads[GLOBAL_WORKER_NUM];
+  static int seen[GLOBAL_WORKER_NUM][GLOBAL_MQ_NUM];
+  memset(seen, 0, sizeof seen);
+  for (int i = 0; i < GLOBAL_WORKER_NUM; i ++) {
+    pthread_create(&threads[i], NULL, global_worker_func, seen[i]);
+  }
+  for (int i = 0; i < GLOBAL_WORKER_NUM; i ++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  // every mq is still in global mq exactly once
+  int found[GLOBAL_MQ_NUM] = {0};
+  struct message_queue *mq;
+  int cnt = 0;
+  while (leptonet_globalmq_pop(&mq)) {
+    found[leptonet_mq_handle(mq)]++;
+    cnt++;
+  }
+  ASSERT_EQ(GLOBAL_MQ_NUM, cnt);
+  ASSERT_EQ(1, leptonet_globalmq_empty());
+  int total = 0;
+  for (int i = 0; i < GLOBAL_MQ_NUM; i ++) {
+    ASSERT_EQ(1, found[i]);
+    for (int j = 0; j < GLOBAL_WORKER_NUM; j ++) {
+      total += seen[j][i];
+    }
+    leptonet_mq_release(mqs[i], NULL, NULL);
+  }
+  ASSERT_EQ(GLOBAL_WORKER_NUM * GLOBAL_WORKER_LOOP, total);
+
+  leptonet_global_message_queue_release();
+
+  TEST_END;
+}
+
+#define CONTENDED_WORKER_NUM 8
+#define CONTENDED_LOOP 100000
+
+// each worker holds at most one mq, so global mq is never empty
+static void* contended_worker_func(void *arg) {
+  int *empty = arg;
+  for (int i = 0; i < CONTENDED_LOOP; i ++) {
+    struct message_queue *mq;
+    if (!leptonet_globalmq_pop(&mq)) {
+      (*empty)++;
+      continue;
+    }
+    leptonet_globalmq_push(mq);
+  }
+  return NULL;
+}
+
+bool test_globalmq_contended() {
+  TEST_BEGIN;
+
+  leptonet_global_message_queue_init();
+
+  struct message_queue *mqs[GLOBAL_MQ_NUM];
+  for (int i = 0; i < GLOBAL_MQ_NUM; i ++) {
+    mqs[i] = leptonet_mq_create(i);
+    leptonet_globalmq_push(mqs[i]);
+  }
+  pthread_t threads[CONTENDED_WORKER_NUM];
+  static int empty[CONTENDED_WORKER_NUM];
+  memset(empty, 0, sizeof empty);
+  for (int i = 0; i < CONTENDED_WORKER_NUM; i ++) {
+    pthread_create(&threads[i], NULL, contended_worker_func, &empty[i]);
+  }
+  for (int i = 0; i < CONTENDED_WORKER_NUM; i ++) {
+    pthread_join(threads[i], NULL);
+    // pop doesn't fail because another worker is popping or pushing
+    ASSERT_EQ(0, empty[i]);
+  }
+  struct message_queue *mq;
+  int cnt = 0;
+  while (leptonet_globalmq_pop(&mq)) {
+    cnt++;
+  }
+  ASSERT_EQ(GLOBAL_MQ_NUM, cnt);
+  for (int i = 0; i < GLOBAL_MQ_NUM; i ++) {
+    leptonet_mq_release(mqs[i], NULL, NULL);
+  }
+  leptonet_global_message_queue_release();
+
+  TEST_END;
+}
+
+#define RELINK_PUSHES 5000
+
+// push is lock-free, so a signal handler can push while this thread is in the middle of a pop
+static struct message_queue *relink_pushed;
+static volatile sig_atomic_t relink_armed;
+
+static void relink_handler(int sig) {
+  (void)sig;
+  if (relink_armed) {
+    relink_armed = 0;
+    leptonet_globalmq_push(relink_pushed);
+  }
+}
+
+bool test_globalmq_relink() {
+  TEST_BEGIN;
+
+  leptonet_global_message_queue_init();
+
+  struct message_queue *last = leptonet_mq_create(1);
+  relink_pushed = leptonet_mq_create(2);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = relink_handler;
+  sigaction(SIGALRM, &sa, NULL);
+  struct itimerval tv = {.it_interval = {.tv_usec = 20}, .it_value = {.tv_usec = 20}};
+  setitimer(ITIMER_REAL, &tv, NULL);
+  sigset_t alrm;
+  sigemptyset(&alrm);
+  sigaddset(&alrm, SIGALRM);
+
+  // pop takes the last mq, and some pushes land while it puts stub back after it
+  int pushes = 0, empty = 0, wrong = 0;
+  while (pushes < RELINK_PUSHES) {
+    leptonet_globalmq_push(last);
+    relink_armed = 1;
+    struct message_queue *mq = NULL;
+    if (!leptonet_globalmq_pop(&mq) || mq != last) {
+      wrong++;
+    }
+    sigprocmask(SIG_BLOCK, &alrm, NULL);
+    if (relink_armed) {
+      relink_armed = 0;
+    } else {
+      pushes++;
+      // pushed one is still queued
+      empty += leptonet_globalmq_empty();
+      if (!leptonet_globalmq_pop(&mq) || mq != relink_pushed) {
+        wrong++;
+      }
+    }
+    sigprocmask(SIG_UNBLOCK, &alrm, NULL);
+  }
+  struct itimerval off;
+  memset(&off, 0, sizeof off);
+  setitimer(ITIMER_REAL, &off, NULL);
+  sa.sa_handler = SIG_DFL;
+  sigaction(SIGALRM, &sa, NULL);
+
+  ASSERT_EQ(0, wrong);
+  ASSERT_EQ(0, empty);
+  ASSERT_EQ(1, leptonet_globalmq_empty());
+  leptonet_mq_release(last, NULL, NULL);
+  leptonet_mq_release(relink_pushed, NULL, NULL);
+  leptonet_global_message_queue_release();
+
+  TEST_END;
+}
+
 TEST_REGIST(mqtest, basic, test_mq_basic);
+TEST_REGIST(mqtest, push_pop, test_mq_push_pop);
+TEST_REGIST(mqtest, batch, test_mq_batch);
+TEST_REGIST(mqtest, overload, test_mq_overload);
+TEST_REGIST(mqtest, hard_limit, test_mq_hard_limit);
+TEST_REGIST(mqtest, multi_producer, test_mq_multi_producer);
+TEST_REGIST(mqtest, globalmq_multi_consumer, test_globalmq_multi_consumer);
+TEST_REGIST(mqtest, globalmq_contended, test_globalmq_contended);
+TEST_REGIST(mqtest, globalmq_relink, test_globalmq_relink);
@@ -0,0 +1,190 @@
+#include <unistd.h>
+
+#include "framework.h"
+#include "../core/leptonet_mq.h"
+#include "../core/leptonet_scheduler.h"
+#include "../core/atomic.h"
+
+#define SERVICE_NUM 64
+#define MESSAGE_NUM 1000
+#define FORWARD_HOPS 4
+
+struct service {
+  struct message_queue *mq[SERVICE_NUM];
+  uint32_t expected[SERVICE_NUM];   // next sission from main thread
+  ATOMIC_INT dispatched;
+  bool ordered;
+};
+
+// message with sz > 0 is forwarded to the next service, it simulates service to service sending
+static void dispatch(void *ud, uint32_t handle, struct leptonet_message *msg) {
+  struct service *S = ud;
+  if (msg->type == 0) {
+    // a mailbox is owned by one worker at a time, so messages from one producer keep order
+    if (msg->sission != S->expected[handle]) {
+      S->ordered = false;
+    }
+    S->expected[handle]++;
+  }
+  if (msg->sz > 0) {
+    struct leptonet_message fwd = {.type = 1, .sission = msg->sission, .data = NULL, .sz = msg->sz - 1};
+    leptonet_mq_push(S->mq[(handle + 1) % SERVICE_NUM], &fwd);
+  }
+  ATOMIC_INC(&S->dispatched);
+}
+
+static void dispatch_batch(void *ud, uint32_t handle, struct leptonet_message *msgs, int n) {
+  for (int i = 0; i < n; i ++) {
+    dispatch(ud, handle, &msgs[i]);
+  }
+}
+
+static bool run_scheduler(int thread, const int *weight, bool batch) {
+  leptonet_global_message_queue_init();
+
+  static struct service S;
+  memset(&S, 0, sizeof S);
+  S.ordered = true;
+  for (int i = 0; i < SERVICE_NUM; i ++) {
+    S.mq[i] = leptonet_mq_create(i);
+    // the flood is intended
+    leptonet_mq_watermark(S.mq[i], 0, 0);
+  }
+
+  struct leptonet_scheduler_config config = {
+    .thread = thread,
+    .weight = weight,
+    .dispatch = batch ? NULL : dispatch,
+    .dispatch_batch = batch ? dispatch_batch : NULL,
+    .ud = &S,
+  };
+  struct leptonet_scheduler *s = leptonet_scheduler_create(&config);
+  leptonet_scheduler_start(s);
+
+  for (int i = 0; i < MESSAGE_NUM; i ++) {
+    for (int j = 0; j < SERVICE_NUM; j ++) {
+      struct leptonet_message msg = {.type = 0, .sission = i, .data = NULL, .sz = FORWARD_HOPS};
+      leptonet_mq_push(S.mq[j], &msg);
+    }
+    leptonet_scheduler_wakeup(s, 0);
+  }
+
+  const int total = SERVICE_NUM * MESSAGE_NUM * (FORWARD_HOPS + 1);
+  while (ATOMIC_LOAD(&S.dispatched) < total) {
+    usleep(1000);
+  }
+  leptonet_scheduler_stop(s);
+  leptonet_scheduler_release(s);
+
+  ASSERT_EQ(total, S.dispatched);
+  ASSERT_EQ(true, S.ordered);
+  for (int i = 0; i < SERVICE_NUM; i ++) {
+    ASSERT_EQ(MESSAGE_NUM, S.expected[i]);
+    ASSERT_EQ(0, leptonet_mq_length(S.mq[i]));
+    leptonet_mq_release(S.mq[i], NULL, NULL);
+  }
+  leptonet_global_message_queue_release();
+  return true;
+}
+
+bool test_scheduler_single() {
+  TEST_BEGIN;
+
+  run_scheduler(1, NULL, false);
+
+  TEST_END;
+}
+
+bool test_scheduler_default_weight() {
+  TEST_BEGIN;
+
+  run_scheduler(8, NULL, false);
+
+  TEST_END;
+}
+
+bool test_scheduler_custom_weight() {
+  TEST_BEGIN;
+
+  const int weight[] = {-1, 0, 1, 2};
+  run_scheduler(4, weight, false);
+
+  TEST_END;
+}
+
+bool test_scheduler_batch() {
+  TEST_BEGIN;
+
+  run_scheduler(4, NULL, true);
+
+  TEST_END;
+}
+
+#define SLOW_THREAD 4
+#define SLOW_MESSAGE 50
+
+struct slow_service {
+  ATOMIC_INT running;
+  ATOMIC_INT most;
+  ATOMIC_INT dispatched;
+};
+
+// each message takes a while, so one worker can't keep up with all mailboxes
+static void slow_dispatch(void *ud, uint32_t handle, struct leptonet_message *msg) {
+  (void)handle;
+  (void)msg;
+  struct slow_service *S = ud;
+  int running = ATOMIC_INC(&S->running);
+  int most;
+  while ((most = ATOMIC_LOAD(&S->most)) < running && !ATOMIC_CAS(&S->most, most, running)) {
+  }
+  usleep(2000);
+  ATOMIC_DEC(&S->running);
+  ATOMIC_INC(&S->dispatched);
+}
+
+bool test_scheduler_helpers() {
+  TEST_BEGIN;
+
+  // mailboxes sit in run queues of busy workers, sleeping workers must come to steal them
+  leptonet_global_message_queue_init();
+  static struct slow_service S;
+  memset(&S, 0, sizeof S);
+  struct message_queue *mq[SLOW_THREAD];
+  for (int i = 0; i < SLOW_THREAD; i ++) {
+    mq[i] = leptonet_mq_create(i);
+  }
+  struct leptonet_scheduler_config config = {
+    .thread = SLOW_THREAD,
+    .dispatch = slow_dispatch,
+    .ud = &S,
+  };
+  struct leptonet_scheduler *s = leptonet_scheduler_create(&config);
+  leptonet_scheduler_start(s);
+  for (int i = 0; i < SLOW_MESSAGE; i ++) {
+    for (int j = 0; j < SLOW_THREAD; j ++) {
+      struct leptonet_message msg = {.type = 0, .sission = i, .data = NULL, .sz = 0};
+      leptonet_mq_push(mq[j], &msg);
+    }
+  }
+  // only one is woken up by us
+  leptonet_scheduler_wakeup(s, SLOW_THREAD - 1);
+  while (ATOMIC_LOAD(&S.dispatched) < SLOW_THREAD * SLOW_MESSAGE) {
+    usleep(1000);
+  }
+  leptonet_scheduler_stop(s);
+  leptonet_scheduler_release(s);
+  ASSERT_EQ(SLOW_THREAD, S.most);
+  for (int i = 0; i < SLOW_THREAD; i ++) {
+    leptonet_mq_release(mq[i], NULL, NULL);
+  }
+  leptonet_global_message_queue_release();
+
+  TEST_END;
+}
+
+TEST_REGIST(schedulertest, single, test_scheduler_single);
+TEST_REGIST(schedulertest, default_weight, test_scheduler_default_weight);
+TEST_REGIST(schedulertest, custom_weight, test_scheduler_custom_weight);
+TEST_REGIST(schedulertest, batch, test_scheduler_batch);
+TEST_REGIST(schedulertest, helpers, test_scheduler_helpers);
@@ -0,0 +1,112 @@
+#include <stdint.h>
+#include <pthread.h>
+
+#include "framework.h"
+#include "../core/leptonet_slab.h"
+#include "../core/atomic.h"
+
+#define OBJECT_NUM 10000
+#define RING_SIZE 1024
+
+bool test_slab_basic() {
+  TEST_BEGIN;
+
+  // every size up to SLAB_MAX_SIZE gets a big enough class
+  for (size_t sz = 0; sz <= SLAB_MAX_SIZE; sz += 7) {
+    char *p = leptonet_slab_alloc(sz);
+    ASSERT_NE(NULL, p);
+    size_t usable = leptonet_slab_size(p);
+    ASSERT_EQ(true, (usable >= sz));
+    ASSERT_EQ(true, (usable >= 16));
+    memset(p, 0xa5, sz);
+    leptonet_slab_free(p);
+  }
+
+  // large request goes to libc
+  void *big = leptonet_slab_alloc(SLAB_MAX_SIZE + 1);
+  ASSERT_NE(NULL, big);
+  ASSERT_EQ(0, leptonet_slab_size(big));
+  leptonet_slab_free(big);
+  leptonet_slab_free(NULL);
+
+  // freed object is reused by the same thread
+  void *p1 = leptonet_slab_alloc(100);
+  leptonet_slab_free(p1);
+  void *p2 = leptonet_slab_alloc(100);
+  ASSERT_EQ(p1, p2);
+  leptonet_slab_free(p2);
+
+  TEST_END;
+}
+
+bool test_slab_many() {
+  TEST_BEGIN;
+
+  static char *ptrs[OBJECT_NUM];
+  for (int i = 0; i < OBJECT_NUM; i ++) {
+    size_t sz = 64 + (i * 131) % 4096;
+    ptrs[i] = leptonet_slab_alloc(sz);
+    ASSERT_NE(NULL, ptrs[i]);
+    // tag each object with its index, overlap would break the tag
+    memset(ptrs[i], i & 0xff, sz);
+  }
+  for (int i = 0; i < OBJECT_NUM; i ++) {
+    size_t sz = 64 + (i * 131) % 4096;
+    ASSERT_EQ((char)(i & 0xff), ptrs[i][0]);
+    ASSERT_EQ((char)(i & 0xff), ptrs[i][sz - 1]);
+    leptonet_slab_free(ptrs[i]);
+  }
+  leptonet_slab_flush();
+
+  TEST_END;
+}
+
+// single producer single consumer ring, objects allocated on one thread are freed on the other
+struct ring {
+  void *volatile slot[RING_SIZE];
+  ATOMIC_UINT head;
+  ATOMIC_UINT tail;
+};
+
+static void* consumer(void *ud) {
+  struct ring *r = ud;
+  int cnt = 0;
+  while (cnt < OBJECT_NUM * 10) {
+    if (ATOMIC_LOAD_ACQ(&r->head) == r->tail) {
+      continue;
+    }
+    unsigned int *p = r->slot[r->tail % RING_SIZE];
+    // content written by producer must be intact
+    if (*p != (unsigned int)cnt) {
+      return (void*)1;
+    }
+    leptonet_slab_free(p);
+    ATOMIC_STORE_REL(&r->tail, r->tail + 1);
+    cnt++;
+  }
+  return NULL;
+}
+
+bool test_slab_cross_thread() {
+  TEST_BEGIN;
+
+  static struct ring r;
+  pthread_t pid;
+  pthread_create(&pid, NULL, consumer, &r);
+  for (int i = 0; i < OBJECT_NUM * 10; i ++) {
+    while (r.head - ATOMIC_LOAD_ACQ(&r.tail) == RING_SIZE) {}
+    unsigned int *p = leptonet_slab_alloc(64 + i % 512);
+    *p = i;
+    r.slot[r.head % RING_SIZE] = p;
+    ATOMIC_STORE_REL(&r.head, r.head + 1);
+  }
+  void *ret;
+  pthread_join(pid, &ret);
+  ASSERT_EQ(NULL, ret);
+
+  TEST_END;
+}
+
+TEST_REGIST(slabtest, basic, test_slab_basic);
+TEST_REGIST(slabtest, many, test_slab_many);
+TEST_REGIST(slabtest, cross_thread, test_slab_cross_thread);
@@ -0,0 +1,203 @@
+#include <pthread.h>
+
+#include "framework.h"
+#include "../core/leptonet_mq.h"
+#include "../core/leptonet_timer.h"
+
+// drain all scheduled mailboxes, return message count and check type
+static int drain(struct message_queue *mq, uint32_t *last) {
+  int cnt = 0;
+  struct message_queue *q;
+  while (leptonet_globalmq_pop(&q)) {
+    ASSERT_EQ(mq, q);
+    struct leptonet_message msg;
+    while (leptonet_mq_pop(q, &msg)) {
+      ASSERT_EQ(PTYPE_RESPONSE, msg.type);
+      *last = msg.sission;
+      cnt++;
+    }
+  }
+  return cnt;
+}
+
+bool test_timer_basic() {
+  TEST_BEGIN;
+
+  leptonet_global_message_queue_init();
+  leptonet_timer_init();
+  struct message_queue *mq = leptonet_mq_create(1);
+  uint32_t sission = 0;
+
+  // timeout 0 is pushed immediately
+  ASSERT_EQ(0, leptonet_timer_timeout(mq, 0, 1));
+  ASSERT_EQ(1, drain(mq, &sission));
+  ASSERT_EQ(1, sission);
+
+  ASSERT_NE(0, leptonet_timer_timeout(mq, 5, 2));
+  dleptonet_timer_tick(4);
+  ASSERT_EQ(0, drain(mq, &sission));
+  dleptonet_timer_tick(1);
+  ASSERT_EQ(1, drain(mq, &sission));
+  ASSERT_EQ(2, sission);
+  ASSERT_EQ(5, leptonet_timer_now());
+
+  // far timer goes through all levels
+  ASSERT_NE(0, leptonet_timer_timeout(mq, 300000, 3));
+  dleptonet_timer_tick(299999);
+  ASSERT_EQ(0, drain(mq, &sission));
+  dleptonet_timer_tick(1);
+  ASSERT_EQ(1, drain(mq, &sission));
+  ASSERT_EQ(3, sission);
+
+  leptonet_mq_release(mq, NULL, NULL);
+  leptonet_timer_release();
+  leptonet_global_message_queue_release();
+
+  TEST_END;
+}
+
+bool test_timer_cancel() {
+  TEST_BEGIN;
+
+  leptonet_global_message_queue_init();
+  leptonet_timer_init();
+  struct message_queue *mq = leptonet_mq_create(1);
+  uint32_t sission = 0;
+
+  uint64_t id = leptonet_timer_timeout(mq, 10, 1);
+  ASSERT_EQ(1, leptonet_timer_cancel(id));
+  ASSERT_EQ(0, leptonet_timer_cancel(id));
+  dleptonet_timer_tick(20);
+  ASSERT_EQ(0, drain(mq, &sission));
+
+  // a fired timer can't be canceled, and its id is not reused by the next timer
+  id = leptonet_timer_timeout(mq, 1, 2);
+  dleptonet_timer_tick(1);
+  ASSERT_EQ(1, drain(mq, &sission));
+  uint64_t nid = leptonet_timer_timeout(mq, 1, 3);
+  ASSERT_NE(id, nid);
+  ASSERT_EQ(0, leptonet_timer_cancel(id));
+  ASSERT_EQ(1, leptonet_timer_cancel(nid));
+
+  leptonet_mq_release(mq, NULL, NULL);
+  leptonet_timer_release();
+  leptonet_global_message_queue_release();
+
+  TEST_END;
+}
+
+#define TIMER_NUM 200000
+#define TIMER_RANGE 70000
+
+bool test_timer_many() {
+  TEST_BEGIN;
+
+  leptonet_global_message_queue_init();
+  leptonet_timer_init();
+  struct message_queue *mq = leptonet_mq_create(1);
+  leptonet_mq_watermark(mq, 0, 0);
+
+  static uint64_t ids[TIMER_NUM];
+  for (int i = 0; i < TIMER_NUM; i ++) {
+    // sission is the expire tick
+    int time = 1 + (i * 7919) % TIMER_RANGE;
+    ids[i] = leptonet_timer_timeout(mq, time, time);
+  }
+  for (int i = 0; i < TIMER_NUM; i += 2) {
+    ASSERT_EQ(1, leptonet_timer_cancel(ids[i]));
+  }
+  int fired = 0;
+  for (int tick = 1; tick <= TIMER_RANGE; tick ++) {
+    dleptonet_timer_tick(1);
+    struct message_queue *q;
+    while (leptonet_globalmq_pop(&q)) {
+      struct leptonet_message msg;
+      while (leptonet_mq_pop(q, &msg)) {
+        // fired exactly at expire tick
+        ASSERT_EQ((uint32_t)tick, msg.sission);
+        fired++;
+      }
+    }
+  }
+  ASSERT_EQ(TIMER_NUM / 2, fired);
+
+  leptonet_mq_release(mq, NULL, NULL);
+  leptonet_timer_release();
+  leptonet_global_message_queue_release();
+
+  TEST_END;
+}
+
+bool test_timer_thread() {
+  TEST_BEGIN;
+
+  leptonet_global_message_queue_init();
+  leptonet_timer_init();
+  struct message_queue *mq = leptonet_mq_create(1);
+  uint32_t sission = 0;
+
+  leptonet_timer_start(NULL);
+  leptonet_timer_timeout(mq, 2, 1);
+  int cnt = 0;
+  while (cnt == 0) {
+    cnt = drain(mq, &sission);
+  }
+  leptonet_timer_stop();
+  ASSERT_EQ(1, cnt);
+  ASSERT_EQ(1, sission);
+
+  leptonet_mq_release(mq, NULL, NULL);
+  leptonet_timer_release();
+  leptonet_global_message_queue_release();
+
+  TEST_END;
+}
+
+#define FIRING_ROUNDS 20
+#define FIRING_NUM 10000
+
+static void* tick_one(void *ud) {
+  (void)ud;
+  dleptonet_timer_tick(1);
+  return NULL;
+}
+
+bool test_timer_cancel_firing() {
+  TEST_BEGIN;
+
+  leptonet_global_message_queue_init();
+  leptonet_timer_init();
+  static uint64_t ids[FIRING_NUM];
+  for (int round = 0; round < FIRING_ROUNDS; round ++) {
+    struct message_queue *mq = leptonet_mq_create(1);
+    leptonet_mq_watermark(mq, 0, 0);
+    for (int i = 0; i < FIRING_NUM; i ++) {
+      ids[i] = leptonet_timer_timeout(mq, 1, i);
+    }
+    // timers are canceled from the last one once the first one has fired
+    pthread_t pid;
+    pthread_create(&pid, NULL, tick_one, NULL);
+    while (leptonet_mq_length(mq) == 0) {
+    }
+    int canceled = 0;
+    for (int i = FIRING_NUM - 1; i >= 0; i --) {
+      canceled += leptonet_timer_cancel(ids[i]);
+    }
+    // a timer which isn't canceled has pushed its message, so mq can be released now
+    ASSERT_EQ(FIRING_NUM, canceled + leptonet_mq_length(mq));
+    pthread_join(pid, NULL);
+    uint32_t sission;
+    ASSERT_EQ(FIRING_NUM - canceled, drain(mq, &sission));
+    leptonet_mq_release(mq, NULL, NULL);
+  }
+  leptonet_timer_release();
+  leptonet_global_message_queue_release();
+
+  TEST_END;
+}
+
+TEST_REGIST(timertest, basic, test_timer_basic);
+TEST_REGIST(timertest, cancel, test_timer_cancel);
+TEST_REGIST(timertest, many, test_timer_many);
+TEST_REGIST(timertest, thread, test_timer_thread);
+TEST_REGIST(timertest, cancel_firing, test_timer_cancel_firing);
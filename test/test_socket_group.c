@@ -0,0 +1,129 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "framework.h"
+#include "../core/socket_group.h"
+#include "../core/atomic.h"
+#include "../core/leptonet_malloc.h"
+
+#define TEST_PORT "17322"
+#define REACTOR_NUM 4
+#define CLIENT_NUM 16
+#define ECHO_SIZE (64 * 1024)
+
+struct group_stat {
+  struct socket_group *g;
+  ATOMIC_INT open;
+  ATOMIC_INT accept;
+  ATOMIC_INT close;
+  ATOMIC_INT wrong_shard;
+};
+
+static void on_message(void *ud, int type, struct socket_message *sm) {
+  struct group_stat *st = ud;
+  switch (type) {
+    case SOCKET_OPEN:
+      ATOMIC_INC(&st->open);
+      break;
+    case SOCKET_ACCEPT:
+      // new socket is owned by the reactor of its listener
+      if (socket_shard((int)sm->ud) != socket_shard(sm->id)) {
+        ATOMIC_INC(&st->wrong_shard);
+      }
+      leptonet_free(sm->buffer);
+      ATOMIC_INC(&st->accept);
+      break;
+    case SOCKET_DATA: {
+      struct socket_buffer buf = {.id = sm->id, .buffer = sm->buffer, .sz = (int)sm->ud};
+      socket_group_sendhigh(st->g, &buf);
+      break;
+    }
+    case SOCKET_CLOSE:
+      ATOMIC_INC(&st->close);
+      break;
+  }
+}
+
+static void* echo_client(void *ud) {
+  (void)ud;
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo("127.0.0.1", TEST_PORT, &hints, &res) != 0) {
+    return (void*)1;
+  }
+  int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  int r = connect(fd, res->ai_addr, res->ai_addrlen);
+  freeaddrinfo(res);
+  if (r < 0) {
+    close(fd);
+    return (void*)1;
+  }
+  char *out = malloc(ECHO_SIZE), *in = malloc(ECHO_SIZE);
+  for (int i = 0; i < ECHO_SIZE; i ++) {
+    out[i] = (char)(i * 13 + fd);
+  }
+  // small enough to fit socket buffers, so send all and then read all
+  size_t sent = 0, recvd = 0;
+  while (sent < ECHO_SIZE) {
+    int cnt = send(fd, out + sent, ECHO_SIZE - sent, 0);
+    if (cnt <= 0) {
+      break;
+    }
+    sent += cnt;
+  }
+  while (recvd < ECHO_SIZE) {
+    int cnt = recv(fd, in + recvd, ECHO_SIZE - recvd, 0);
+    if (cnt <= 0) {
+      break;
+    }
+    recvd += cnt;
+  }
+  close(fd);
+  bool ok = recvd == ECHO_SIZE && memcmp(in, out, ECHO_SIZE) == 0;
+  free(out);
+  free(in);
+  return ok ? NULL : (void*)1;
+}
+
+bool test_socket_group_echo() {
+  TEST_BEGIN;
+
+  static struct group_stat st;
+  st.g = socket_group_create(REACTOR_NUM, 0, on_message, &st);
+  ASSERT_NE(NULL, st.g);
+  ASSERT_EQ(REACTOR_NUM, socket_group_size(st.g));
+  socket_group_listen(st.g, "127.0.0.1", TEST_PORT, 64, 1);
+  while (ATOMIC_LOAD_ACQ(&st.open) < REACTOR_NUM) {
+    usleep(1000);
+  }
+
+  pthread_t pids[CLIENT_NUM];
+  for (int i = 0; i < CLIENT_NUM; i ++) {
+    pthread_create(&pids[i], NULL, echo_client, NULL);
+  }
+  for (int i = 0; i < CLIENT_NUM; i ++) {
+    void *ret;
+    pthread_join(pids[i], &ret);
+    ASSERT_EQ(NULL, ret);
+  }
+  while (ATOMIC_LOAD_ACQ(&st.close) < CLIENT_NUM) {
+    usleep(1000);
+  }
+  ASSERT_EQ(CLIENT_NUM, st.accept);
+  ASSERT_EQ(0, st.wrong_shard);
+  // ids are routed by shard, an id of a missing reactor is dropped
+  ASSERT_EQ(NULL, socket_group_server(st.g, REACTOR_NUM));
+  ASSERT_NE(NULL, socket_group_server(st.g, REACTOR_NUM - 1));
+  socket_group_release(st.g);
+
+  TEST_END;
+}
+
+TEST_REGIST(socketgrouptest, echo, test_socket_group_echo);
@@ -0,0 +1,135 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "framework.h"
+#include "../core/socket_pool.h"
+
+#define BUFFER_NUM 4096
+
+bool test_socket_pool_basic() {
+  TEST_BEGIN;
+
+  struct socket_pool *p = socket_pool_lease();
+  ASSERT_NE(NULL, p);
+  // capacity is sz rounded up to a size class
+  for (size_t sz = 1; sz <= SOCKET_POOL_MAX; sz = sz * 3 + 1) {
+    char *buf = socket_pool_alloc(p, sz);
+    ASSERT_NE(NULL, buf);
+    size_t cap = socket_pool_size(buf);
+    ASSERT_EQ(true, (cap >= sz));
+    ASSERT_EQ(true, (cap >= SOCKET_POOL_MIN));
+    ASSERT_EQ(true, (cap < 2 * sz + SOCKET_POOL_MIN));
+    memset(buf, 0xa5, cap);
+    ASSERT_EQ(true, socket_pool_free(buf));
+  }
+  ASSERT_EQ(NULL, socket_pool_alloc(p, SOCKET_POOL_MAX + 1));
+
+  // freed buffer is reused once the rest of its page is taken
+  void *b1 = socket_pool_alloc(p, 1000);
+  ASSERT_EQ(true, socket_pool_free(b1));
+  void *bufs[64];
+  bool reused = false;
+  for (int i = 0; i < 64; i ++) {
+    bufs[i] = socket_pool_alloc(p, 1000);
+    reused = reused || bufs[i] == b1;
+  }
+  ASSERT_EQ(true, reused);
+  for (int i = 0; i < 64; i ++) {
+    socket_pool_free(bufs[i]);
+  }
+
+  // memory of others isn't taken
+  void *m = malloc(64);
+  ASSERT_EQ(false, socket_pool_free(m));
+  ASSERT_EQ(0, socket_pool_size(m));
+  free(m);
+  socket_pool_return(p);
+
+  TEST_END;
+}
+
+bool test_socket_pool_many() {
+  TEST_BEGIN;
+
+  struct socket_pool *p = socket_pool_lease();
+  ASSERT_NE(NULL, p);
+  static char *bufs[BUFFER_NUM];
+  for (int i = 0; i < BUFFER_NUM; i ++) {
+    size_t sz = SOCKET_POOL_MIN << (i % 8);
+    bufs[i] = socket_pool_alloc(p, sz);
+    ASSERT_NE(NULL, bufs[i]);
+    // tag each buffer with its index, overlap would break the tag
+    memset(bufs[i], i & 0xff, sz);
+  }
+  for (int i = 0; i < BUFFER_NUM; i ++) {
+    size_t sz = SOCKET_POOL_MIN << (i % 8);
+    ASSERT_EQ((char)(i & 0xff), bufs[i][0]);
+    ASSERT_EQ((char)(i & 0xff), bufs[i][sz - 1]);
+    socket_pool_free(bufs[i]);
+  }
+  socket_pool_return(p);
+
+  TEST_END;
+}
+
+static void* free_all(void *ud) {
+  char **bufs = ud;
+  for (int i = 0; i < BUFFER_NUM; i ++) {
+    socket_pool_free(bufs[i]);
+  }
+  return NULL;
+}
+
+bool test_socket_pool_cross_thread() {
+  TEST_BEGIN;
+
+  // buffers handed to consumer are freed on its thread, leasing thread picks them up later
+  struct socket_pool *p = socket_pool_lease();
+  ASSERT_NE(NULL, p);
+  static char *bufs[BUFFER_NUM];
+  for (int round = 0; round < 4; round ++) {
+    for (int i = 0; i < BUFFER_NUM; i ++) {
+      bufs[i] = socket_pool_alloc(p, 512);
+      ASSERT_NE(NULL, bufs[i]);
+      memset(bufs[i], round, 512);
+    }
+    pthread_t pid;
+    pthread_create(&pid, NULL, free_all, bufs);
+    pthread_join(pid, NULL);
+  }
+  socket_pool_return(p);
+
+  TEST_END;
+}
+
+bool test_socket_pool_lease() {
+  TEST_BEGIN;
+
+  // pools are limited, each one is leased by one reactor at most
+  struct socket_pool *pools[256];
+  int n = 0;
+  while (n < 256 && (pools[n] = socket_pool_lease()) != NULL) {
+    n++;
+  }
+  ASSERT_EQ(true, (n > 0));
+  ASSERT_EQ(true, (n < 256));
+  for (int i = 0; i < n; i ++) {
+    for (int j = i + 1; j < n; j ++) {
+      ASSERT_NE(pools[i], pools[j]);
+    }
+  }
+  socket_pool_return(pools[0]);
+  ASSERT_EQ(pools[0], socket_pool_lease());
+  for (int i = 0; i < n; i ++) {
+    socket_pool_return(pools[i]);
+  }
+
+  TEST_END;
+}
+
+TEST_REGIST(socketpooltest, basic, test_socket_pool_basic);
+TEST_REGIST(socketpooltest, many, test_socket_pool_many);
+TEST_REGIST(socketpooltest, cross_thread, test_socket_pool_cross_thread);
+TEST_REGIST(socketpooltest, lease, test_socket_pool_lease);
@@ -0,0 +1,91 @@
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "framework.h"
+#include "../core/socket_resolver.h"
+#include "../core/atomic.h"
+
+struct answer {
+  ATOMIC_INT done;
+  pthread_t thread;
+  struct socket_resolved r;
+};
+
+static void on_resolved(void *ud, const struct socket_resolved *r) {
+  struct answer *a = ud;
+  a->r = *r;
+  a->thread = pthread_self();
+  ATOMIC_STORE_REL(&a->done, 1);
+}
+
+static void wait_answer(struct answer *a) {
+  while (ATOMIC_LOAD_ACQ(&a->done) == 0) {
+    usleep(1000);
+  }
+}
+
+bool test_resolver_basic() {
+  TEST_BEGIN;
+
+  // first query is resolved by a resolver thread
+  static struct answer a1;
+  socket_resolver_query("127.0.0.1", "17323", SOCK_STREAM, false, on_resolved, &a1);
+  wait_answer(&a1);
+  ASSERT_EQ(0, a1.r.err);
+  ASSERT_EQ(true, (a1.r.n >= 1));
+  struct sockaddr_in *in = (struct sockaddr_in*)&a1.r.addrs[0].addr;
+  ASSERT_EQ(AF_INET, in->sin_family);
+  ASSERT_EQ(17323, ntohs(in->sin_port));
+  ASSERT_EQ(0, pthread_equal(a1.thread, pthread_self()));
+
+  // then it's cached, and answered on calling thread
+  static struct answer a2;
+  socket_resolver_query("127.0.0.1", "17323", SOCK_STREAM, false, on_resolved, &a2);
+  ASSERT_EQ(1, a2.done);
+  ASSERT_NE(0, pthread_equal(a2.thread, pthread_self()));
+  ASSERT_EQ(0, memcmp(&a1.r, &a2.r, sizeof a1.r));
+
+  // socket type is a part of the name
+  static struct answer a3;
+  socket_resolver_query("127.0.0.1", "17323", SOCK_DGRAM, false, on_resolved, &a3);
+  wait_answer(&a3);
+  ASSERT_EQ(0, a3.r.err);
+  ASSERT_EQ(0, pthread_equal(a3.thread, pthread_self()));
+
+  TEST_END;
+}
+
+bool test_resolver_passive() {
+  TEST_BEGIN;
+
+  static struct answer a;
+  socket_resolver_query(NULL, "17323", SOCK_STREAM, true, on_resolved, &a);
+  wait_answer(&a);
+  ASSERT_EQ(0, a.r.err);
+  ASSERT_EQ(true, (a.r.n >= 1));
+
+  TEST_END;
+}
+
+bool test_resolver_failure() {
+  TEST_BEGIN;
+
+  // failure is cached too
+  static struct answer a1, a2;
+  socket_resolver_query("no-such-host.invalid", "80", SOCK_STREAM, false, on_resolved, &a1);
+  wait_answer(&a1);
+  ASSERT_NE(0, a1.r.err);
+  ASSERT_EQ(0, a1.r.n);
+  socket_resolver_query("no-such-host.invalid", "80", SOCK_STREAM, false, on_resolved, &a2);
+  ASSERT_EQ(1, a2.done);
+  ASSERT_EQ(a1.r.err, a2.r.err);
+
+  TEST_END;
+}
+
+TEST_REGIST(resolvertest, basic, test_resolver_basic);
+TEST_REGIST(resolvertest, passive, test_resolver_passive);
+TEST_REGIST(resolvertest, failure, test_resolver_failure);
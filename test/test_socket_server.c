@@ -0,0 +1,907 @@
+#include <stdint.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "framework.h"
+#include "../core/socket_server.h"
+#include "../core/socket_resolver.h"
+#include "../core/atomic.h"
+#include "../core/leptonet_malloc.h"
+
+#define TEST_PORT "17321"
+#define ECHO_SIZE (1024 * 1024)
+
+// rcvbuf is receive buffer of client, 0 for default, a small one keeps server's socket buffer full
+static int client_connect_rcvbuf(int rcvbuf) {
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo("127.0.0.1", TEST_PORT, &hints, &res) != 0) {
+    return -1;
+  }
+  int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if (fd >= 0 && rcvbuf > 0) {
+    // before connect, so that window is small from the beginning
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+  }
+  if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+static int client_connect() {
+  return client_connect_rcvbuf(0);
+}
+
+// send ECHO_SIZE bytes and read them back, return NULL if all bytes are echoed in order
+static void* echo_client(void *ud) {
+  (void)ud;
+  int fd = client_connect();
+  if (fd < 0) {
+    return (void*)1;
+  }
+  static char out[ECHO_SIZE], in[ECHO_SIZE];
+  for (int i = 0; i < ECHO_SIZE; i ++) {
+    out[i] = (char)(i * 7);
+  }
+  // writer side is blocking, the server echoes while we're still sending, so send in chunks
+  size_t sent = 0, recvd = 0;
+  while (recvd < ECHO_SIZE) {
+    if (sent < ECHO_SIZE) {
+      size_t n = ECHO_SIZE - sent < 4096 ? ECHO_SIZE - sent : 4096;
+      int cnt = send(fd, out + sent, n, 0);
+      if (cnt <= 0) {
+        break;
+      }
+      sent += cnt;
+    }
+    int cnt = recv(fd, in + recvd, ECHO_SIZE - recvd, sent < ECHO_SIZE ? MSG_DONTWAIT : 0);
+    if (cnt == 0) {
+      break;
+    }
+    if (cnt > 0) {
+      recvd += cnt;
+    }
+  }
+  close(fd);
+  if (recvd != ECHO_SIZE || memcmp(in, out, ECHO_SIZE) != 0) {
+    return (void*)1;
+  }
+  return NULL;
+}
+
+static bool echo(size_t zerocopy, int readmode) {
+  struct socket_server *ss = socket_server_create(0);
+  ASSERT_NE(NULL, ss);
+  socket_server_zerocopy(ss, zerocopy);
+  socket_server_readmode(ss, readmode);
+  struct socket_message sm;
+  socket_server_listen(ss, "127.0.0.1", TEST_PORT, 32, 1);
+  ASSERT_EQ(SOCKET_OPEN, socket_server_poll(ss, &sm));
+  int listen_id = sm.id;
+
+  pthread_t pid;
+  pthread_create(&pid, NULL, echo_client, NULL);
+
+  size_t echoed = 0;
+  int client = -1;
+  bool closed = false;
+  while (!closed) {
+    int type = socket_server_poll(ss, &sm);
+    switch (type) {
+      case SOCKET_ACCEPT:
+        ASSERT_EQ(listen_id, sm.id);
+        // peer address
+        ASSERT_EQ(0, strncmp(sm.buffer, "127.0.0.1:", 10));
+        leptonet_free(sm.buffer);
+        client = (int)sm.ud;
+        break;
+      case SOCKET_DATA: {
+        ASSERT_EQ(client, sm.id);
+        struct socket_buffer buf = {.id = sm.id, .buffer = sm.buffer, .sz = (int)sm.ud};
+        echoed += sm.ud;
+        socket_server_sendhigh(ss, &buf);
+        break;
+      }
+      case SOCKET_CLOSE:
+        ASSERT_EQ(client, sm.id);
+        closed = true;
+        break;
+      default:
+        ASSERT_EQ(0, 1);
+    }
+  }
+  void *ret;
+  pthread_join(pid, &ret);
+  ASSERT_EQ(NULL, ret);
+  ASSERT_EQ(ECHO_SIZE, echoed);
+  socket_server_release(ss);
+  return true;
+}
+
+bool test_socket_server_echo() {
+  TEST_BEGIN;
+
+  ASSERT_EQ(true, echo(0, SOCKET_READ_POOL));
+
+  TEST_END;
+}
+
+bool test_socket_server_zerocopy() {
+  TEST_BEGIN;
+
+  // received buffers grow up to 64KB, large ones are echoed by MSG_ZEROCOPY
+  // loopback copies anyway, but completions still come from error queue
+  ASSERT_EQ(true, echo(4096, SOCKET_READ_POOL));
+
+  TEST_END;
+}
+
+#define ZC_CLOSE_SIZE (8 * 1024 * 1024)
+
+bool test_socket_server_zerocopy_close() {
+  TEST_BEGIN;
+
+  struct socket_server *ss = socket_server_create(0);
+  socket_server_zerocopy(ss, 4096);
+  struct socket_message sm;
+  socket_server_listen(ss, "127.0.0.1", TEST_PORT, 32, 1);
+  ASSERT_EQ(SOCKET_OPEN, socket_server_poll(ss, &sm));
+  int fd = client_connect_rcvbuf(4096);
+  ASSERT_EQ(SOCKET_ACCEPT, socket_server_poll(ss, &sm));
+  leptonet_free(sm.buffer);
+  int id = (int)sm.ud;
+
+  // it's sent by MSG_ZEROCOPY partially, most of sent bytes are still in socket buffer when it's closed
+  char *data = leptonet_malloc(ZC_CLOSE_SIZE);
+  memset(data, 'z', ZC_CLOSE_SIZE);
+  struct socket_buffer buf = {.id = id, .buffer = data, .sz = ZC_CLOSE_SIZE};
+  socket_server_sendhigh(ss, &buf);
+  socket_server_close(ss, id, SHUT_RDWR, 2);
+  ASSERT_EQ(SOCKET_CLOSE, socket_server_poll(ss, &sm));
+  ASSERT_EQ(id, sm.id);
+  // kernel may still refer to the buffer, so connection is aborted before it's freed
+  char in[4096];
+  int cnt;
+  while ((cnt = recv(fd, in, sizeof in, 0)) > 0) {
+  }
+  ASSERT_EQ(-1, cnt);
+  ASSERT_EQ(ECONNRESET, errno);
+  close(fd);
+  socket_server_release(ss);
+
+  TEST_END;
+}
+
+bool test_socket_server_readcopy() {
+  TEST_BEGIN;
+
+  // received bytes are copied out of scratch area into exact sized buffers
+  ASSERT_EQ(true, echo(0, SOCKET_READ_COPY));
+
+  TEST_END;
+}
+
+struct poller {
+  struct socket_server *ss;
+  int type;
+  uint64_t cpu_ns;
+};
+
+static void* idle_poll(void *ud) {
+  struct poller *p = ud;
+  struct socket_message sm;
+  struct timespec b, e;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &b);
+  p->type = socket_server_poll(p->ss, &sm);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &e);
+  p->cpu_ns = (e.tv_sec - b.tv_sec) * 1000000000ULL + e.tv_nsec - b.tv_nsec;
+  return NULL;
+}
+
+bool test_socket_server_idle() {
+  TEST_BEGIN;
+
+  // an idle poll blocks in epoll and is woken up by a command
+  struct poller p = {.ss = socket_server_create(0), .type = -1};
+  ASSERT_NE(NULL, p.ss);
+  pthread_t pid;
+  pthread_create(&pid, NULL, idle_poll, &p);
+  usleep(200 * 1000);
+  socket_server_listen(p.ss, "127.0.0.1", TEST_PORT, 32, 1);
+  pthread_join(pid, NULL);
+  ASSERT_EQ(SOCKET_OPEN, p.type);
+  // spinning for 200ms would burn about that much cpu time
+  ASSERT_EQ(true, (p.cpu_ns < 50 * 1000000ULL));
+  socket_server_release(p.ss);
+
+  TEST_END;
+}
+
+#define SENDER_NUM 4
+#define SEND_NUM 10000
+
+struct sender {
+  struct socket_server *ss;
+  int id;
+  int seq;
+};
+
+static void* send_many(void *ud) {
+  struct sender *p = ud;
+  for (int i = 0; i < SEND_NUM; i ++) {
+    struct socket_buffer buf = {.id = p->id, .buffer = leptonet_malloc(sizeof(int)), .sz = sizeof(int)};
+    memcpy(buf.buffer, &p->seq, sizeof(int));
+    socket_server_sendlow(p->ss, &buf);
+  }
+  return NULL;
+}
+
+// count bytes until SENDER_NUM * SEND_NUM ints arrive, then close
+static void* count_client(void *ud) {
+  int fd = client_connect();
+  if (fd < 0) {
+    return (void*)1;
+  }
+  int *sum = ud;
+  size_t total = 0;
+  int v;
+  while (total < SENDER_NUM * SEND_NUM * sizeof(int)) {
+    int cnt = recv(fd, &v, sizeof v, MSG_WAITALL);
+    if (cnt != sizeof v) {
+      break;
+    }
+    *sum += v;
+    total += cnt;
+  }
+  close(fd);
+  return NULL;
+}
+
+bool test_socket_server_senders() {
+  TEST_BEGIN;
+
+  // requests from several threads go through command ring, which wraps around many times
+  struct socket_server *ss = socket_server_create(0);
+  struct socket_message sm;
+  socket_server_listen(ss, "127.0.0.1", TEST_PORT, 32, 1);
+  ASSERT_EQ(SOCKET_OPEN, socket_server_poll(ss, &sm));
+  int sum = 0;
+  pthread_t client;
+  pthread_create(&client, NULL, count_client, &sum);
+  ASSERT_EQ(SOCKET_ACCEPT, socket_server_poll(ss, &sm));
+  leptonet_free(sm.buffer);
+
+  struct sender senders[SENDER_NUM];
+  pthread_t pids[SENDER_NUM];
+  for (int i = 0; i < SENDER_NUM; i ++) {
+    senders[i].ss = ss;
+    senders[i].id = (int)sm.ud;
+    senders[i].seq = i + 1;
+    pthread_create(&pids[i], NULL, send_many, &senders[i]);
+  }
+  // returns when client closes after all bytes
+  ASSERT_EQ(SOCKET_CLOSE, socket_server_poll(ss, &sm));
+  for (int i = 0; i < SENDER_NUM; i ++) {
+    pthread_join(pids[i], NULL);
+  }
+  pthread_join(client, NULL);
+  ASSERT_EQ(SEND_NUM * (1 + 2 + 3 + 4), sum);
+  socket_server_release(ss);
+
+  TEST_END;
+}
+
+#define STORM_CLIENTS 32
+#define STORM_KEPT 4
+
+// connect STORM_CLIENTS sockets, exit with the number of them closed by server
+static int storm_client() {
+  int fds[STORM_CLIENTS];
+  for (int i = 0; i < STORM_CLIENTS; i ++) {
+    fds[i] = client_connect();
+    if (fds[i] < 0) {
+      return 255;
+    }
+  }
+  usleep(500 * 1000);
+  int shed = 0;
+  for (int i = 0; i < STORM_CLIENTS; i ++) {
+    char c;
+    if (recv(fds[i], &c, 1, MSG_DONTWAIT) == 0) {
+      shed++;
+    }
+  }
+  return shed;
+}
+
+struct storm {
+  struct socket_server *ss;
+  pid_t pid;
+  int status;
+};
+
+static void* storm_wait(void *ud) {
+  struct storm *st = ud;
+  waitpid(st->pid, &st->status, 0);
+  socket_server_exit(st->ss);
+  return NULL;
+}
+
+bool test_socket_server_shed() {
+  TEST_BEGIN;
+
+  // only STORM_KEPT fds are left for accepted sockets, the rest are dropped by the reserved fd
+  struct storm st = {.ss = socket_server_create(0)};
+  struct socket_message sm;
+  socket_server_listen(st.ss, "127.0.0.1", TEST_PORT, 64, 1);
+  ASSERT_EQ(SOCKET_OPEN, socket_server_poll(st.ss, &sm));
+  st.pid = fork();
+  if (st.pid == 0) {
+    _exit(storm_client());
+  }
+  int lowest = dup(0);
+  close(lowest);
+  struct rlimit old, rl;
+  getrlimit(RLIMIT_NOFILE, &old);
+  rl = old;
+  rl.rlim_cur = lowest + STORM_KEPT;
+  setrlimit(RLIMIT_NOFILE, &rl);
+  pthread_t pid;
+  pthread_create(&pid, NULL, storm_wait, &st);
+
+  int accepted = 0;
+  int type;
+  while ((type = socket_server_poll(st.ss, &sm)) != SOCKET_EXIT) {
+    if (type == SOCKET_ACCEPT) {
+      leptonet_free(sm.buffer);
+      accepted++;
+    }
+  }
+  pthread_join(pid, NULL);
+  setrlimit(RLIMIT_NOFILE, &old);
+  ASSERT_EQ(STORM_KEPT, accepted);
+  ASSERT_EQ(1, WIFEXITED(st.status));
+  ASSERT_EQ(STORM_CLIENTS - STORM_KEPT, WEXITSTATUS(st.status));
+  socket_server_release(st.ss);
+
+  TEST_END;
+}
+
+#define UDP_ROUNDS 16
+#define UDP_BURST 100
+
+static int udp_size(int i) {
+  return (i * 37) % 1400;
+}
+
+// send bursts of datagrams, then read them back, return NULL if all are echoed in order
+static void* udp_client(void *ud) {
+  (void)ud;
+  struct socket_udp_address server;
+  if (!socket_server_udp_address("127.0.0.1", atoi(TEST_PORT), &server)) {
+    return (void*)1;
+  }
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  struct timeval tv = {.tv_sec = 2};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+  int bufsz = 1 << 20;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsz, sizeof bufsz);
+  char out[1400], in[1400];
+  bool ok = true;
+  for (int round = 0; round < UDP_ROUNDS && ok; round ++) {
+    for (int i = 0; i < UDP_BURST; i ++) {
+      int seq = round * UDP_BURST + i;
+      memset(out, seq & 0xff, sizeof out);
+      sendto(fd, out, udp_size(seq), 0, &server.u.addr, server.len);
+    }
+    for (int i = 0; i < UDP_BURST; i ++) {
+      int seq = round * UDP_BURST + i;
+      int cnt = recv(fd, in, sizeof in, 0);
+      memset(out, seq & 0xff, sizeof out);
+      if (cnt != udp_size(seq) || memcmp(in, out, cnt) != 0) {
+        ok = false;
+        break;
+      }
+    }
+  }
+  close(fd);
+  return ok ? NULL : (void*)1;
+}
+
+struct udp_wait {
+  struct socket_server *ss;
+  void *ret;
+};
+
+// replies are sent by polling, so server polls until client is done
+static void* udp_wait(void *ud) {
+  struct udp_wait *w = ud;
+  pthread_t pid;
+  pthread_create(&pid, NULL, udp_client, NULL);
+  pthread_join(pid, &w->ret);
+  socket_server_exit(w->ss);
+  return NULL;
+}
+
+bool test_socket_server_udp() {
+  TEST_BEGIN;
+
+  struct socket_server *ss = socket_server_create(0);
+  struct socket_message sm;
+  socket_server_udp(ss, "127.0.0.1", TEST_PORT, 2);
+  ASSERT_EQ(SOCKET_OPEN, socket_server_poll(ss, &sm));
+  int id = sm.id;
+  ASSERT_EQ(2, sm.opaque);
+
+  struct udp_wait w = {.ss = ss};
+  pthread_t pid;
+  pthread_create(&pid, NULL, udp_wait, &w);
+  // every datagram is echoed to its source
+  int echoed = 0;
+  int type;
+  while ((type = socket_server_poll(ss, &sm)) != SOCKET_EXIT) {
+    ASSERT_EQ(SOCKET_UDP, type);
+    ASSERT_EQ(id, sm.id);
+    ASSERT_EQ(udp_size(echoed), (int)sm.ud);
+    const struct socket_udp_address *from = socket_server_udp_source(&sm);
+    ASSERT_EQ(AF_INET, from->u.addr.sa_family);
+    struct socket_buffer buf = {.id = id, .buffer = sm.buffer, .sz = (int)sm.ud};
+    socket_server_sendto(ss, &buf, from);
+    echoed++;
+  }
+  pthread_join(pid, NULL);
+  ASSERT_EQ(NULL, w.ret);
+  ASSERT_EQ(UDP_ROUNDS * UDP_BURST, echoed);
+
+  struct socket_udp_address addr;
+  ASSERT_EQ(false, socket_server_udp_address("not an ip", 0, &addr));
+  ASSERT_EQ(true, socket_server_udp_address("::1", 1, &addr));
+  ASSERT_EQ(AF_INET6, addr.u.addr.sa_family);
+  socket_server_release(ss);
+
+  TEST_END;
+}
+
+bool test_socket_server_connect() {
+  TEST_BEGIN;
+
+  struct socket_server *ss = socket_server_create(0);
+  struct socket_message sm;
+  socket_server_listen(ss, "127.0.0.1", TEST_PORT, 32, 1);
+  ASSERT_EQ(SOCKET_OPEN, socket_server_poll(ss, &sm));
+  int listen_id = sm.id;
+
+  // both ends are in the same server, connected one says hello to accepted one
+  int id = socket_server_connect(ss, "127.0.0.1", TEST_PORT, 2);
+  ASSERT_NE(-1, id);
+  int accepted = -1;
+  bool opened = false;
+  while (accepted < 0 || !opened) {
+    int type = socket_server_poll(ss, &sm);
+    if (type == SOCKET_ACCEPT) {
+      ASSERT_EQ(listen_id, sm.id);
+      leptonet_free(sm.buffer);
+      accepted = (int)sm.ud;
+    } else {
+      ASSERT_EQ(SOCKET_OPEN, type);
+      ASSERT_EQ(id, sm.id);
+      ASSERT_EQ(2, sm.opaque);
+      opened = true;
+    }
+  }
+  char *hello = leptonet_malloc(5);
+  memcpy(hello, "hello", 5);
+  struct socket_buffer buf = {.id = id, .buffer = hello, .sz = 5};
+  socket_server_sendhigh(ss, &buf);
+  ASSERT_EQ(SOCKET_DATA, socket_server_poll(ss, &sm));
+  ASSERT_EQ(accepted, sm.id);
+  ASSERT_EQ(5, sm.ud);
+  ASSERT_EQ(0, memcmp(sm.buffer, "hello", 5));
+  socket_server_buffer_free(sm.buffer);
+
+  // nobody listens there
+  int refused = socket_server_connect(ss, "127.0.0.1", "17329", 3);
+  ASSERT_EQ(SOCKET_ERR, socket_server_poll(ss, &sm));
+  ASSERT_EQ(refused, sm.id);
+  // name which can't be resolved
+  int unknown = socket_server_connect(ss, "no-such-host.invalid", TEST_PORT, 4);
+  ASSERT_EQ(SOCKET_ERR, socket_server_poll(ss, &sm));
+  ASSERT_EQ(unknown, sm.id);
+  ASSERT_EQ(4, sm.opaque);
+  socket_server_release(ss);
+
+  TEST_END;
+}
+
+struct resolver_hold {
+  ATOMIC_INT held;
+  ATOMIC_INT release;
+};
+
+// keep a resolver thread until it's released, so that later names wait in queue
+static void hold_resolver(void *ud, const struct socket_resolved *r) {
+  (void)r;
+  struct resolver_hold *h = ud;
+  ATOMIC_INC(&h->held);
+  while (ATOMIC_LOAD_ACQ(&h->release) == 0) {
+    usleep(1000);
+  }
+}
+
+bool test_socket_server_connect_close() {
+  TEST_BEGIN;
+
+  struct socket_server *ss = socket_server_create(0);
+  struct socket_message sm;
+  // names are cached, the one of connect mustn't be resolved before
+  socket_server_listen(ss, "127.0.0.1", "17333", 32, 1);
+  ASSERT_EQ(SOCKET_OPEN, socket_server_poll(ss, &sm));
+
+  // names which aren't cached, each of them holds a resolver thread
+  static struct resolver_hold hold;
+  socket_resolver_query("127.0.0.1", "17331", SOCK_STREAM, false, hold_resolver, &hold);
+  socket_resolver_query("127.0.0.1", "17332", SOCK_STREAM, false, hold_resolver, &hold);
+  while (ATOMIC_LOAD_ACQ(&hold.held) < SOCKET_RESOLVER_THREADS) {
+    usleep(1000);
+  }
+  // it's closed while its name is being resolved, so it's never connected
+  int id = socket_server_connect(ss, "127.0.0.1", "17333", 2);
+  ASSERT_NE(-1, id);
+  socket_server_close(ss, id, SHUT_RDWR, 3);
+  ATOMIC_STORE_REL(&hold.release, 1);
+  ASSERT_EQ(SOCKET_CLOSE, socket_server_poll(ss, &sm));
+  ASSERT_EQ(id, sm.id);
+  ASSERT_EQ(3, sm.opaque);
+  socket_server_release(ss);
+
+  TEST_END;
+}
+
+#define SLOW_CHUNK (1024 * 1024)
+#define SLOW_CHUNKS 32
+
+struct slow_reader {
+  struct socket_server *ss;
+  int fd;
+  size_t recvd;
+};
+
+static void* slow_read(void *ud) {
+  struct slow_reader *r = ud;
+  static char buf[64 * 1024];
+  while (r->recvd < SLOW_CHUNK * SLOW_CHUNKS) {
+    int cnt = recv(r->fd, buf, sizeof buf, 0);
+    if (cnt <= 0) {
+      break;
+    }
+    r->recvd += cnt;
+  }
+  socket_server_exit(r->ss);
+  return NULL;
+}
+
+bool test_socket_server_watermark() {
+  TEST_BEGIN;
+
+  struct socket_server *ss = socket_server_create(0);
+  struct socket_message sm;
+  socket_server_listen(ss, "127.0.0.1", TEST_PORT, 32, 1);
+  ASSERT_EQ(SOCKET_OPEN, socket_server_poll(ss, &sm));
+  // a is a slow reader, b is the peer of a proxy, its reads are paused while a is warned
+  int a = client_connect();
+  ASSERT_EQ(SOCKET_ACCEPT, socket_server_poll(ss, &sm));
+  leptonet_free(sm.buffer);
+  int a_id = (int)sm.ud;
+  int b = client_connect();
+  ASSERT_EQ(SOCKET_ACCEPT, socket_server_poll(ss, &sm));
+  leptonet_free(sm.buffer);
+  int b_id = (int)sm.ud;
+
+  socket_server_watermark(ss, a_id, SLOW_CHUNK, SLOW_CHUNK / 4, b_id);
+  for (int i = 0; i < SLOW_CHUNKS; i ++) {
+    char *data = leptonet_malloc(SLOW_CHUNK);
+    memset(data, i, SLOW_CHUNK);
+    struct socket_buffer buf = {.id = a_id, .buffer = data, .sz = SLOW_CHUNK};
+    socket_server_sendlow(ss, &buf);
+  }
+  ASSERT_EQ(SOCKET_WARNING, socket_server_poll(ss, &sm));
+  ASSERT_EQ(a_id, sm.id);
+  ASSERT_EQ(true, (sm.ud >= SLOW_CHUNK));
+
+  ASSERT_EQ(1, send(b, "x", 1, 0));
+  struct slow_reader reader = {.ss = ss, .fd = a};
+  pthread_t pid;
+  pthread_create(&pid, NULL, slow_read, &reader);
+  bool resumed = false, b_data = false;
+  int type;
+  while ((type = socket_server_poll(ss, &sm)) != SOCKET_EXIT) {
+    if (type == SOCKET_WARNING) {
+      ASSERT_EQ(a_id, sm.id);
+      ASSERT_EQ(0, sm.ud);
+      resumed = true;
+    } else {
+      ASSERT_EQ(SOCKET_DATA, type);
+      ASSERT_EQ(b_id, sm.id);
+      // b is read only after a drains
+      ASSERT_EQ(true, resumed);
+      socket_server_buffer_free(sm.buffer);
+      b_data = true;
+    }
+  }
+  pthread_join(pid, NULL);
+  ASSERT_EQ(SLOW_CHUNK * SLOW_CHUNKS, reader.recvd);
+  ASSERT_EQ(true, resumed);
+  if (!b_data) {
+    // with io_uring, b is read by a completion which may come after exit request of reader
+    ASSERT_EQ(SOCKET_DATA, socket_server_poll(ss, &sm));
+    ASSERT_EQ(b_id, sm.id);
+    socket_server_buffer_free(sm.buffer);
+    b_data = true;
+  }
+  ASSERT_EQ(true, b_data);
+  close(a);
+  close(b);
+  socket_server_release(ss);
+
+  TEST_END;
+}
+
+#define DIRECT_SIZE (8 * 1024 * 1024)
+
+struct direct_reader {
+  struct socket_server *ss;
+  int fd;
+  bool ok;
+};
+
+// reads the large buffer and the tail after it, in order
+static void* direct_read(void *ud) {
+  struct direct_reader *r = ud;
+  static char buf[DIRECT_SIZE + 4];
+  size_t recvd = 0;
+  while (recvd < sizeof buf) {
+    int cnt = recv(r->fd, buf + recvd, sizeof buf - recvd, 0);
+    if (cnt <= 0) {
+      break;
+    }
+    recvd += cnt;
+  }
+  r->ok = recvd == sizeof buf && memcmp(buf + DIRECT_SIZE, "tail", 4) == 0;
+  for (size_t i = 0; r->ok && i < DIRECT_SIZE; i += 4096) {
+    r->ok = buf[i] == (char)(i >> 12);
+  }
+  socket_server_exit(r->ss);
+  return NULL;
+}
+
+static void send_string(struct socket_server *ss, int id, const char *str) {
+  size_t sz = strlen(str);
+  char *data = leptonet_malloc(sz);
+  memcpy(data, str, sz);
+  struct socket_buffer buf = {.id = id, .buffer = data, .sz = (int)sz};
+  socket_server_sendhigh(ss, &buf);
+}
+
+bool test_socket_server_direct() {
+  TEST_BEGIN;
+
+  struct socket_server *ss = socket_server_create(0);
+  struct socket_message sm;
+  socket_server_listen(ss, "127.0.0.1", TEST_PORT, 32, 1);
+  ASSERT_EQ(SOCKET_OPEN, socket_server_poll(ss, &sm));
+  int fd = client_connect_rcvbuf(4096);
+  ASSERT_EQ(SOCKET_ACCEPT, socket_server_poll(ss, &sm));
+  leptonet_free(sm.buffer);
+  int id = (int)sm.ud;
+
+  // nothing is queued, so it's sent by this thread, without polling
+  send_string(ss, id, "ping");
+  char in[4];
+  ASSERT_EQ(4, recv(fd, in, 4, MSG_WAITALL));
+  ASSERT_EQ(0, memcmp(in, "ping", 4));
+
+  // requests are handled in order, so watermark is set once udp socket is opened
+  socket_server_watermark(ss, id, DIRECT_SIZE / 4, DIRECT_SIZE / 16, -1);
+  socket_server_udp(ss, "127.0.0.1", "0", 2);
+  ASSERT_EQ(SOCKET_OPEN, socket_server_poll(ss, &sm));
+  ASSERT_EQ(2, sm.opaque);
+
+  // socket buffer takes a part of it, and socket thread sends the rest before the tail
+  char *data = leptonet_malloc(DIRECT_SIZE);
+  for (size_t i = 0; i < DIRECT_SIZE; i ++) {
+    data[i] = (char)(i >> 12);
+  }
+  struct socket_buffer buf = {.id = id, .buffer = data, .sz = DIRECT_SIZE};
+  socket_server_sendhigh(ss, &buf);
+  // remainder parked by direct write counts in buffered bytes before socket thread takes it
+  ASSERT_EQ(SOCKET_WARNING, socket_server_poll(ss, &sm));
+  ASSERT_EQ(id, sm.id);
+  ASSERT_EQ(true, (sm.ud >= DIRECT_SIZE / 4));
+  send_string(ss, id, "tail");
+  struct direct_reader reader = {.ss = ss, .fd = fd};
+  pthread_t pid;
+  pthread_create(&pid, NULL, direct_read, &reader);
+  int type;
+  bool resumed = false;
+  while ((type = socket_server_poll(ss, &sm)) != SOCKET_EXIT) {
+    ASSERT_EQ(SOCKET_WARNING, type);
+    ASSERT_EQ(0, sm.ud);
+    resumed = true;
+  }
+  pthread_join(pid, NULL);
+  ASSERT_EQ(true, reader.ok);
+  ASSERT_EQ(true, resumed);
+  close(fd);
+  socket_server_release(ss);
+
+  TEST_END;
+}
+
+#define LISTS_FILL (4 * 1024 * 1024)
+#define LISTS_QUEUED 64
+#define LISTS_SENT 256
+#define LISTS_HIGH 0x80000000u
+
+// each record is seq, length and a payload of seq, high records have LISTS_HIGH in seq
+struct lists_record {
+  uint32_t seq;
+  uint32_t sz;
+};
+
+static uint32_t lists_size(uint32_t i) {
+  return (i * 37 % 64 + 1) * 1024 + i % 7;
+}
+
+static void lists_send(struct socket_server *ss, int id, uint32_t seq, uint32_t sz) {
+  char *data = leptonet_malloc(sizeof(struct lists_record) + sz);
+  struct lists_record rec = {.seq = seq, .sz = sz};
+  memcpy(data, &rec, sizeof rec);
+  memset(data + sizeof rec, (char)seq, sz);
+  struct socket_buffer buf = {.id = id, .buffer = data, .sz = (int)(sizeof rec + sz)};
+  if (seq & LISTS_HIGH) {
+    socket_server_sendhigh(ss, &buf);
+  } else {
+    socket_server_sendlow(ss, &buf);
+  }
+}
+
+struct lists_sender {
+  struct socket_server *ss;
+  int id;
+};
+
+// high buffers come while a low one is written partially, reader is slowed by its small receive buffer
+static void* lists_send_more(void *ud) {
+  struct lists_sender *p = ud;
+  for (uint32_t i = LISTS_QUEUED; i < LISTS_QUEUED + LISTS_SENT; i ++) {
+    lists_send(p->ss, p->id, i | LISTS_HIGH, lists_size(i));
+    lists_send(p->ss, p->id, i, lists_size(i + 1));
+    usleep(500);
+  }
+  return NULL;
+}
+
+struct lists_reader {
+  struct socket_server *ss;
+  int fd;
+  bool ok;
+};
+
+static bool lists_recv(int fd, void *buf, size_t sz) {
+  return recv(fd, buf, sz, MSG_WAITALL) == (ssize_t)sz;
+}
+
+// records must arrive whole, in order of each list, and queued high ones before queued low ones
+static void* lists_read(void *ud) {
+  struct lists_reader *r = ud;
+  static char payload[LISTS_FILL];
+  uint32_t high = 0, low = 0;
+  struct lists_record rec;
+  r->ok = lists_recv(r->fd, &rec, sizeof rec) && rec.seq == LISTS_HIGH && rec.sz == LISTS_FILL &&
+    lists_recv(r->fd, payload, LISTS_FILL);
+  while (r->ok && (high < LISTS_QUEUED + LISTS_SENT - 1 || low < LISTS_QUEUED + LISTS_SENT)) {
+    r->ok = lists_recv(r->fd, &rec, sizeof rec);
+    if (!r->ok) {
+      break;
+    }
+    uint32_t i = rec.seq & ~LISTS_HIGH;
+    if (rec.seq & LISTS_HIGH) {
+      r->ok = i == high + 1 && rec.sz == lists_size(i);
+      high = i;
+    } else {
+      r->ok = i == low && rec.sz == lists_size(i + 1) && (i >= LISTS_QUEUED || high >= LISTS_QUEUED - 1);
+      low = i + 1;
+    }
+    r->ok = r->ok && lists_recv(r->fd, payload, rec.sz);
+    for (uint32_t j = 0; r->ok && j < rec.sz; j ++) {
+      r->ok = payload[j] == (char)rec.seq;
+    }
+  }
+  socket_server_exit(r->ss);
+  return NULL;
+}
+
+bool test_socket_server_lists() {
+  TEST_BEGIN;
+
+  struct socket_server *ss = socket_server_create(0);
+  struct socket_message sm;
+  socket_server_listen(ss, "127.0.0.1", TEST_PORT, 32, 1);
+  ASSERT_EQ(SOCKET_OPEN, socket_server_poll(ss, &sm));
+  int fd = client_connect_rcvbuf(4096);
+  ASSERT_EQ(SOCKET_ACCEPT, socket_server_poll(ss, &sm));
+  leptonet_free(sm.buffer);
+  int id = (int)sm.ud;
+
+  // the first one fills socket buffer, so the rest are queued in write lists
+  lists_send(ss, id, LISTS_HIGH, LISTS_FILL);
+  for (uint32_t i = 1; i < LISTS_QUEUED; i ++) {
+    lists_send(ss, id, i | LISTS_HIGH, lists_size(i));
+    lists_send(ss, id, i - 1, lists_size(i));
+  }
+  lists_send(ss, id, LISTS_QUEUED - 1, lists_size(LISTS_QUEUED));
+  // requests are handled in order, so all of them are queued once udp socket is opened
+  socket_server_udp(ss, "127.0.0.1", "0", 2);
+  ASSERT_EQ(SOCKET_OPEN, socket_server_poll(ss, &sm));
+
+  struct lists_reader reader = {.ss = ss, .fd = fd};
+  struct lists_sender sender = {.ss = ss, .id = id};
+  pthread_t rpid, spid;
+  pthread_create(&rpid, NULL, lists_read, &reader);
+  pthread_create(&spid, NULL, lists_send_more, &sender);
+  int type;
+  while ((type = socket_server_poll(ss, &sm)) != SOCKET_EXIT) {
+    ASSERT_NE(SOCKET_ERR, type);
+  }
+  pthread_join(spid, NULL);
+  pthread_join(rpid, NULL);
+  ASSERT_EQ(true, reader.ok);
+  close(fd);
+  socket_server_release(ss);
+
+  TEST_END;
+}
+
+bool test_socket_server_backend() {
+  TEST_BEGIN;
+
+  struct socket_server *ss = socket_server_create(0);
+  ASSERT_NE(NULL, ss);
+#ifdef LEPTONET_USE_IO_URING
+  // reads and writes of other tests are io_uring completions, it mustn't fall back to epoll here
+  ASSERT_EQ(0, strcmp(socket_server_backend(ss), "io_uring"));
+#else
+  ASSERT_EQ(0, strcmp(socket_server_backend(ss), "epoll"));
+#endif
+  socket_server_release(ss);
+
+  TEST_END;
+}
+
+TEST_REGIST(socketservertest, echo, test_socket_server_echo);
+TEST_REGIST(socketservertest, zerocopy, test_socket_server_zerocopy);
+TEST_REGIST(socketservertest, zerocopyclose, test_socket_server_zerocopy_close);
+TEST_REGIST(socketservertest, readcopy, test_socket_server_readcopy);
+TEST_REGIST(socketservertest, idle, test_socket_server_idle);
+TEST_REGIST(socketservertest, senders, test_socket_server_senders);
+TEST_REGIST(socketservertest, shed, test_socket_server_shed);
+TEST_REGIST(socketservertest, udp, test_socket_server_udp);
+TEST_REGIST(socketservertest, connect, test_socket_server_connect);
+TEST_REGIST(socketservertest, connectclose, test_socket_server_connect_close);
+TEST_REGIST(socketservertest, watermark, test_socket_server_watermark);
+TEST_REGIST(socketservertest, direct, test_socket_server_direct);
+TEST_REGIST(socketservertest, lists, test_socket_server_lists);
+TEST_REGIST(socketservertest, backend, test_socket_server_backend);